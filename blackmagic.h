@@ -56,3 +56,20 @@ enum INPUT_SOURCE {
 	INPUT_COMPOSITE,
 	INPUT_SVIDEO,
 };
+
+/* FX2 status, byte 5 of a status (0x01) message on endpoint 0x88 */
+enum {
+	FX2Status_Unknown = 0,
+	FX2Status_NotPowered,
+	FX2Status_UpdatingFirmware,
+	FX2Status_Programming,
+	FX2Status_Booting,
+	FX2Status_Idle,
+	FX2Status_PreparingEncode,
+	FX2Status_Encoding,
+	FX2Status_PreparingNullOutput,
+	FX2Status_NullOutput,
+	FX2Status_PreparingStop,
+	FX2Status_Stopped,
+	FX2Status_InvalidFPGA
+};
@@ -0,0 +1,225 @@
+/* BlackMagic Design tools - time-shift buffer reader
+ *
+ * Copies a stretch of a bmd-streamer time-shift buffer (--dvr) to
+ * stdout: from a number of seconds before live or from a wall clock
+ * time, until a duration or wall clock time has passed, or following
+ * live otherwise. Output starts with the latest PAT and PMT followed by
+ * a random access point, so that it plays from the first byte. The
+ * buffer is mapped read-only and never touched; data overwritten before
+ * it could be copied ends the output with an error.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "mpegts.h"
+#include "dvr.h"
+
+#define CHUNK_SIZE	(256*1024)
+#define POLL_MS		20
+
+static volatile int running = 1;
+
+static void dostop(int sig)
+{
+	running = 0;
+}
+
+static int usage(void)
+{
+	fprintf(stderr,
+		"usage: bmd-dvrcat [OPTIONS] FILE.dvr > clip.ts\n"
+		"	-a,--ago SECONDS	Start this much stream time before live\n"
+		"	-f,--from TIME		Start at this wall clock time\n"
+		"	-d,--duration SECONDS	Stop after this much stream time\n"
+		"	-t,--to TIME		Stop at this wall clock time\n"
+		"	-i,--info		Show what the buffer holds and exit\n"
+		"Without a start the output starts at the latest random access point,\n"
+		"without a stop it follows live. TIME is \"YYYY-MM-DD HH:MM:SS\",\n"
+		"\"HH:MM:SS\" of today or @UNIXTIME.\n");
+	return 1;
+}
+
+static int parse_time(const char *s, int64_t *us)
+{
+	struct tm tm;
+	time_t t;
+	char *end;
+
+	if (s[0] == '@') {
+		*us = (int64_t) (strtod(&s[1], &end) * 1e6);
+		return *end == 0;
+	}
+	t = time(NULL);
+	localtime_r(&t, &tm);
+	end = strptime(s, "%Y-%m-%d %H:%M:%S", &tm);
+	if (!end || *end) {
+		localtime_r(&t, &tm);
+		end = strptime(s, "%H:%M:%S", &tm);
+	}
+	if (!end || *end)
+		return 0;
+	tm.tm_isdst = -1;
+	*us = (int64_t) mktime(&tm) * 1000000;
+	return 1;
+}
+
+static void format_time(int64_t us, char *buf, size_t size)
+{
+	struct tm tm;
+	time_t t = us / 1000000;
+
+	localtime_r(&t, &tm);
+	strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+static int write_all(const unsigned char *p, size_t len)
+{
+	ssize_t r;
+
+	while (len) {
+		r = write(1, p, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return 0;
+		p += r;
+		len -= r;
+	}
+	return 1;
+}
+
+static int info(struct dvr *d)
+{
+	struct dvr_header *h = d->hdr;
+	struct dvr_index first, last;
+	char t1[32], t2[32];
+
+	printf("buffer: %llu MB, %u index entries, %llu MB written\n",
+	       (unsigned long long) h->data_size >> 20, h->index_size,
+	       (unsigned long long) dvr_head(d) >> 20);
+	if (!dvr_find(d, DVR_KEY_PCR, 0, 1, &first) || !dvr_find(d, DVR_KEY_PCR, INT64_MAX, 0, &last)) {
+		printf("no random access points\n");
+		return 0;
+	}
+	format_time(first.time_us, t1, sizeof(t1));
+	format_time(last.time_us, t2, sizeof(t2));
+	printf("random access points: %s to %s, %.1f s of stream time\n", t1, t2,
+	       (double) (last.pcr - first.pcr) / TS_PCR_HZ);
+	format_time(h->time_us, t1, sizeof(t1));
+	printf("last write: %s, live is %.1f s past the latest random access point\n", t1,
+	       (double) (h->pcr - last.pcr) / TS_PCR_HZ);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option long_options[] = {
+		{ "ago",	required_argument, NULL, 'a' },
+		{ "from",	required_argument, NULL, 'f' },
+		{ "duration",	required_argument, NULL, 'd' },
+		{ "to",		required_argument, NULL, 't' },
+		{ "info",	no_argument, NULL, 'i' },
+		{ NULL }
+	};
+	const char *optstring = "a:f:d:t:i";
+	static unsigned char buf[CHUNK_SIZE];
+	unsigned char pat[TS_PACKET_SIZE], pmt[TS_PACKET_SIZE];
+	struct timespec poll = { 0, POLL_MS * 1000000 };
+	struct dvr_index start, stop;
+	struct dvr d;
+	double ago = -1, duration = -1;
+	int64_t from_us = -1, to_us = -1;
+	uint64_t pos, end = UINT64_MAX;
+	ssize_t n;
+	int opt, show_info = 0, found;
+
+	while ((opt = getopt_long(argc, argv, optstring, long_options, NULL)) > 0) {
+		switch (opt) {
+		case 'a': ago = atof(optarg); break;
+		case 'd': duration = atof(optarg); break;
+		case 'f':
+			if (!parse_time(optarg, &from_us))
+				return usage();
+			break;
+		case 't':
+			if (!parse_time(optarg, &to_us))
+				return usage();
+			break;
+		case 'i': show_info = 1; break;
+		default:
+			return usage();
+		}
+	}
+	if (optind + 1 != argc || (ago >= 0 && from_us >= 0) || (duration >= 0 && to_us >= 0))
+		return usage();
+
+	if (!dvr_open(&d, argv[optind])) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+	if (show_info)
+		return info(&d);
+
+	signal(SIGINT, dostop);
+	signal(SIGTERM, dostop);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* The start point may not have been written yet when following */
+	for (;;) {
+		if (from_us >= 0)
+			found = dvr_find(&d, DVR_KEY_TIME, from_us, 0, &start) ||
+				dvr_find(&d, DVR_KEY_TIME, from_us, 1, &start);
+		else
+			found = dvr_find(&d, DVR_KEY_PCR,
+					 ago > 0 ? (int64_t) (d.hdr->pcr - ago * TS_PCR_HZ) : INT64_MAX,
+					 0, &start) ||
+				dvr_find(&d, DVR_KEY_PCR, 0, 1, &start);
+		if (found || !running)
+			break;
+		nanosleep(&poll, NULL);
+	}
+	if (!found) {
+		dvr_close(&d);
+		return 1;
+	}
+
+	if (dvr_psi(&d, pat, pmt) && (!write_all(pat, sizeof(pat)) || !write_all(pmt, sizeof(pmt))))
+		return 0;
+
+	for (pos = start.pos; running && pos < end; ) {
+		/* Stop at the first random access point past the end */
+		if (end == UINT64_MAX && (duration >= 0 || to_us >= 0)) {
+			if (duration >= 0)
+				found = dvr_find(&d, DVR_KEY_PCR, start.pcr + (int64_t) (duration * TS_PCR_HZ),
+						 1, &stop);
+			else
+				found = dvr_find(&d, DVR_KEY_TIME, to_us, 1, &stop);
+			if (found)
+				end = stop.pos;
+		}
+		n = dvr_read(&d, pos, buf, end - pos < sizeof(buf) ? end - pos : sizeof(buf));
+		if (n < 0) {
+			fprintf(stderr, "%s: overwritten before it could be read\n", argv[optind]);
+			dvr_close(&d);
+			return 1;
+		}
+		if (n == 0) {
+			nanosleep(&poll, NULL);
+			continue;
+		}
+		if (!write_all(buf, n))
+			break;
+		pos += n;
+	}
+	dvr_close(&d);
+	return 0;
+}
@@ -17,19 +17,37 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <limits.h>
 #include <signal.h>
 #include <string.h>
 #include <syslog.h>
-#include <pthread.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/vfs.h>
+#include <netdb.h>
+#include <linux/magic.h>
+#include <time.h>
 
 #include <libusb.h>
 
 #include "blackmagic.h"
+#include "mpegts.h"
+#include "tsnet.h"
+#include "hls.h"
+#include "record.h"
+#include "dvr.h"
+#include "hist.h"
+#include "tsring.h"
+#include "tsout.h"
+#include "fx2emu.h"
 
 #define VERSION "1.0.2"
 
@@ -37,26 +55,80 @@
  * TODO and ideas:
  * - Get VR_SET_AUDIO_DELAY for remaining modes from USB traces
  * - Selecting capture target format - now it's "Native (Progressive)"
- * - Make the capture thread cancellable
  */
 
 #define array_size(x) (sizeof(x) / sizeof(x[0]))
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define BMD_MAX_OUTPUTS	8
+
+enum OUTPUT_TYPE {
+	OUTPUT_PIPE = 0,
+	OUTPUT_UDP,
+	OUTPUT_RTP,
+	OUTPUT_HTTP,
+};
+
+/* A stream consumer: stdout, a program fed through a pipe, a UDP or RTP
+ * destination, or the clients of the HTTP server */
+struct output_spec {
+	int		type;
+	char *		exec_program;
+	char *		dest;
+	struct sockaddr_storage addr;
+	socklen_t	addrlen;
+	unsigned int	lag_kb;
+	int		lag_policy;
+	int		mcast_ttl;
+	char *		mcast_if;
+	int		udp_gso;
+};
 
 struct encoding_parameters {
 	uint16_t	video_kbps, video_max_kbps, audio_kbps, audio_khz;
 	uint8_t		h264_profile, h264_level, h264_bframes, h264_cabac, fps_divider;
 	int8_t		input_source;
-	char *		exec_program;
+	struct output_spec outputs[BMD_MAX_OUTPUTS];
+	int		num_outputs;
+	unsigned int	lag_kb;
+	int		lag_policy;
+	int		mcast_ttl;
+	char *		mcast_if;
+	int		udp_gso;
 	int		respawn : 1;
+	int		persist : 1;
+	int		rebase : 1;
 	int		pipe_sz;
+	int		usb_transfers;
+	int		ring_kb;
+	int		vmsplice;
+	char *		hls_dir;
+	double		hls_time;
+	int		hls_list_size;
+	struct rec_config record;
+	char *		dvr_dir;
+	int		dvr_minutes;
 	int		src_x, src_y, src_width, src_height, dst_width, dst_height;
+	int		emulate;
+	char *		emulate_ts;
+	unsigned int	emulate_kbps;
 };
 
+/* PIDs the encoder is programmed to use */
+#define BMD_PID_PMT	0x0100
+#define BMD_PID_SIT	0x001f
+#define BMD_PID_PCR	0x1001
+#define BMD_PID_VIDEO	0x1011
+#define BMD_PID_AUDIO	0x1100
+
 static int do_syslog = 0;
 static int loglevel = LOG_NOTICE;
 static int firmware_fd = AT_FDCWD;
 static int running = 1;
-static volatile int num_workers = 0;
+static int dump_stats = 0;
+static int verify_registers = 0;
+static struct ts_filter pid_filter;
+static libusb_context *usb_ctx;
 static struct encoding_parameters ep = {
 	.video_kbps = 3000,
 	.video_max_kbps = 3500,
@@ -68,6 +140,12 @@ static struct encoding_parameters ep = {
 	.audio_khz = 48000,
 	.fps_divider = 1,
 	.input_source = -1,
+	.usb_transfers = 8,
+	.ring_kb = 4096,
+	.hls_time = 6,
+	.hls_list_size = 6,
+	.record = { .buffer_kb = REC_BUFFER_KB, .buffers = REC_BUFFERS },
+	.dvr_minutes = 10,
 };
 
 static const char *input_source_names[5] = {
@@ -266,22 +344,6 @@ static struct display_mode *display_modes[DMODE_MAX] = {
 	},
 };
 
-enum {
-	FX2Status_Unknown = 0,
-	FX2Status_NotPowered,
-	FX2Status_UpdatingFirmware,
-	FX2Status_Programming,
-	FX2Status_Booting,
-	FX2Status_Idle,
-	FX2Status_PreparingEncode,
-	FX2Status_Encoding,
-	FX2Status_PreparingNullOutput,
-	FX2Status_NullOutput,
-	FX2Status_PreparingStop,
-	FX2Status_Stopped,
-	FX2Status_InvalidFPGA
-};
-
 static const char* FX2Status_to_String(int s)
 {
 	switch (s) {
@@ -358,114 +420,272 @@ static void dlog(int prio, const char *format, ...)
 	va_end(va);
 }
 
+static int64_t elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+	return (int64_t)(to->tv_sec - from->tv_sec) * 1000000 +
+		(to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+/* Everything runs from a single epoll loop: libusb pollfds, device
+ * output fds and timers. Sources register an event_handler whose
+ * callback is invoked with the ready epoll events. */
+struct event_handler {
+	int		fd;
+	uint32_t	events;
+	void		(*handler)(struct event_handler *eh, uint32_t events);
+};
+
+static int epoll_fd = -1;
+
+static int event_update(struct event_handler *eh, uint32_t events)
+{
+	struct epoll_event ev = { .events = events, .data.ptr = eh };
+	int r;
+
+	if (events == eh->events)
+		return 0;
+	if (events == 0)
+		r = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, eh->fd, NULL);
+	else if (eh->events == 0)
+		r = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, eh->fd, &ev);
+	else
+		r = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, eh->fd, &ev);
+	if (r == 0)
+		eh->events = events;
+	return r;
+}
+
+/* Firmware images are loaded on first use and kept pre-parsed as runs of
+ * contiguous addresses, so the upload needs one control transfer per run
+ * instead of one per record. The FX2 loader takes up to 4kB per request. */
+#define FX2_LOAD_MAX	4096
+
+struct firmware_run {
+	uint16_t	addr, len;
+	uint8_t		*data;
+};
+
 struct firmware {
-	uint32_t	size;
+	const char *	filename;
 	uint16_t	device_id;
-	uint8_t		data[];
+	int		loaded;
+	int		num_records, num_runs;
+	struct firmware_run *runs;
+	uint8_t		*data;
 };
 
-static struct firmware *firmwares[2];
+static struct firmware firmwares[] = {
+	{ "bmd-atemtvstudio.bin", USB_PID_BMD_ATEM_TV_STUDIO },
+	{ "bmd-h264prorecorder.bin", USB_PID_BMD_H264_PRO_RECORDER },
+};
 
-static struct firmware *load_firmware(const char *filename, uint16_t device_id)
+static int load_firmware(struct firmware *fw)
 {
-	struct firmware *fw;
+	struct _fwhdr { uint8_t len, addr_high, addr_low, marker, data[]; };
+	struct _fwhdr *fwhdr;
+	struct firmware_run *run = NULL;
 	struct stat st;
-	int r, fd;
+	uint8_t *map, *out;
+	uint16_t addr;
+	size_t pos;
+	int fd;
 
-	r = fstatat(firmware_fd, filename, &st, 0);
-	if (r != 0) {
-		dlog(LOG_ERR, "%s: failed to load firmware to memory", filename);
-		return NULL;
-	}
+	fd = openat(firmware_fd, fw->filename, O_RDONLY|O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+		goto error;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		goto error;
 
-	fw = malloc(sizeof(struct firmware) + st.st_size);
-	if (fw == NULL)
-		return NULL;
+	/* At most one run per record, and never more data than the file */
+	fw->runs = calloc(st.st_size / 5 + 1, sizeof(struct firmware_run));
+	fw->data = out = malloc(st.st_size);
+	if (fw->runs == NULL || fw->data == NULL)
+		goto error_unmap;
 
-	fw->size = st.st_size;
-	fw->device_id = device_id;
+	for (pos = 0; pos + 4 <= st.st_size; pos += fwhdr->len + 5) {
+		fwhdr = (struct _fwhdr *) &map[pos];
+		if (fwhdr->marker != 0 || pos + 4 + fwhdr->len > st.st_size)
+			break;
+		addr = (fwhdr->addr_high << 8) + fwhdr->addr_low;
+		if (run == NULL || run->addr + run->len != addr ||
+		    run->len + fwhdr->len > FX2_LOAD_MAX) {
+			run = &fw->runs[fw->num_runs++];
+			run->addr = addr;
+			run->len = 0;
+			run->data = out;
+		}
+		memcpy(out, fwhdr->data, fwhdr->len);
+		out += fwhdr->len;
+		run->len += fwhdr->len;
+		fw->num_records++;
+	}
 
-	fd = openat(firmware_fd, filename, O_RDONLY);
-	if (fd < 0)
-		goto error;
-	if (read(fd, fw->data, fw->size) != fw->size)
-		goto error;
+	munmap(map, st.st_size);
 	close(fd);
-	return fw;
+	dlog(LOG_INFO, "%s: %d records in %d runs", fw->filename, fw->num_records, fw->num_runs);
+	return 1;
+
+error_unmap:
+	munmap(map, st.st_size);
 error:
-	close(fd);
-	free(fw);
-	return NULL;
+	dlog(LOG_ERR, "%s: failed to load firmware to memory", fw->filename);
+	if (fd >= 0)
+		close(fd);
+	free(fw->runs);
+	free(fw->data);
+	fw->runs = NULL;
+	fw->data = NULL;
+	fw->num_runs = fw->num_records = 0;
+	return 0;
+}
+
+static struct firmware *get_firmware(uint16_t device_id)
+{
+	struct firmware *fw = NULL;
+	int i;
+
+	for (i = 0; i < array_size(firmwares); i++) {
+		if (firmwares[i].device_id != device_id)
+			continue;
+		/* A failure is not remembered: the file may be installed or
+		 * readable by the time the next device needs it */
+		if (!firmwares[i].loaded)
+			firmwares[i].loaded = load_firmware(&firmwares[i]);
+		if (firmwares[i].loaded)
+			fw = &firmwares[i];
+		break;
+	}
+
+	return fw;
 }
 
-struct mpeg_parser_buffer {
-	int output_fd;
-	int oldlen;
-	unsigned char olddata[0xbc];
+/* Bulk transfers kept in flight on the MPEG-TS endpoint. Completed
+ * transfers are parsed and resubmitted from the completion callback,
+ * so the endpoint always has a transfer pending. */
+struct mpegts_transfer {
+	struct blackmagic_device *bmd;
+	struct libusb_transfer *transfer;
+	struct timespec submitted;
+	int held;		/* not resubmitted, see bmd_mpegts_resume() */
+	unsigned char headroom[0xbc];
 	unsigned char data[16*1024];
 };
 
-static int mpegparser_parse(struct mpeg_parser_buffer *pb, int newlen)
-{
-	struct iovec iov[64];
-	unsigned char *buf = &pb->data[-pb->oldlen];
-	int i = 0, len = newlen + pb->oldlen, r = 0, ioc = 0, nomerge = 1;
+struct mpegts_stats {
+	uint64_t	bytes, transfers, timeouts;
+	uint64_t	latency_us, latency_max_us;
+};
 
-	while (i + 0xbc <= len) {
-		if (memcmp(&buf[i], "\x00\x00\x00\x00", 4) == 0) goto skip_block;
-		if (buf[i] != 0x47) {
-			while (buf[i] != 0x47 && i < len)
-				i++;
-			goto skip;
-		}
-		if (buf[i+1] == 0x1f && buf[i+2] == 0xff) goto skip_block;
-		if (pb->output_fd < 0 || r) {
-		skip_block:
-			i += 0xbc;
-		skip:
-			nomerge = 1;
-			continue;
-		}
+/* Running totals for /metrics, the stats above restart with every
+ * report. Everything runs on the event loop thread, so these are plain
+ * counters. */
+struct bmd_metrics {
+	uint64_t	usb_bytes, usb_transfers, usb_timeouts;
+	uint64_t	encoder_starts, respawns;
+	int64_t		configure_us, first_packet_us;	/* of the last encoder start */
+	uint64_t	http_bytes, http_lag_dropped;
+
+	/* Between USB transfer completions, and from the completion of the
+	 * transfer to that of the output write it was sent in */
+	struct hist	usb_interval, delivery;
+	int64_t		last_completion_us;
+};
 
-		if (nomerge) {
-			nomerge = 0;
-			iov[ioc].iov_base = &buf[i];
-			iov[ioc].iov_len = 0xbc;
-			if (++ioc >= array_size(iov)) {
-				if (writev(pb->output_fd, iov, ioc) < 0) {
-					dlog(LOG_NOTICE, "error writing MPEG TS: %s",
-						strerror(errno));
-					if (errno == EPIPE) r = -1;
-				}
-				ioc = 0;
-				nomerge = 1;
-			}
-		} else {
-			iov[ioc-1].iov_len += 0xbc;
-		}
-		i += 0xbc;
-	}
+/* Set of MB86H56 register writes, applied in insertion order */
+struct fujitsu_regimage {
+	int		count;
+	uint32_t	reg[128];
+	uint16_t	value[128];
+};
 
-	if (ioc && writev(pb->output_fd, iov, ioc) < 0) {
-		dlog(LOG_NOTICE, "error writing MPEG TS: %s",
-			strerror(errno));
-		if (errno == EPIPE) r = -1;
-	}
+/* Shadow copy of the MB86H56 registers written since the last encoder
+ * stop or chip reset, keyed by address. Registers only read, which
+ * include the status ones, are not kept. */
+#define FUJITSU_SHADOW_VALID	0x80000000
+struct fujitsu_shadow {
+	uint32_t	reg[256];
+	uint16_t	value[256];
+	unsigned int	hits, misses;
+};
 
-	pb->oldlen = len - i;
-	memcpy(&pb->data[-pb->oldlen], &buf[i], pb->oldlen);
-	return r;
-}
+struct bmd_output {
+	struct blackmagic_device *bmd;
+	const struct output_spec *spec;
+	int fd;
+	int splice : 1;
+	int blocking : 1;	/* the device is held back for it */
+	int block_expired : 1;	/* not waited for until it is within its limit */
+	int error;
+	uint32_t watch;		/* epoll events watched while not blocked */
+	struct ts_reader reader;
+	struct ts_udp udp;
+	struct event_handler event;
+	uint64_t dropped;
+	uint64_t bytes, errors, eagain;
+	uint64_t lag_dropped;	/* by readers before the current one */
+};
+
+/* Client of the built-in HTTP server. It sits on http_pending until its
+ * request names a device, then on the device's list as an output of its
+ * own. Other replies stay on http_pending while they are sent. Ring
+ * data is sent with MSG_ZEROCOPY where the socket supports it. */
+#define HTTP_REQUEST_MS		5000	/* for the request and a reply to it */
+
+struct http_client {
+	struct http_client *next;
+	struct bmd_output out;
+	char peer[64];
+	char req[1024];
+	int req_len;
+	struct timespec accepted;
+	char *reply;
+	size_t reply_len, reply_sent;
+	struct ts_tcp tcp;
+};
+
+/* Control requests are queued per device and sent one at a time */
+#define BMD_CTRL_QUEUE		1024
+#define BMD_CTRL_DATA		64
+
+#define BMD_CTRL_IGNORE		0x01	/* errors are not fatal */
+#define BMD_CTRL_FALLBACK	0x02	/* skipped once block writes are known to work */
+#define BMD_CTRL_CALL		0x04	/* no request, only the hook is called in turn */
+
+struct blackmagic_device;
+
+struct bmd_ctrl {
+	uint8_t		request_type, request;
+	uint16_t	value, index, length;
+	unsigned int	timeout;
+	int		flags;
+	/* Called with the length transferred or a libusb error */
+	void		(*done)(struct blackmagic_device *bmd, struct bmd_ctrl *c, int r);
+	uint32_t	reg;
+	uint16_t	arg;		/* for the hook */
+	const uint8_t	*ext;		/* longer data, kept by the caller */
+	uint8_t		data[BMD_CTRL_DATA];
+};
+
+enum BMD_STATE {
+	BMD_STATE_OPENING = 0,
+	BMD_STATE_RUNNING,
+	BMD_STATE_STOPPING,
+	BMD_STATE_CLOSING,
+};
 
 struct blackmagic_device {
+	struct blackmagic_device *next;
 	char name[64];
-	pthread_t device_thread, mpegts_thread;
-	volatile int running;
+	int state;
+	struct timespec state_time;
+	int running;
 	int status;
 	int fxstatus;
 	int recognized : 1;
 	int encode_sent : 1;
 	int display_mode_changed : 1;
+	int status_pending : 1;
 
 	int current_display_mode;
 	struct display_mode *current_mode;
@@ -473,13 +693,58 @@ struct blackmagic_device {
 	struct libusb_device_descriptor desc;
 	libusb_device *usbdev;
 	libusb_device_handle *usbdev_handle;
+	struct fx2emu *emu;
+	struct event_handler emu_event;
 
 	uint8_t mac[6];
 
+	struct fujitsu_shadow fujitsu_shadow;
+	int fujitsu_block_writes;
+	unsigned int fujitsu_writes, fujitsu_skipped;
+	struct timespec encode_start;
+	int first_packet_pending : 1;
+	int fujitsu_bad;
+	uint16_t dump[24];
+	struct firmware *firmware;
+	struct timespec firmware_start;
+
+	struct libusb_transfer *ctrl_transfer;
+	struct bmd_ctrl ctrl[BMD_CTRL_QUEUE];
+	unsigned int ctrl_head, ctrl_tail;
+	int ctrl_active, ctrl_running;
+	uint8_t ctrl_buffer[LIBUSB_CONTROL_SETUP_SIZE + FX2_LOAD_MAX];
+
+	struct libusb_transfer *message_transfer;
+	int message_active;
 	uint8_t message_buffer[1024];
+
 	struct mpeg_parser_buffer mpegparser;
+	struct ts_ring ring;
+	struct ts_join join;
+	struct ts_rebase rebase;
+	struct hls hls;
+	struct recorder rec;
+	struct event_handler rec_event;
+	struct dvr dvr;
+	struct bmd_output outputs[BMD_MAX_OUTPUTS];
+	int num_outputs;
+	struct http_client *http_clients;
+	char usb_ports[32];
+
+	struct mpegts_transfer *mpegts_transfers;
+	int mpegts_active;
+	int mpegts_held;
+	struct timespec mpegts_held_since;
+	struct mpegts_stats mpegts_stats;
+	struct timespec mpegts_stats_start;
+	struct bmd_metrics metrics;
+	struct ts_stats ts_stats;
+	uint64_t video_packets_reported;
+	uint32_t total_bandwidth;
 };
 
+static struct blackmagic_device *devices;
+
 static void reapchildren(int sig)
 {
 	int status;
@@ -487,114 +752,464 @@ static void reapchildren(int sig)
 	while (waitpid(-1, &status, WNOHANG) == 0 || errno == EINTR);
 }
 
+static void dodump(int sig)
+{
+	dump_stats = 1;
+}
+
 static void dostop(int sig)
 {
 	running = 0;
 }
 
-static void bmd_set_input_source(struct blackmagic_device *bmd, uint8_t mode)
+/* USB transport: the device, or the emulator standing in for it */
+static int bmd_submit(struct blackmagic_device *bmd, struct libusb_transfer *transfer)
 {
-	int r;
+	if (bmd->emu)
+		return emu_submit(bmd->emu, transfer);
+	return libusb_submit_transfer(transfer);
+}
+
+static int bmd_cancel(struct blackmagic_device *bmd, struct libusb_transfer *transfer)
+{
+	if (bmd->emu)
+		return emu_cancel(bmd->emu, transfer);
+	return libusb_cancel_transfer(transfer);
+}
+
+static int transfer_status_to_error(enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:	return LIBUSB_SUCCESS;
+	case LIBUSB_TRANSFER_TIMED_OUT:	return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:	return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:	return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:	return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_CANCELLED:	return LIBUSB_ERROR_INTERRUPTED;
+	default:			return LIBUSB_ERROR_IO;
+	}
+}
+
+/* Control requests never block the main loop: each is submitted from the
+ * completion of the one before, so programming or stopping one device
+ * does not hold up the streams of the others. Queueing does not send
+ * anything, bmd_ctrl_next() is called once a sequence is queued. A
+ * failed request without a hook fails the device and drops the rest of
+ * the queue. */
+static struct bmd_ctrl *bmd_ctrl_queue(struct blackmagic_device *bmd, int flags,
+				       uint8_t request_type, uint8_t request,
+				       uint16_t value, uint16_t index,
+				       const void *data, uint16_t length, unsigned int timeout)
+{
+	struct bmd_ctrl *c;
+
 	if (bmd->status != LIBUSB_SUCCESS)
-		return;
-	dlog(LOG_NOTICE, "%s: switching input source to %s (%d)",
-		bmd->name, input_source_names[mode], mode);
-	r = libusb_control_transfer(
-		bmd->usbdev_handle, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-		VR_SET_INPUT_SOURCE, 0x0000, 0, &mode, 1, 1000);
-	if (r < 0)
-		bmd->status = r;
+		return NULL;
+	if (bmd->ctrl_tail - bmd->ctrl_head >= BMD_CTRL_QUEUE) {
+		dlog(LOG_ERR, "%s: control request queue full", bmd->name);
+		bmd->status = LIBUSB_ERROR_NO_MEM;
+		return NULL;
+	}
+	c = &bmd->ctrl[bmd->ctrl_tail++ % BMD_CTRL_QUEUE];
+	memset(c, 0, offsetof(struct bmd_ctrl, data));
+	c->flags = flags;
+	c->request_type = request_type;
+	c->request = request;
+	c->value = value;
+	c->index = index;
+	c->length = length;
+	c->timeout = timeout;
+	if (data && length <= sizeof(c->data))
+		memcpy(c->data, data, length);
+	else
+		c->ext = data;
+	return c;
+}
+
+static void bmd_ctrl_call(struct blackmagic_device *bmd,
+			  void (*done)(struct blackmagic_device *, struct bmd_ctrl *, int))
+{
+	struct bmd_ctrl *c;
+
+	c = bmd_ctrl_queue(bmd, BMD_CTRL_CALL, 0, 0, 0, 0, NULL, 0, 0);
+	if (c)
+		c->done = done;
+}
+
+static int bmd_ctrl_busy(struct blackmagic_device *bmd)
+{
+	return bmd->ctrl_active || bmd->ctrl_head != bmd->ctrl_tail;
 }
 
-static void bmd_read_register(struct blackmagic_device *bmd, uint8_t reg, uint8_t *value)
+static void bmd_ctrl_complete(struct libusb_transfer *transfer);
+
+static void bmd_ctrl_next(struct blackmagic_device *bmd)
 {
+	struct bmd_ctrl *c;
 	int r;
-	if (bmd->status != LIBUSB_SUCCESS)
+
+	/* Hooks queue further requests, the loop below picks them up */
+	if (bmd->ctrl_active || bmd->ctrl_running)
 		return;
-	r = libusb_control_transfer(
-		bmd->usbdev_handle, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
-		VR_READ_REGISTER, 0x0000, reg << 8, value, 1, 1000);
-	if (r < 0)
-		bmd->status = r;
+	bmd->ctrl_running = 1;
+	while (bmd->ctrl_head != bmd->ctrl_tail && bmd->status == LIBUSB_SUCCESS) {
+		c = &bmd->ctrl[bmd->ctrl_head % BMD_CTRL_QUEUE];
+		if ((c->flags & BMD_CTRL_FALLBACK) && bmd->fujitsu_block_writes > 0) {
+			bmd->ctrl_head++;
+			continue;
+		}
+		if (c->flags & BMD_CTRL_CALL) {
+			bmd->ctrl_head++;
+			c->done(bmd, c, 0);
+			continue;
+		}
+		libusb_fill_control_setup(bmd->ctrl_buffer, c->request_type, c->request,
+					  c->value, c->index, c->length);
+		if (!(c->request_type & LIBUSB_ENDPOINT_IN))
+			memcpy(&bmd->ctrl_buffer[LIBUSB_CONTROL_SETUP_SIZE],
+			       c->ext ? c->ext : c->data, c->length);
+		libusb_fill_control_transfer(bmd->ctrl_transfer, bmd->usbdev_handle, bmd->ctrl_buffer,
+					     bmd_ctrl_complete, bmd, c->timeout);
+		r = bmd_submit(bmd, bmd->ctrl_transfer);
+		if (r != LIBUSB_SUCCESS) {
+			dlog(LOG_ERR, "%s: failed to submit control request %d: %s",
+				bmd->name, c->request, libusb_error_name(r));
+			bmd->status = r;
+			break;
+		}
+		bmd->ctrl_active = 1;
+		break;
+	}
+	if (bmd->status != LIBUSB_SUCCESS)
+		bmd->ctrl_head = bmd->ctrl_tail;
+	bmd->ctrl_running = 0;
 }
 
-static void bmd_load_firmware(struct blackmagic_device *bmd, uint16_t address, uint8_t *data, size_t len)
+static void bmd_ctrl_complete(struct libusb_transfer *transfer)
 {
+	struct blackmagic_device *bmd = transfer->user_data;
+	struct bmd_ctrl *c = &bmd->ctrl[bmd->ctrl_head++ % BMD_CTRL_QUEUE];
 	int r;
+
+	bmd->ctrl_active = 0;
+	r = transfer_status_to_error(transfer->status);
+	if (r == LIBUSB_SUCCESS) {
+		r = transfer->actual_length;
+		if (c->request_type & LIBUSB_ENDPOINT_IN)
+			memcpy(c->data, libusb_control_transfer_get_data(transfer),
+			       r < sizeof(c->data) ? r : sizeof(c->data));
+	}
+	if (c->done) {
+		c->done(bmd, c, r);
+	} else if (r < 0 && !(c->flags & BMD_CTRL_IGNORE) && bmd->status == LIBUSB_SUCCESS) {
+		dlog(LOG_ERR, "%s: control request %d failed: %s",
+			bmd->name, c->request, libusb_error_name(r));
+		bmd->status = r;
+	}
+	bmd_ctrl_next(bmd);
+}
+
+static void bmd_set_input_source(struct blackmagic_device *bmd, uint8_t mode)
+{
 	if (bmd->status != LIBUSB_SUCCESS)
 		return;
-	r = libusb_control_transfer(
-		bmd->usbdev_handle, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-		CYPRESS_VR_FIRMWARE_LOAD, address, 0, data, len, 1000);
-	if (r < 0)
-		bmd->status = r;
+	dlog(LOG_NOTICE, "%s: switching input source to %s (%d)",
+		bmd->name, input_source_names[mode], mode);
+	bmd_ctrl_queue(bmd, 0, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
+		       VR_SET_INPUT_SOURCE, 0x0000, 0, &mode, 1, 1000);
+	bmd_ctrl_next(bmd);
 }
 
-static uint16_t bmd_fujitsu_read(struct blackmagic_device *bmd, uint32_t reg)
+static void fujitsu_regimage_set(struct fujitsu_regimage *img, uint32_t reg, uint16_t value)
 {
-	uint8_t value[2];
-	int r;
+	if (img->count >= array_size(img->reg))
+		return;
+	img->reg[img->count] = reg;
+	img->value[img->count] = value;
+	img->count++;
+}
 
-	if (bmd->status != LIBUSB_SUCCESS)
+/* Registers written as a command rather than a setting, such as the
+ * encoder enable: never cached, so they are written every time */
+static int fujitsu_trigger(uint32_t reg)
+{
+	return reg == 0x001144;
+}
+
+static int fujitsu_shadow_slot(struct fujitsu_shadow *sh, uint32_t reg)
+{
+	int i, slot = ((reg >> 1) * 2654435761u) >> 24;
+
+	for (i = 0; i < array_size(sh->reg); i++, slot = (slot + 1) & 0xff)
+		if (sh->reg[slot] == (reg | FUJITSU_SHADOW_VALID) || sh->reg[slot] == 0)
+			return slot;
+	return -1;
+}
+
+static int fujitsu_shadow_get(struct fujitsu_shadow *sh, uint32_t reg, uint16_t *value)
+{
+	int slot = fujitsu_shadow_slot(sh, reg);
+
+	if (slot < 0 || sh->reg[slot] == 0)
 		return 0;
+	*value = sh->value[slot];
+	return 1;
+}
+
+static void fujitsu_shadow_set(struct fujitsu_shadow *sh, uint32_t reg, uint16_t value)
+{
+	int slot = fujitsu_shadow_slot(sh, reg);
+
+	if (slot < 0 || fujitsu_trigger(reg))
+		return;
+	sh->reg[slot] = reg | FUJITSU_SHADOW_VALID;
+	sh->value[slot] = value;
+}
+
+static void fujitsu_shadow_invalidate(struct fujitsu_shadow *sh)
+{
+	memset(sh->reg, 0, sizeof(sh->reg));
+}
+
+static struct bmd_ctrl *bmd_fujitsu_read(struct blackmagic_device *bmd, uint32_t reg,
+					 void (*done)(struct blackmagic_device *, struct bmd_ctrl *, int))
+{
+	struct bmd_ctrl *c;
+
+	c = bmd_ctrl_queue(bmd, 0, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
+			   VR_FUJITSU_READ, reg & 0xffff, (reg >> 16) & 0xff, NULL, 2, 1000);
+	if (c) {
+		c->done = done;
+		c->reg = reg;
+	}
+	return c;
+}
 
-	r = libusb_control_transfer(
-		bmd->usbdev_handle, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
-		VR_FUJITSU_READ, reg & 0xffff, (reg >> 16) & 0xff,
-		value, sizeof(value), 1000);
+static int bmd_fujitsu_value(struct bmd_ctrl *c, int r, uint16_t *value)
+{
 	if (r != 2)
 		return 0;
-
-	return (value[0] << 8) | value[1];
+	*value = (c->data[0] << 8) | c->data[1];
+	return 1;
 }
 
-static void bmd_fujitsu_write(struct blackmagic_device *bmd, uint32_t reg, uint16_t value)
+static void bmd_fujitsu_verify_read(struct blackmagic_device *bmd, struct bmd_ctrl *c, int r)
 {
-	uint8_t msg[5];
-	int r;
+	uint16_t value;
 
-	if (bmd->status != LIBUSB_SUCCESS)
+	if (!bmd_fujitsu_value(c, r, &value) || value == c->arg)
 		return;
+	dlog(LOG_WARNING, "%s: register cache mismatch @%06x: cached %04x, device %04x",
+		bmd->name, c->reg, c->arg, value);
+	fujitsu_shadow_set(&bmd->fujitsu_shadow, c->reg, value);
+	bmd->fujitsu_bad++;
+}
+
+/* Check every cached register against the device, correcting the cache.
+ * 'done' is called once all are read, with the mismatches counted in
+ * fujitsu_bad. */
+static void bmd_fujitsu_verify(struct blackmagic_device *bmd,
+			       void (*done)(struct blackmagic_device *, struct bmd_ctrl *, int))
+{
+	struct fujitsu_shadow *sh = &bmd->fujitsu_shadow;
+	struct bmd_ctrl *c;
+	int i;
+
+	bmd->fujitsu_bad = 0;
+	for (i = 0; i < array_size(sh->reg); i++) {
+		if (sh->reg[i] == 0)
+			continue;
+		c = bmd_fujitsu_read(bmd, sh->reg[i] & ~FUJITSU_SHADOW_VALID, bmd_fujitsu_verify_read);
+		if (c)
+			c->arg = sh->value[i];
+	}
+	if (done)
+		bmd_ctrl_call(bmd, done);
+}
+
+static struct bmd_ctrl *bmd_fujitsu_queue_write(struct blackmagic_device *bmd, int flags,
+						uint32_t reg, uint16_t value)
+{
+	uint8_t msg[5];
 
 	msg[0] = reg >> 16;
 	msg[1] = reg >> 8;
 	msg[2] = reg;
 	msg[3] = value >> 8;
 	msg[4] = value;
+	return bmd_ctrl_queue(bmd, flags, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
+			      VR_FUJITSU_WRITE, 0, 0, msg, 5, 1000);
+}
 
-	if (loglevel >= LOG_DEBUG) {
-		uint16_t oldvalue = bmd_fujitsu_read(bmd, reg);
-		if (value != oldvalue)
-			dlog(LOG_DEBUG, "%s: fujitsu_write @%06x %04x != %04x",
-				bmd->name, reg, value, oldvalue);
+static void bmd_fujitsu_write(struct blackmagic_device *bmd, uint32_t reg, uint16_t value)
+{
+	struct fujitsu_shadow *sh = &bmd->fujitsu_shadow;
+	uint16_t oldvalue;
+
+	if (bmd->status != LIBUSB_SUCCESS)
+		return;
+
+	/* No-op writes and debug diffs are served from the register cache,
+	 * the device is not read back */
+	if (fujitsu_shadow_get(sh, reg, &oldvalue)) {
+		sh->hits++;
+		if (value == oldvalue) {
+			bmd->fujitsu_skipped++;
+			return;
+		}
+		dlog(LOG_DEBUG, "%s: fujitsu_write @%06x %04x != %04x",
+			bmd->name, reg, value, oldvalue);
+	} else {
+		sh->misses++;
+		dlog(LOG_DEBUG, "%s: fujitsu_write @%06x %04x", bmd->name, reg, value);
 	}
 
-	r = libusb_control_transfer(
-		bmd->usbdev_handle, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,  
-		VR_FUJITSU_WRITE, 0, 0, msg, 5, 1000);
-	if (r < 0)
-		bmd->status = r;
+	if (!bmd_fujitsu_queue_write(bmd, 0, reg, value))
+		return;
+	fujitsu_shadow_set(sh, reg, value);
+	bmd->fujitsu_writes++;
 }
 
-static int bmd_upload_firmware(struct blackmagic_device *bmd, struct firmware *fw)
+static void bmd_fujitsu_block_written(struct blackmagic_device *bmd, struct bmd_ctrl *c, int r)
 {
-	struct _fwhdr { uint8_t len, addr_high, addr_low, marker, data[]; };
-	struct _fwhdr *fwhdr;
-	uint16_t addr;
-	int i, pos = 0;
+	if (r == c->length || bmd->fujitsu_block_writes < 0)
+		return;
+	bmd->fujitsu_block_writes = -1;
+	dlog(LOG_INFO, "%s: block register writes not supported", bmd->name);
+}
 
-	bmd_load_firmware(bmd, 0xe600, "\x01", 1);
-	while (pos < fw->size && bmd->status == LIBUSB_SUCCESS) {
-		fwhdr = (struct _fwhdr *) &fw->data[pos];
-		if (fwhdr->marker != 0)
-			break;
-		addr = (fwhdr->addr_high << 8) + fwhdr->addr_low;
-		bmd_load_firmware(bmd, addr, fwhdr->data, fwhdr->len);
-		pos += fwhdr->len + 5;
+static void bmd_fujitsu_block_check(struct blackmagic_device *bmd, struct bmd_ctrl *c, int r)
+{
+	uint16_t value;
+
+	if (bmd->fujitsu_block_writes != 0 ||
+	    (bmd_fujitsu_value(c, r, &value) && value == c->arg))
+		return;
+	bmd->fujitsu_block_writes = -1;
+	dlog(LOG_INFO, "%s: block register writes not effective", bmd->name);
+}
+
+static void bmd_fujitsu_block_probed(struct blackmagic_device *bmd, struct bmd_ctrl *c, int r)
+{
+	if (bmd->fujitsu_block_writes != 0)
+		return;
+	bmd->fujitsu_block_writes = 1;
+	dlog(LOG_INFO, "%s: using block register writes", bmd->name);
+}
+
+/* Write consecutive registers with one VX_CSR_WRITE_MEM_BLOCK request.
+ * Support is probed on first use by reading the block back, with single
+ * register writes queued behind that are only sent if the probe fails;
+ * devices that reject or ignore it get single register writes. */
+static int bmd_fujitsu_write_block(struct blackmagic_device *bmd, uint32_t reg, const uint16_t *values, int n)
+{
+	struct bmd_ctrl *c;
+	uint8_t msg[64];
+	int i;
+
+	if (bmd->status != LIBUSB_SUCCESS || bmd->fujitsu_block_writes < 0 ||
+	    n * 2 > sizeof(msg))
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		msg[2*i+0] = values[i] >> 8;
+		msg[2*i+1] = values[i];
 	}
-	bmd_load_firmware(bmd, 0xe600, "\x00", 1);
 
-	return bmd->status == LIBUSB_SUCCESS;
+	c = bmd_ctrl_queue(bmd, 0, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
+			   VX_CSR_WRITE_MEM_BLOCK, reg & 0xffff, (reg >> 16) & 0xff,
+			   msg, n * 2, 1000);
+	if (!c)
+		return 0;
+	c->done = bmd_fujitsu_block_written;
+
+	if (bmd->fujitsu_block_writes == 0) {
+		for (i = 0; i < n; i++) {
+			c = bmd_fujitsu_read(bmd, reg + 2*i, bmd_fujitsu_block_check);
+			if (c)
+				c->arg = values[i];
+		}
+		bmd_ctrl_call(bmd, bmd_fujitsu_block_probed);
+		for (i = 0; i < n; i++)
+			bmd_fujitsu_queue_write(bmd, BMD_CTRL_FALLBACK, reg + 2*i, values[i]);
+	}
+
+	for (i = 0; i < n; i++)
+		fujitsu_shadow_set(&bmd->fujitsu_shadow, reg + 2*i, values[i]);
+	bmd->fujitsu_writes++;
+	return 1;
+}
+
+/* Program a register image: registers already holding the target value
+ * are skipped, runs of consecutive registers are written as a block. */
+static void bmd_fujitsu_apply(struct blackmagic_device *bmd, struct fujitsu_regimage *img)
+{
+	uint16_t cur;
+	int i, j, n, dirty;
+
+	for (i = 0; i < img->count && bmd->status == LIBUSB_SUCCESS; i += n) {
+		dirty = 0;
+		for (n = 0; i + n < img->count && n < 32; n++) {
+			if (n && img->reg[i+n] != img->reg[i] + 2*n)
+				break;
+			if (!fujitsu_shadow_get(&bmd->fujitsu_shadow, img->reg[i+n], &cur) ||
+			    cur != img->value[i+n])
+				dirty++;
+		}
+		if (!dirty) {
+			bmd->fujitsu_skipped += n;
+			continue;
+		}
+		if (dirty > 1 && bmd_fujitsu_write_block(bmd, img->reg[i], &img->value[i], n))
+			continue;
+		for (j = i; j < i + n; j++)
+			bmd_fujitsu_write(bmd, img->reg[j], img->value[j]);
+	}
+}
+
+static void bmd_firmware_loaded(struct blackmagic_device *bmd, struct bmd_ctrl *c, int r)
+{
+	if (r >= 0 || bmd->status != LIBUSB_SUCCESS)
+		return;
+	dlog(LOG_NOTICE, "%s: firmware failed to download: %s", bmd->name, libusb_error_name(r));
+	bmd->status = r;
+}
+
+static void bmd_firmware_uploaded(struct blackmagic_device *bmd, struct bmd_ctrl *c, int r)
+{
+	struct firmware *fw = bmd->firmware;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	dlog(LOG_INFO, "%s: firmware upload took %.1f ms, %d transfers for %d records",
+		bmd->name, elapsed_us(&bmd->firmware_start, &now) / 1000.0,
+		fw->num_runs + 2, fw->num_records);
+	dlog(LOG_NOTICE, "%s: firmware downloaded succesfully", bmd->name);
+}
+
+static void bmd_load_firmware(struct blackmagic_device *bmd, uint16_t address, const uint8_t *data, size_t len)
+{
+	struct bmd_ctrl *c;
+
+	c = bmd_ctrl_queue(bmd, 0, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
+			   CYPRESS_VR_FIRMWARE_LOAD, address, 0, data, len, 1000);
+	if (c)
+		c->done = bmd_firmware_loaded;
+}
+
+/* The runs are sent from the firmware image, which is never freed */
+static void bmd_upload_firmware(struct blackmagic_device *bmd, struct firmware *fw)
+{
+	int i;
+
+	bmd->firmware = fw;
+	clock_gettime(CLOCK_MONOTONIC, &bmd->firmware_start);
+	bmd_load_firmware(bmd, 0xe600, (const uint8_t *) "\x01", 1);
+	for (i = 0; i < fw->num_runs; i++)
+		bmd_load_firmware(bmd, fw->runs[i].addr, fw->runs[i].data, fw->runs[i].len);
+	bmd_load_firmware(bmd, 0xe600, (const uint8_t *) "\x00", 1);
+	bmd_ctrl_call(bmd, bmd_firmware_uploaded);
+	bmd_ctrl_next(bmd);
 }
 
 static const char *format_usb_ports(const uint8_t *ports, size_t n, char *fmt)
@@ -634,30 +1249,115 @@ static int pipe2(int pipefd[2], int flags)
 }
 #endif
 
-static int bmd_start_exec_program(struct blackmagic_device *bmd, int pipe_sz, char *exec_program)
+static const char *bmd_output_name(struct bmd_output *o)
 {
-	uint8_t ports[8];
-	char fmt[array_size(ports)*4];
-	char tmp[1024];
+	if (o->spec->type == OUTPUT_HTTP)
+		return container_of(o, struct http_client, out)->peer;
+	return o->spec->dest ?: o->spec->exec_program ?: "stdout";
+}
+
+/* Moves a new reader back to the latest random access point still within
+ * its lag limit and queues 'prefix' and the cached PAT, PMT and SIT
+ * ahead of it, so that the decoder behind a starting (or restarted)
+ * consumer gets everything it needs at once instead of waiting for the
+ * next tables and IDR. */
+static void bmd_output_prime(struct bmd_output *o, const char *prefix, int n)
+{
+	struct blackmagic_device *bmd = o->bmd;
+	struct ts_reader *rd = &o->reader;
+	struct ts_join *j = &bmd->join;
+
+	if (j->have_rap && bmd->ring.head - j->rap <= rd->lag_limit)
+		rd->cursor = rd->pin = j->rap;
+
+	if (n)
+		memcpy(rd->carry, prefix, n);
+	if (j->have_pat) {
+		memcpy(&rd->carry[n], j->pat, TS_PACKET_SIZE);
+		n += TS_PACKET_SIZE;
+	}
+	if (j->have_pmt) {
+		memcpy(&rd->carry[n], j->pmt, TS_PACKET_SIZE);
+		n += TS_PACKET_SIZE;
+	}
+	if (j->have_sit) {
+		memcpy(&rd->carry[n], j->sit, TS_PACKET_SIZE);
+		n += TS_PACKET_SIZE;
+	}
+	rd->carry_off = 0;
+	rd->carry_len = n;
+}
+
+static void bmd_set_output(struct bmd_output *o, int fd)
+{
+	struct blackmagic_device *bmd = o->bmd;
+	struct stat st;
+	int policy = o->spec->lag_policy;
+	int fifo;
+
+	o->fd = fd;
+	o->error = 0;
+	o->event.fd = fd;
+	/* What is pinned is told by what is still in the pipe, so the pipe
+	 * must be this output's alone: stdout is shared by all devices */
+	fifo = fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+	o->splice = ep.vmsplice && fifo && o->spec->exec_program;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if (ep.vmsplice && !o->splice && o->spec->type == OUTPUT_PIPE)
+		dlog(LOG_INFO, "%s: output %s is %s, not using vmsplice", bmd->name, bmd_output_name(o),
+			fifo ? "shared by all devices" : "not a pipe");
+	/* Datagrams go out in whole groups, which thinning would break up */
+	if (policy == TS_LAG_NONREF && o->spec->type != OUTPUT_PIPE)
+		policy = TS_LAG_GOP;
+	ts_ring_attach(&bmd->ring, &o->reader, o->spec->lag_kb, policy, o->splice);
+
+	/* UDP receivers come and go regardless, they are sent live */
+	if (o->spec->type == OUTPUT_PIPE) {
+		bmd_output_prime(o, NULL, 0);
+		dlog(LOG_DEBUG, "%s: output %s starts %u packets behind live", bmd->name,
+			bmd_output_name(o), bmd->ring.head - o->reader.cursor);
+	}
+}
+
+static int bmd_start_output(struct bmd_output *o)
+{
+	struct blackmagic_device *bmd = o->bmd;
+	char *exec_program = o->spec->exec_program;
+	char tmp[1024];
 	char *envp[16];
 	char *argv[] = { exec_program, 0 };
 	int r, i, p, pipefd[2];
 	posix_spawn_file_actions_t fa;
 
+	if (o->spec->type != OUTPUT_PIPE) {
+		if (!ts_udp_open(&o->udp, (struct sockaddr *) &o->spec->addr, o->spec->addrlen,
+				 o->spec->type == OUTPUT_RTP, o->spec->mcast_ttl, o->spec->mcast_if,
+				 ep.pipe_sz * 1024, o->spec->udp_gso))
+			return 0;
+		if (o->spec->udp_gso && !o->udp.gso)
+			dlog(LOG_INFO, "%s: UDP GSO not available for %s", bmd->name, o->spec->dest);
+		bmd_set_output(o, o->udp.fd);
+		return 1;
+	}
+
 	if (!exec_program) {
-		bmd->mpegparser.output_fd = STDOUT_FILENO;
+		/* Private descriptor so each device can watch it in epoll */
+		r = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+		if (r < 0)
+			return 0;
+		bmd_set_output(o, r);
 		return 1;
 	}
 
-	dlog(LOG_DEBUG, "%s: launching exec program: %s", bmd->name, ep.exec_program);
+	dlog(LOG_DEBUG, "%s: launching exec program: %s", bmd->name, exec_program);
 
 	if (pipe2(pipefd, O_CLOEXEC) < 0)
 		return 0;
 
-	if (pipe_sz) {
-		if (fcntl(pipefd[0], F_SETPIPE_SZ, pipe_sz * 1024) < 0)
+	if (ep.pipe_sz) {
+		if (fcntl(pipefd[0], F_SETPIPE_SZ, ep.pipe_sz * 1024) < 0)
 			dlog(LOG_ERR, "%s: unable to set pipe size",
-			     bmd->name, ep.exec_program);
+			     bmd->name, exec_program);
 	}
 
 	i = p = 0;
@@ -671,8 +1371,7 @@ static int bmd_start_exec_program(struct blackmagic_device *bmd, int pipe_sz, ch
 	envp[i++] = &tmp[p];
 	p += snprintf(&tmp[p], sizeof(tmp)-p, "BMD_STREAM_HEIGHT=%d", bmd->current_mode->height) + 1;
 	envp[i++] = &tmp[p];
-	r = libusb_get_port_numbers(bmd->usbdev, ports, array_size(ports));
-	p += snprintf(&tmp[p], sizeof(tmp)-p, "BMD_USB_PORTS=%s", format_usb_ports(ports, r, fmt)) + 1;
+	p += snprintf(&tmp[p], sizeof(tmp)-p, "BMD_USB_PORTS=%s", bmd->usb_ports) + 1;
 	envp[i] = 0;
 
 	posix_spawn_file_actions_init(&fa);
@@ -687,63 +1386,1102 @@ static int bmd_start_exec_program(struct blackmagic_device *bmd, int pipe_sz, ch
 		return 0;
 	}
 
-	bmd->mpegparser.output_fd = pipefd[1];
-	fcntl(pipefd[1], F_SETFL, O_NONBLOCK);
+	bmd_set_output(o, pipefd[1]);
 	return 1;
 }
 
-static void bmd_kill_exec_program(struct blackmagic_device *bmd)
+/* Whatever the consumer has not taken yet stays pinned in the ring */
+static void bmd_output_update_pin(struct bmd_output *o)
+{
+	if (o->spec->type == OUTPUT_HTTP)
+		ts_tcp_update_pin(&container_of(o, struct http_client, out)->tcp);
+	else
+		ts_pipe_update_pin(&o->reader, o->fd);
+}
+
+static void bmd_stop_output(struct bmd_output *o)
 {
-	if (ep.exec_program && bmd->mpegparser.output_fd >= 0) {
-		dlog(LOG_DEBUG, "%s: closing output stream", bmd->name);
-		close(bmd->mpegparser.output_fd);
+	if (o->fd < 0)
+		return;
+
+	dlog(LOG_DEBUG, "%s: closing output stream", o->bmd->name);
+	event_update(&o->event, 0);
+	if (o->reader.pinning)
+		bmd_output_update_pin(o);
+	o->lag_dropped += o->reader.overruns;
+	ts_ring_detach(&o->bmd->ring, &o->reader);
+	close(o->fd);
+	o->fd = -1;
+	o->splice = 0;
+}
+
+/* With --persist outputs stay open across encoder restarts, only those
+ * that are not are started */
+static int bmd_start_outputs(struct blackmagic_device *bmd)
+{
+	int i, started = 0;
+
+	for (i = 0; i < bmd->num_outputs; i++) {
+		if (bmd->outputs[i].fd >= 0) {
+			dlog(LOG_DEBUG, "%s: output %s continues %u packets behind live", bmd->name,
+				bmd_output_name(&bmd->outputs[i]),
+				bmd->ring.head - bmd->outputs[i].reader.cursor);
+			started++;
+		} else if (bmd_start_output(&bmd->outputs[i]))
+			started++;
+		else
+			dlog(LOG_ERR, "%s: failed to start output %s: %s", bmd->name,
+				bmd_output_name(&bmd->outputs[i]), strerror(errno));
 	}
-	bmd->mpegparser.output_fd = -1;
+	return started;
 }
 
+static void bmd_stop_outputs(struct blackmagic_device *bmd)
+{
+	int i;
+
+	for (i = 0; i < bmd->num_outputs; i++)
+		bmd_stop_output(&bmd->outputs[i]);
+}
 
-static void *bmd_pump_mpegts(void *ctx)
+static void http_client_close(struct http_client *c);
+
+static void bmd_output_failed(struct bmd_output *o)
 {
-	struct blackmagic_device *bmd = ctx;
-	int actual_length, r;
+	struct blackmagic_device *bmd = o->bmd;
+	int i;
+
+	if (o->spec->type == OUTPUT_HTTP) {
+		http_client_close(container_of(o, struct http_client, out));
+		return;
+	}
+	bmd_stop_output(o);
+	if (o->spec->type == OUTPUT_PIPE && !o->spec->exec_program) {
+		running = 0;
+		return;
+	}
+	if (ep.respawn && bmd_start_output(o)) {
+		bmd->metrics.respawns++;
+		return;
+	}
+	for (i = 0; i < bmd->num_outputs; i++)
+		if (bmd->outputs[i].fd >= 0)
+			return;
+	bmd->running = 0;
+}
 
-	do {
-		r = libusb_bulk_transfer(
-			bmd->usbdev_handle, 0x86,
-			bmd->mpegparser.data, sizeof(bmd->mpegparser.data),
-			&actual_length, 5000);
-		if (r != LIBUSB_SUCCESS && r != LIBUSB_ERROR_TIMEOUT)
+/* Samples the delivery latency of each stamped group of packets the
+ * output finished sending with its cursor moving on from 'start' */
+static void bmd_output_delivered(struct bmd_output *o, unsigned int start)
+{
+	struct ts_ring *ring = &o->bmd->ring;
+	unsigned int pos = (start | (TS_RING_STAMP - 1)) + 1;
+	struct timespec now;
+	int64_t now_us;
+
+	if ((int)(o->reader.cursor - pos) < 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	now_us = now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+	for (; (int)(o->reader.cursor - pos) >= 0; pos += TS_RING_STAMP)
+		hist_add(&o->bmd->metrics.delivery,
+			 now_us - ring->stamp[((pos - 1) / TS_RING_STAMP) & (ring->mask / TS_RING_STAMP)]);
+}
+
+/* Datagrams go out whole, a short tail waits for the next write. Send
+ * errors other than a full socket buffer drop what is queued; they are
+ * logged once until sending works again. */
+static void bmd_output_send(struct bmd_output *o)
+{
+	struct blackmagic_device *bmd = o->bmd;
+	struct ts_ring *ring = &bmd->ring;
+	struct ts_reader *rd = &o->reader;
+	int r;
+
+	r = ts_udp_write(&o->udp, ring, rd);
+	if (r > 0) {
+		bmd_output_delivered(o, rd->cursor - r);
+		o->bytes += r * 0xbc;
+		o->error = 0;
+	} else if (r < 0 && errno == EAGAIN) {
+		o->eagain++;
+	} else if (r < 0) {
+		o->errors++;
+		if (errno != o->error)
+			dlog(LOG_NOTICE, "%s: error sending MPEG TS to %s: %s",
+				bmd->name, o->spec->dest, strerror(errno));
+		o->error = errno;
+		o->dropped += (ring->head - rd->cursor) * 0xbc;
+		ts_reader_flush(ring, rd);
+	}
+	event_update(&o->event, o->watch | (ring->head - rd->cursor >= TS_UDP_PACKETS ? EPOLLOUT : 0));
+}
+
+/* Send what this output has not seen yet without blocking. When the
+ * output is full, wait for it to become writable in the event loop;
+ * the ring keeps the data until the lag limit of the output is hit.
+ * Returns zero if the output is not (or no longer) open. */
+static int bmd_output_write(struct bmd_output *o)
+{
+	struct blackmagic_device *bmd = o->bmd;
+	struct ts_ring *ring = &bmd->ring;
+	struct ts_reader *rd = &o->reader;
+	ssize_t (*send)(void *arg, void *ptr, size_t len) = NULL;
+	void *arg = NULL;
+	unsigned int start;
+	ssize_t r;
+
+	if (o->fd < 0)
+		return 0;
+	if (rd->overrun) {
+		dlog(LOG_NOTICE, "%s: output %s is too slow, disconnecting",
+			bmd->name, bmd_output_name(o));
+		bmd_output_failed(o);
+		return 0;
+	}
+	if (rd->pinning)
+		bmd_output_update_pin(o);
+	if (o->spec->type == OUTPUT_UDP || o->spec->type == OUTPUT_RTP) {
+		bmd_output_send(o);
+		return 1;
+	}
+	if (o->spec->type == OUTPUT_HTTP) {
+		send = ts_tcp_send;
+		arg = &container_of(o, struct http_client, out)->tcp;
+	}
+
+	for (;;) {
+		start = rd->cursor;
+		r = ts_pipe_write(ring, rd, o->fd, 1, send, arg);
+		if (r > 0) {
+			bmd_output_delivered(o, start);
+			o->bytes += r;
+			if (o->spec->type == OUTPUT_HTTP)
+				bmd->metrics.http_bytes += r;
+			continue;
+		}
+		if (r == 0)
 			break;
-		if (r == LIBUSB_ERROR_TIMEOUT)
-			dlog(LOG_INFO, "%s: mpeg-ts pump: timeout reading data, retrying!", bmd->name);
-
-		if (mpegparser_parse(&bmd->mpegparser, actual_length) < 0) {
-			if (ep.exec_program) {
-				if (ep.respawn) {
-					bmd_kill_exec_program(bmd);
-					bmd_start_exec_program(bmd, ep.pipe_sz, ep.exec_program);
-				} else {
-					bmd->running = 0;
-				}
-			} else
-				running = 0;
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno == EAGAIN) {
+			o->eagain++;
+			event_update(&o->event, o->watch | EPOLLOUT);
+			return 1;
+		}
+		o->errors++;
+		dlog(o->spec->type == OUTPUT_HTTP ? LOG_INFO : LOG_NOTICE,
+			"%s: error writing MPEG TS to %s: %s",
+			bmd->name, bmd_output_name(o), strerror(errno));
+		if (errno == EPIPE || o->splice || o->spec->type == OUTPUT_HTTP) {
+			bmd_output_failed(o);
+			return 0;
 		}
-	} while (running && bmd->running);
+		o->dropped += (ring->head - rd->cursor) * 0xbc - rd->partial + rd->carry_len;
+		ts_reader_flush(ring, rd);
+	}
+	event_update(&o->event, o->watch);
+	return 1;
+}
+
+static void bmd_write_output(struct blackmagic_device *bmd)
+{
+	struct http_client *c, *next;
+	int i;
+
+	for (i = 0; i < bmd->num_outputs; i++)
+		bmd_output_write(&bmd->outputs[i]);
+	for (c = bmd->http_clients; c; c = next) {
+		next = c->next;
+		bmd_output_write(&c->out);
+	}
+}
 
-	dlog(LOG_DEBUG, "%s: mpeg-ts pump exiting: %s", bmd->name, libusb_error_name(r));
+static void bmd_mpegts_resume(struct blackmagic_device *bmd);
 
-	return NULL;
+static void bmd_output_event(struct event_handler *eh, uint32_t events)
+{
+	struct bmd_output *o = container_of(eh, struct bmd_output, event);
+
+	bmd_output_write(o);
+	bmd_mpegts_resume(o->bmd);
 }
 
-static int bmd_recognize_device(struct blackmagic_device *bmd)
+/* Built-in HTTP server: GET /device/<usb-ports>.ts streams the device
+ * at those USB ports (as in BMD_USB_PORTS) to any number of clients. */
+static struct output_spec http_spec;
+static struct event_handler http_listen;
+static struct http_client *http_pending;
+static struct http_client *http_closed;	/* freed after the event batch */
+
+/* Events for the client may still be due in the current epoll batch, so
+ * it is only unhooked here and freed by http_reap() */
+static void http_client_close(struct http_client *c)
 {
+	struct blackmagic_device *bmd = c->out.bmd;
+	struct http_client **pc;
+
+	for (pc = bmd ? &bmd->http_clients : &http_pending; *pc != c; pc = &(*pc)->next);
+	*pc = c->next;
+
+	if (bmd) {
+		dlog(LOG_INFO, "%s: http client %s left, %llu packets dropped by lag policy",
+			bmd->name, c->peer, c->out.reader.overruns);
+		bmd->metrics.http_lag_dropped += c->out.reader.overruns;
+		bmd_stop_output(&c->out);
+	} else {
+		event_update(&c->out.event, 0);
+		close(c->out.fd);
+	}
+	c->out.event.handler = NULL;
+	c->next = http_closed;
+	http_closed = c;
+
+	/* accepting was paused when out of descriptors */
+	if (http_listen.handler && !http_listen.events)
+		event_update(&http_listen, EPOLLIN);
+}
+
+static void http_client_reply(struct http_client *c, const char *status)
+{
+	char buf[128];
+	int n;
+
+	n = snprintf(buf, sizeof(buf), "HTTP/1.0 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+	(void) send(c->out.fd, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+	http_client_close(c);
+}
+
+/* Primes the client behind the response header */
+static void http_client_attach(struct http_client *c, struct blackmagic_device *bmd)
+{
+	static const char header[] =
+		"HTTP/1.0 200 OK\r\n"
+		"Content-Type: video/mp2t\r\n"
+		"Cache-Control: no-cache\r\n"
+		"Connection: close\r\n"
+		"\r\n";
+	struct bmd_output *o = &c->out;
+	struct ts_reader *rd = &o->reader;
+	struct http_client **pc;
+
+	for (pc = &http_pending; *pc != c; pc = &(*pc)->next);
+	*pc = c->next;
+	c->next = bmd->http_clients;
+	bmd->http_clients = c;
+
+	o->bmd = bmd;
+	o->watch = EPOLLIN;
+	ts_ring_attach(&bmd->ring, rd, o->spec->lag_kb, o->spec->lag_policy,
+		       ts_tcp_init(&c->tcp, o->fd, rd));
+	bmd_output_prime(o, header, sizeof(header) - 1);
+
+	dlog(LOG_INFO, "%s: http client %s joined %u packets behind live%s",
+		bmd->name, c->peer, bmd->ring.head - rd->cursor,
+		c->tcp.zerocopy ? ", zero copy" : "");
+	bmd_output_write(o);
+}
+
+/* GET /metrics: the device and output counters in the Prometheus text
+ * format, one series per device (by USB ports) or output. The reply is
+ * kept on the client and sent as the socket takes it, by
+ * http_client_flush() on EPOLLOUT, within HTTP_REQUEST_MS. */
+static void metric_header(FILE *f, const char *name, const char *type, const char *help)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metric_label(FILE *f, const char *value)
+{
+	for (; *value; value++) {
+		if (*value == '"' || *value == '\\')
+			fputc('\\', f);
+		fputc(*value, f);
+	}
+}
+
+#define DEVICE_METRIC(name, type, help, expr) do {					\
+	metric_header(f, name, type, help);						\
+	for (bmd = devices; bmd; bmd = bmd->next)					\
+		fprintf(f, name "{device=\"%s\"} %.15g\n", bmd->usb_ports, (double) (expr));	\
+} while (0)
+
+#define OUTPUT_METRIC(name, type, help, expr) do {					\
+	metric_header(f, name, type, help);						\
+	for (bmd = devices; bmd; bmd = bmd->next) {					\
+		for (i = 0; i < bmd->num_outputs; i++) {				\
+			o = &bmd->outputs[i];						\
+			fprintf(f, name "{device=\"%s\",output=\"", bmd->usb_ports);	\
+			metric_label(f, bmd_output_name(o));				\
+			fprintf(f, "\"} %.15g\n", (double) (expr));			\
+		}									\
+	}										\
+} while (0)
+
+static void metric_summary(FILE *f, struct blackmagic_device *bmd, const char *stage, const struct hist *h)
+{
+	static const double q[] = { 0.5, 0.9, 0.99, 0.999, 1 };
+	int i;
+
+	for (i = 0; i < array_size(q); i++)
+		fprintf(f, "bmd_latency_seconds{device=\"%s\",stage=\"%s\",quantile=\"%g\"} %g\n",
+			bmd->usb_ports, stage, q[i], hist_quantile(h, q[i]) / 1e6);
+	fprintf(f, "bmd_latency_seconds_sum{device=\"%s\",stage=\"%s\"} %g\n",
+		bmd->usb_ports, stage, h->sum / 1e6);
+	fprintf(f, "bmd_latency_seconds_count{device=\"%s\",stage=\"%s\"} %llu\n",
+		bmd->usb_ports, stage, (unsigned long long) h->count);
+}
+
+static uint64_t bmd_http_lag_dropped(struct blackmagic_device *bmd)
+{
+	struct http_client *c;
+	uint64_t n = bmd->metrics.http_lag_dropped;
+
+	for (c = bmd->http_clients; c; c = c->next)
+		n += c->out.reader.overruns;
+	return n;
+}
+
+static int bmd_http_clients(struct blackmagic_device *bmd)
+{
+	struct http_client *c;
+	int n = 0;
+
+	for (c = bmd->http_clients; c; c = c->next)
+		n++;
+	return n;
+}
+
+static void bmd_write_metrics(FILE *f)
+{
+	struct blackmagic_device *bmd;
+	struct bmd_output *o;
+	int i;
+
+	DEVICE_METRIC("bmd_usb_bytes_total", "counter", "MPEG-TS bytes read from USB",
+		bmd->metrics.usb_bytes);
+	DEVICE_METRIC("bmd_usb_transfers_total", "counter", "MPEG-TS USB transfers completed",
+		bmd->metrics.usb_transfers);
+	DEVICE_METRIC("bmd_usb_timeouts_total", "counter", "MPEG-TS USB transfers timed out",
+		bmd->metrics.usb_timeouts);
+	DEVICE_METRIC("bmd_ts_packets_total", "counter", "TS packets parsed",
+		bmd->ts_stats.packets);
+	DEVICE_METRIC("bmd_ts_resyncs_total", "counter", "Times TS sync was lost",
+		bmd->ts_stats.resyncs);
+	DEVICE_METRIC("bmd_ts_resync_bytes_total", "counter", "Bytes skipped to regain TS sync",
+		bmd->ts_stats.resync_bytes);
+	DEVICE_METRIC("bmd_ts_null_packets_total", "counter", "Null packets dropped",
+		bmd->ts_stats.null_packets);
+	DEVICE_METRIC("bmd_ts_cc_errors_total", "counter", "Continuity counter errors in the input",
+		bmd->ts_stats.cc_errors);
+	DEVICE_METRIC("bmd_encoder_starts_total", "counter", "Encoder starts",
+		bmd->metrics.encoder_starts);
+	DEVICE_METRIC("bmd_encoder_configure_seconds", "gauge", "Time to configure the encoder at the last start",
+		bmd->metrics.configure_us / 1e6);
+	DEVICE_METRIC("bmd_encoder_first_packet_seconds", "gauge", "Time to the first packet at the last start",
+		bmd->metrics.first_packet_us / 1e6);
+	DEVICE_METRIC("bmd_fx_status", "gauge", "FX2 status code",
+		bmd->fxstatus);
+	DEVICE_METRIC("bmd_display_mode", "gauge", "Input display mode code",
+		bmd->current_display_mode);
+	DEVICE_METRIC("bmd_output_respawns_total", "counter", "Output programs restarted",
+		bmd->metrics.respawns);
+
+	OUTPUT_METRIC("bmd_output_bytes_total", "counter", "Bytes written to the output",
+		o->bytes);
+	OUTPUT_METRIC("bmd_output_write_errors_total", "counter", "Failed writes to the output",
+		o->errors);
+	OUTPUT_METRIC("bmd_output_eagain_total", "counter", "Writes that found the output full",
+		o->eagain);
+	OUTPUT_METRIC("bmd_output_lag_dropped_packets_total", "counter", "Packets dropped by the lag policy",
+		o->lag_dropped + (o->fd >= 0 ? o->reader.overruns : 0));
+	OUTPUT_METRIC("bmd_output_lag_packets", "gauge", "Packets queued for the output",
+		o->fd >= 0 ? bmd->ring.head - o->reader.cursor : 0);
+
+	DEVICE_METRIC("bmd_http_bytes_total", "counter", "Bytes sent to http clients",
+		bmd->metrics.http_bytes);
+	DEVICE_METRIC("bmd_http_lag_dropped_packets_total", "counter",
+		"Packets dropped by the lag policy for http clients",
+		bmd_http_lag_dropped(bmd));
+	DEVICE_METRIC("bmd_http_clients", "gauge", "Connected http clients",
+		bmd_http_clients(bmd));
+
+	metric_header(f, "bmd_latency_seconds", "summary",
+		"Latency by stage: usb_interval between USB transfer completions, delivery from "
+		"USB completion to output write, record_write in the disk writer queue");
+	for (bmd = devices; bmd; bmd = bmd->next) {
+		metric_summary(f, bmd, "usb_interval", &bmd->metrics.usb_interval);
+		metric_summary(f, bmd, "delivery", &bmd->metrics.delivery);
+		if (bmd->mpegparser.rec)
+			metric_summary(f, bmd, "record_write", &bmd->rec.stats.write_hist);
+	}
+}
+
+/* Sends what the socket takes of the reply, the rest on EPOLLOUT */
+static void http_client_flush(struct http_client *c)
+{
+	ssize_t r;
+
+	while (c->reply_sent < c->reply_len) {
+		r = send(c->out.fd, c->reply + c->reply_sent, c->reply_len - c->reply_sent,
+			 MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno == EAGAIN)
+			return;
+		if (r <= 0)
+			break;
+		c->reply_sent += r;
+	}
+	http_client_close(c);
+}
+
+static void http_client_metrics(struct http_client *c)
+{
+	char head[160], *text = NULL;
+	size_t len = 0;
+	FILE *f;
+	int n;
+
+	f = open_memstream(&text, &len);
+	if (!f) {
+		http_client_reply(c, "500 Internal Server Error");
+		return;
+	}
+	bmd_write_metrics(f);
+	fclose(f);
+
+	n = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\n"
+		"Connection: close\r\n\r\n", len);
+	c->reply = malloc(n + len);
+	if (!c->reply) {
+		free(text);
+		http_client_reply(c, "500 Internal Server Error");
+		return;
+	}
+	memcpy(c->reply, head, n);
+	memcpy(c->reply + n, text, len);
+	c->reply_len = n + len;
+	free(text);
+	if (event_update(&c->out.event, EPOLLOUT) < 0) {
+		http_client_close(c);
+		return;
+	}
+	http_client_flush(c);
+}
+
+static void http_client_request(struct http_client *c)
+{
+	struct blackmagic_device *bmd;
+	char *path, *end;
+	ssize_t r;
+
+	r = recv(c->out.fd, &c->req[c->req_len], sizeof(c->req) - 1 - c->req_len, MSG_DONTWAIT);
+	if (r < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (r <= 0) {
+		http_client_close(c);
+		return;
+	}
+	c->req_len += r;
+	c->req[c->req_len] = 0;
+	if (!strstr(c->req, "\r\n\r\n") && !strstr(c->req, "\n\n")) {
+		if (c->req_len >= sizeof(c->req) - 1)
+			http_client_reply(c, "400 Bad Request");
+		return;
+	}
+
+	if (strncmp(c->req, "GET ", 4) != 0) {
+		http_client_reply(c, "405 Method Not Allowed");
+		return;
+	}
+	path = &c->req[4];
+	end = strpbrk(path, " \r\n");
+	if (end && end - path == 8 && strncmp(path, "/metrics", 8) == 0) {
+		http_client_metrics(c);
+		return;
+	}
+	if (!end || strncmp(path, "/device/", 8) != 0 || end - path < 12 ||
+	    strncmp(end - 3, ".ts", 3) != 0) {
+		http_client_reply(c, "404 Not Found");
+		return;
+	}
+	path += 8;
+	end[-3] = 0;
+
+	for (bmd = devices; bmd; bmd = bmd->next)
+		if (bmd->ring.data && strcmp(bmd->usb_ports, path) == 0)
+			break;
+	if (!bmd) {
+		http_client_reply(c, "404 Not Found");
+		return;
+	}
+	http_client_attach(c, bmd);
+}
+
+static void http_client_event(struct event_handler *eh, uint32_t events)
+{
+	struct http_client *c = container_of(eh, struct http_client, out.event);
+	struct blackmagic_device *bmd = c->out.bmd;
+	char buf[256];
+	socklen_t len = sizeof(int);
+	int err = 0;
+	ssize_t r;
+
+	if (!bmd) {
+		if (c->reply)
+			http_client_flush(c);
+		else
+			http_client_request(c);
+		return;
+	}
+
+	if (events & EPOLLERR) {
+		ts_tcp_completions(&c->tcp);
+		if (getsockopt(c->out.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+			http_client_close(c);
+			return;
+		}
+	}
+	if (events & (EPOLLIN | EPOLLHUP)) {
+		/* Nothing more is expected from the client but the close */
+		r = recv(c->out.fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+			http_client_close(c);
+			return;
+		}
+	}
+	/* The client may be gone after this */
+	bmd_output_write(&c->out);
+	bmd_mpegts_resume(bmd);
+}
+
+static void http_accept(struct event_handler *eh, uint32_t events)
+{
+	struct sockaddr_storage addr;
+	socklen_t len;
+	struct http_client *c;
+	char host[INET6_ADDRSTRLEN], serv[8];
+	int fd;
+
+	for (;;) {
+		len = sizeof(addr);
+		fd = accept4(eh->fd, (struct sockaddr *) &addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EMFILE || errno == ENFILE) {
+				dlog(LOG_ERR, "http: out of file descriptors, pausing");
+				event_update(eh, 0);
+			} else if (errno != EAGAIN) {
+				dlog(LOG_ERR, "http: accept: %s", strerror(errno));
+			}
+			return;
+		}
+
+		c = calloc(1, sizeof(*c));
+		if (!c) {
+			close(fd);
+			continue;
+		}
+		if (getnameinfo((struct sockaddr *) &addr, len, host, sizeof(host), serv, sizeof(serv),
+				NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+			snprintf(c->peer, sizeof(c->peer), "http %s:%s", host, serv);
+		else
+			snprintf(c->peer, sizeof(c->peer), "http client");
+		c->out.spec = &http_spec;
+		c->out.fd = fd;
+		c->out.event.fd = fd;
+		c->out.event.handler = http_client_event;
+		clock_gettime(CLOCK_MONOTONIC, &c->accepted);
+		c->next = http_pending;
+		http_pending = c;
+		if (event_update(&c->out.event, EPOLLIN) < 0)
+			http_client_close(c);
+	}
+}
+
+static void http_reap(void)
+{
+	struct http_client *c;
+
+	while ((c = http_closed)) {
+		http_closed = c->next;
+		free(c->reply);
+		free(c);
+	}
+}
+
+/* Closes the clients that have not sent a full request, or taken the
+ * reply to it, in time */
+static void http_expire(struct timespec *now)
+{
+	struct http_client *c, *next;
+
+	for (c = http_pending; c; c = next) {
+		next = c->next;
+		if (elapsed_us(&c->accepted, now) < HTTP_REQUEST_MS * 1000)
+			continue;
+		dlog(LOG_INFO, "%s: %s in %d ms, closing", c->peer,
+			c->reply ? "reply not taken" : "no request", HTTP_REQUEST_MS);
+		http_client_close(c);
+	}
+}
+
+static int http_start(void)
+{
+	struct stat st;
+	int fd, one = 1;
+
+	fd = socket(http_spec.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return 0;
+	/* A socket left by an earlier run; anything else makes bind fail */
+	if (http_spec.addr.ss_family == AF_UNIX &&
+	    lstat(http_spec.dest, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(http_spec.dest);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *) &http_spec.addr, http_spec.addrlen) < 0 ||
+	    listen(fd, 128) < 0) {
+		close(fd);
+		return 0;
+	}
+	http_listen.fd = fd;
+	http_listen.handler = http_accept;
+	return event_update(&http_listen, EPOLLIN) == 0;
+}
+
+/* What the encoder actually produces, measured on the PCR PID, against
+ * what it was configured for. Jitter is measured at USB transfer
+ * completion, so it includes the transfer granularity. */
+static void bmd_report_pcr_stats(struct blackmagic_device *bmd, int64_t us)
+{
+	struct ts_pcr_report pr;
+	uint64_t video = bmd->ts_stats.pid[BMD_PID_VIDEO].packets;
+	double video_kbps;
+
+	video_kbps = us > 0 ? (video - bmd->video_packets_reported) * 184 * 8000.0 / us : 0;
+	bmd->video_packets_reported = video;
+	if (!ts_pcr_report(&bmd->ts_stats.pcr, &pr))
+		return;
+
+	dlog(LOG_INFO, "%s: pcr: mux %.0f kbit/s, video %.0f kbit/s, interval avg %.1f ms, "
+		"max %.1f ms, jitter %.2f ms, clock drift %+.1f ppm over %.0f s, %llu discontinuities",
+		bmd->name, pr.bitrate / 1000, video_kbps,
+		pr.interval_avg_ms, pr.interval_max_ms, pr.jitter_ms,
+		pr.drift_ppm, pr.drift_span_s,
+		(unsigned long long) pr.discontinuities);
+
+	if (bmd->total_bandwidth && pr.bitrate > bmd->total_bandwidth)
+		dlog(LOG_WARNING, "%s: mux bitrate %.0f kbit/s above the configured %u kbit/s",
+			bmd->name, pr.bitrate / 1000, bmd->total_bandwidth / 1000);
+	if (video_kbps > ep.video_max_kbps)
+		dlog(LOG_WARNING, "%s: video bitrate %.0f kbit/s above --video-max-kbps %u",
+			bmd->name, video_kbps, ep.video_max_kbps);
+}
+
+static void bmd_report_mpegts_stats(struct blackmagic_device *bmd, struct timespec *now)
+{
+	struct mpegts_stats *st = &bmd->mpegts_stats;
+	struct ts_reader *rd;
+	int64_t us = elapsed_us(&bmd->mpegts_stats_start, now);
+	unsigned long long overruns = 0;
+	unsigned int high_water = 0;
+
+	for (rd = bmd->ring.readers; rd; rd = rd->next) {
+		if (rd->high_water > high_water)
+			high_water = rd->high_water;
+		overruns += rd->overruns;
+	}
+
+	if (st->transfers && us > 0)
+		dlog(LOG_INFO, "%s: mpeg-ts pump: %.0f kbit/s, %llu transfers, "
+			"latency avg %.2f ms, max %.2f ms, %llu timeouts, "
+			"ring high-water %u/%u packets, %llu overruns",
+			bmd->name, st->bytes * 8000.0 / us,
+			(unsigned long long) st->transfers,
+			st->latency_us / 1000.0 / st->transfers,
+			st->latency_max_us / 1000.0,
+			(unsigned long long) st->timeouts,
+			high_water, bmd->ring.size, overruns);
+
+	bmd_report_pcr_stats(bmd, us);
+
+	memset(st, 0, sizeof(*st));
+	bmd->mpegts_stats_start = *now;
+}
+
+/* What the policies that go by pictures did besides dropping packets */
+static void ts_reader_policy_stats(const struct ts_reader *rd, int policy, char *buf, size_t size)
+{
+	switch (policy) {
+	case TS_LAG_GOP:
+		snprintf(buf, size, ", %llu gop skips", rd->gop_skips);
+		break;
+	case TS_LAG_NONREF:
+		snprintf(buf, size, ", %llu non-reference packets thinned, %llu gop skips",
+			rd->thinned, rd->gop_skips);
+		break;
+	case TS_LAG_BLOCK:
+		snprintf(buf, size, ", blocked %.1f ms, %llu timeouts",
+			rd->blocked_us / 1000.0, rd->block_timeouts);
+		break;
+	default:
+		buf[0] = 0;
+	}
+}
+
+/* Input side counts loss between the encoder and the parser (USB or
+ * device), output side counts what was lost towards the consumer. */
+static void bmd_report_stream_stats(struct blackmagic_device *bmd, int prio, int per_pid)
+{
+	struct ts_stats *st = &bmd->ts_stats;
+	struct ts_pid_stats *ps;
+	struct bmd_output *o;
+	struct http_client *c;
+	struct hls_stats hs;
+	struct rec_stats *rs = &bmd->rec.stats;
+	struct dvr_index di;
+	struct ts_reader total;
+	char policy[128], lat[128];
+	int pid, i, clients = 0;
+
+	dlog(prio, "%s: stream input: %llu cc errors, %llu tei, %llu resyncs (%llu bytes), "
+		"%llu zero-fill, %llu null packets",
+		bmd->name,
+		(unsigned long long) st->cc_errors, (unsigned long long) st->tei,
+		(unsigned long long) st->resyncs, (unsigned long long) st->resync_bytes,
+		(unsigned long long) st->zero_packets, (unsigned long long) st->null_packets);
+	if (bmd->emu)
+		dlog(prio, "%s: emulated device: %llu kB sent, %llu kB the host was too slow for",
+			bmd->name, (unsigned long long) bmd->emu->sent / 1024,
+			(unsigned long long) bmd->emu->overflow / 1024);
+	if (bmd->ring.renew_errors)
+		dlog(LOG_ERR, "%s: stream buffer: unable to renew %llu pinned blocks, out of memory",
+			bmd->name, bmd->ring.renew_errors);
+	if (bmd->mpegparser.rebase)
+		dlog(prio, "%s: stream rebase: %llu restarts, timestamps moved by %.3f s",
+			bmd->name, (unsigned long long) bmd->rebase.rebases,
+			(double) bmd->rebase.offset / TS_PCR_HZ);
+	for (i = 0; i < bmd->num_outputs; i++) {
+		o = &bmd->outputs[i];
+		ts_reader_policy_stats(&o->reader, o->reader.policy, policy, sizeof(policy));
+		dlog(prio, "%s: stream output %s: %llu packets dropped by lag policy %s%s, "
+			"%llu bytes on write errors, high-water %u/%u packets",
+			bmd->name, bmd_output_name(o),
+			o->reader.overruns, ts_lag_policy_names[o->spec->lag_policy], policy,
+			(unsigned long long) o->dropped,
+			o->reader.high_water, o->reader.lag_limit);
+	}
+	memset(&total, 0, sizeof(total));
+	for (c = bmd->http_clients; c; c = c->next, clients++) {
+		total.overruns += c->out.reader.overruns;
+		total.gop_skips += c->out.reader.gop_skips;
+		total.thinned += c->out.reader.thinned;
+		total.blocked_us += c->out.reader.blocked_us;
+		total.block_timeouts += c->out.reader.block_timeouts;
+	}
+	if (clients) {
+		ts_reader_policy_stats(&total, http_spec.lag_policy, policy, sizeof(policy));
+		dlog(prio, "%s: stream output http: %d clients, %llu packets dropped by lag policy %s%s",
+			bmd->name, clients, total.overruns, ts_lag_policy_names[http_spec.lag_policy], policy);
+	}
+	if (bmd->mpegparser.hls) {
+		hls_get_stats(bmd->mpegparser.hls, &hs);
+		dlog(prio, "%s: stream output hls: %llu segments (%.1f s, %llu kB), %llu dropped, "
+			"%llu write errors, %.3f%% segmenting + %.3f%% writing of stream time",
+			bmd->name, (unsigned long long) hs.segments, hs.media_s,
+			(unsigned long long) hs.bytes / 1024,
+			(unsigned long long) hs.dropped, (unsigned long long) hs.errors,
+			hs.media_s > 0 ? hs.cut_s * 100 / hs.media_s : 0,
+			hs.media_s > 0 ? hs.write_s * 100 / hs.media_s : 0);
+	}
+	if (bmd->mpegparser.rec)
+		dlog(prio, "%s: stream output record: %llu files, %llu kB written, %llu kB dropped, "
+			"%llu write errors, %d/%d buffers high-water, write latency avg %.1f ms max %.1f ms",
+			bmd->name, (unsigned long long) rs->files,
+			(unsigned long long) rs->bytes / 1024, (unsigned long long) rs->dropped / 1024,
+			(unsigned long long) rs->errors, rs->queued_max, bmd->rec.cfg.buffers,
+			rs->writes ? rs->write_us / 1e3 / rs->writes : 0, rs->write_max_us / 1e3);
+	if (bmd->metrics.usb_interval.count) {
+		hist_format(&bmd->metrics.usb_interval, lat, sizeof(lat));
+		dlog(prio, "%s: latency usb completion interval: %s", bmd->name, lat);
+	}
+	if (bmd->metrics.delivery.count) {
+		hist_format(&bmd->metrics.delivery, lat, sizeof(lat));
+		dlog(prio, "%s: latency usb completion to output write: %s", bmd->name, lat);
+	}
+	if (bmd->mpegparser.rec && rs->write_hist.count) {
+		hist_format(&rs->write_hist, lat, sizeof(lat));
+		dlog(prio, "%s: latency record write queue: %s", bmd->name, lat);
+	}
+	if (bmd->mpegparser.dvr && dvr_find(&bmd->dvr, DVR_KEY_PCR, 0, 1, &di))
+		dlog(prio, "%s: stream output dvr: %.1f s of %d min held, %llu random access points",
+			bmd->name, (double) (bmd->dvr.hdr->pcr - di.pcr) / TS_PCR_HZ, ep.dvr_minutes,
+			(unsigned long long) bmd->dvr.hdr->index_head);
+
+	if (!per_pid)
+		return;
+	for (pid = 0; pid < TS_PID_MAX; pid++) {
+		ps = &st->pid[pid];
+		if (!ps->packets)
+			continue;
+		dlog(prio, "%s: pid 0x%04x: %llu packets, %u cc errors, %u tei",
+			bmd->name, pid, (unsigned long long) ps->packets,
+			ps->cc_errors, ps->tei);
+	}
+}
+
+/* The block policy holds the device back for outputs that could not
+ * take the transfers in flight and one more: completed transfers are
+ * not resubmitted until the outputs have caught up, which is checked
+ * when they become writable, for at most BMD_BLOCK_MS. The device
+ * buffers the stream meanwhile and nothing waits, other devices keep
+ * streaming. Once the time is up the outputs are no longer waited for
+ * and ts_ring_make_room() skips them as with the gop policy. */
+#define BMD_BLOCK_MS		100
+#define BMD_TRANSFER_PACKETS	(sizeof(((struct mpegts_transfer *) 0)->data) / 0xbc + 1)
+
+static int bmd_output_blocking(struct bmd_output *o, int transfers)
+{
+	struct ts_reader *rd = &o->reader;
+	unsigned int lag;
+
+	if (o->fd < 0 || rd->policy != TS_LAG_BLOCK)
+		return 0;
+	lag = o->bmd->ring.head + transfers * BMD_TRANSFER_PACKETS - rd->cursor;
+	if (lag <= rd->lag_limit) {
+		o->block_expired = 0;
+		return 0;
+	}
+	if (o->block_expired)
+		return 0;
+	o->blocking = 1;
+	return 1;
+}
+
+/* Checks if an output would be put over its limit by 'transfers' */
+static int bmd_outputs_blocking(struct blackmagic_device *bmd, int transfers)
+{
+	struct http_client *c;
+	int i, r = 0;
+
+	for (i = 0; i < bmd->num_outputs; i++)
+		r |= bmd_output_blocking(&bmd->outputs[i], transfers);
+	for (c = bmd->http_clients; c; c = c->next)
+		r |= bmd_output_blocking(&c->out, transfers);
+	return r;
+}
+
+static void bmd_output_unblock(struct bmd_output *o, int64_t us, int expired)
+{
+	if (!o->blocking)
+		return;
+	o->blocking = 0;
+	o->block_expired = expired;
+	o->reader.blocked_us += us;
+}
+
+/* Resubmits held back transfers as far as the outputs can take them, or
+ * all of them once BMD_BLOCK_MS is up. Only while the pump runs: the
+ * transfers are let go when it is cancelled. */
+static void bmd_mpegts_resume(struct blackmagic_device *bmd)
+{
+	struct mpegts_transfer *mt;
+	struct http_client *c;
+	struct timespec now;
+	int64_t us;
+	int i, expired;
+
+	if (!bmd->mpegts_held || bmd->state != BMD_STATE_RUNNING)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = elapsed_us(&bmd->mpegts_held_since, &now);
+	expired = us >= BMD_BLOCK_MS * 1000;
+	for (i = 0; i < ep.usb_transfers && bmd->mpegts_held; i++) {
+		mt = &bmd->mpegts_transfers[i];
+		if (!mt->held)
+			continue;
+		if (!expired && bmd_outputs_blocking(bmd, bmd->mpegts_active + 1))
+			return;
+		mt->held = 0;
+		bmd->mpegts_held--;
+		mt->submitted = now;
+		if (bmd_submit(bmd, mt->transfer) == LIBUSB_SUCCESS)
+			bmd->mpegts_active++;
+	}
+	for (i = 0; i < bmd->num_outputs; i++)
+		bmd_output_unblock(&bmd->outputs[i], us, expired);
+	for (c = bmd->http_clients; c; c = c->next)
+		bmd_output_unblock(&c->out, us, expired);
+}
+
+static void bmd_mpegts_complete(struct libusb_transfer *transfer)
+{
+	struct mpegts_transfer *mt = transfer->user_data;
+	struct blackmagic_device *bmd = mt->bmd;
+	struct mpegts_stats *st = &bmd->mpegts_stats;
+	struct timespec now;
+	int64_t latency;
+	unsigned int head;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		dlog(LOG_INFO, "%s: mpeg-ts pump: timeout reading data, retrying!", bmd->name);
+		st->timeouts++;
+		bmd->metrics.usb_timeouts++;
+		/* fall through - partial data may have been received */
+	case LIBUSB_TRANSFER_COMPLETED:
+		break;
+	default:
+		dlog(LOG_DEBUG, "%s: mpeg-ts transfer finished: status %d",
+			bmd->name, transfer->status);
+		bmd->mpegts_active--;
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	latency = elapsed_us(&mt->submitted, &now);
+	st->bytes += transfer->actual_length;
+	st->transfers++;
+	st->latency_us += latency;
+	bmd->metrics.usb_bytes += transfer->actual_length;
+	bmd->metrics.usb_transfers++;
+	if (latency > st->latency_max_us)
+		st->latency_max_us = latency;
+	if (elapsed_us(&bmd->mpegts_stats_start, &now) >= 10000000)
+		bmd_report_mpegts_stats(bmd, &now);
+
+	head = bmd->ring.head;
+	bmd->ts_stats.arrival_us = now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+	if (bmd->metrics.last_completion_us)
+		hist_add(&bmd->metrics.usb_interval, bmd->ts_stats.arrival_us - bmd->metrics.last_completion_us);
+	bmd->metrics.last_completion_us = bmd->ts_stats.arrival_us;
+	mpegparser_parse(&bmd->mpegparser, mt->data, transfer->actual_length);
+	if (bmd->first_packet_pending && bmd->ring.head != head) {
+		bmd->first_packet_pending = 0;
+		bmd->metrics.first_packet_us = elapsed_us(&bmd->encode_start, &now);
+		dlog(LOG_INFO, "%s: first packet %.1f ms after encoder start",
+			bmd->name, bmd->metrics.first_packet_us / 1000.0);
+	}
+	bmd_write_output(bmd);
+
+	if (bmd->state == BMD_STATE_RUNNING) {
+		mt->submitted = now;
+		if (bmd_outputs_blocking(bmd, bmd->mpegts_active)) {
+			if (!bmd->mpegts_held)
+				bmd->mpegts_held_since = now;
+			mt->held = 1;
+			bmd->mpegts_held++;
+		} else if (bmd_submit(bmd, transfer) == LIBUSB_SUCCESS) {
+			return;
+		}
+	}
+	bmd->mpegts_active--;
+}
+
+static int bmd_start_mpegts(struct blackmagic_device *bmd)
+{
+	struct mpegts_transfer *mt;
+	int i, r, n = ep.usb_transfers;
+
+	bmd->mpegts_transfers = calloc(n, sizeof(struct mpegts_transfer));
+	if (bmd->mpegts_transfers == NULL)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &bmd->mpegts_stats_start);
+	for (i = 0; i < n; i++) {
+		mt = &bmd->mpegts_transfers[i];
+		mt->bmd = bmd;
+		mt->transfer = libusb_alloc_transfer(0);
+		if (mt->transfer == NULL)
+			break;
+		libusb_fill_bulk_transfer(mt->transfer, bmd->usbdev_handle, 0x86,
+			mt->data, sizeof(mt->data), bmd_mpegts_complete, mt, 5000);
+		mt->submitted = bmd->mpegts_stats_start;
+		r = bmd_submit(bmd, mt->transfer);
+		if (r != LIBUSB_SUCCESS) {
+			dlog(LOG_ERR, "%s: failed to submit mpeg-ts transfer: %s",
+				bmd->name, libusb_error_name(r));
+			break;
+		}
+		bmd->mpegts_active++;
+	}
+	dlog(LOG_DEBUG, "%s: mpeg-ts pump: %d transfers in flight", bmd->name, bmd->mpegts_active);
+
+	return bmd->mpegts_active != 0;
+}
+
+static void bmd_cancel_mpegts(struct blackmagic_device *bmd)
+{
+	struct mpegts_transfer *mt;
+	struct http_client *c;
+	struct timespec now;
+	int64_t us;
+	int i;
+
+	if (bmd->mpegts_transfers == NULL)
+		return;
+	for (i = 0; i < ep.usb_transfers; i++) {
+		mt = &bmd->mpegts_transfers[i];
+		if (mt->held)
+			mt->held = 0;
+		else if (mt->transfer)
+			bmd_cancel(bmd, mt->transfer);
+	}
+	if (!bmd->mpegts_held)
+		return;
+	/* Held transfers are no longer waited for */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = elapsed_us(&bmd->mpegts_held_since, &now);
+	bmd->mpegts_held = 0;
+	for (i = 0; i < bmd->num_outputs; i++)
+		bmd_output_unblock(&bmd->outputs[i], us, 0);
+	for (c = bmd->http_clients; c; c = c->next)
+		bmd_output_unblock(&c->out, us, 0);
+}
+
+static void bmd_free_mpegts(struct blackmagic_device *bmd)
+{
+	int i;
+
+	if (bmd->mpegts_transfers == NULL)
+		return;
+	for (i = 0; i < ep.usb_transfers; i++)
+		libusb_free_transfer(bmd->mpegts_transfers[i].transfer);
+	free(bmd->mpegts_transfers);
+	bmd->mpegts_transfers = NULL;
+}
+
+static void bmd_mac_read(struct blackmagic_device *bmd, struct bmd_ctrl *c, int r)
+{
+	if (r == 1)
+		bmd->mac[c->arg] = c->data[0];
+	else if (r < 0 && bmd->status == LIBUSB_SUCCESS)
+		bmd->status = r;
+}
+
+static void bmd_mac_done(struct blackmagic_device *bmd, struct bmd_ctrl *c, int r)
+{
+	dlog(LOG_NOTICE, "%s: MAC address %02x:%02x:%02x:%02x:%02x:%02x",
+		bmd->name,
+		bmd->mac[0], bmd->mac[1], bmd->mac[2],
+		bmd->mac[3], bmd->mac[4], bmd->mac[5]);
+}
+
+static void bmd_recognize_device(struct blackmagic_device *bmd)
+{
+	struct bmd_ctrl *c;
 	int i;
 
 	bmd->recognized = 1;
 
 	/* Pro Recorder does not have a NIC */
 	if (bmd->desc.idProduct == USB_PID_BMD_H264_PRO_RECORDER)
-		return 1;
+		return;
 
 	/* ATEM TV Studio register layout:
 	 * 0x84..0x87	firmware version, timestamp or checksum
@@ -755,25 +2493,26 @@ static int bmd_recognize_device(struct blackmagic_device *bmd)
 	 * 0xa8..0xab	ipv4 gateway
 	 */
 
-	for (i = 0; i < 6; i++)
-		bmd_read_register(bmd, 0x88 + i, &bmd->mac[i]);
-
-	dlog(LOG_NOTICE, "%s: MAC address %02x:%02x:%02x:%02x:%02x:%02x",
-		bmd->name,
-		bmd->mac[0], bmd->mac[1], bmd->mac[2],
-		bmd->mac[3], bmd->mac[4], bmd->mac[5]);
-
-	return bmd->status == LIBUSB_SUCCESS;
+	for (i = 0; i < 6; i++) {
+		c = bmd_ctrl_queue(bmd, 0, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
+				   VR_READ_REGISTER, 0x0000, (0x88 + i) << 8, NULL, 1, 1000);
+		if (c) {
+			c->done = bmd_mac_read;
+			c->arg = i;
+		}
+	}
+	bmd_ctrl_call(bmd, bmd_mac_done);
+	bmd_ctrl_next(bmd);
 }
 
-static int bmd_configure_encoder(struct blackmagic_device *bmd, struct encoding_parameters *ep)
+static void bmd_configure_encoder(struct blackmagic_device *bmd, struct encoding_parameters *ep)
 {
-	uint8_t fpga_command_1[1] = { 0x20 };
-	uint8_t fpga_command_2[1] = { 0x40 };
+	static const uint8_t fpga_command_1[1] = { 0x20 };
+	static const uint8_t fpga_command_2[1] = { 0x40 };
 	struct display_mode *current_mode = bmd->current_mode;
+	struct fujitsu_regimage img = { 0 };
 	uint32_t total_bandwidth;
 	float fps;
-	int r;
 
 	fps = (float)current_mode->fps_numerator / current_mode->fps_denominator;
 
@@ -782,135 +2521,120 @@ static int bmd_configure_encoder(struct blackmagic_device *bmd, struct encoding_
 	total_bandwidth += (ep->audio_kbps * 1000.0 * 1024 / (8 * ep->audio_khz) + 14) / 148 * 1504.0 * ep->audio_khz / 1024;
 	total_bandwidth += 48128.0 * fps / ((fps == 25 || fps == 50) ? 12 : 15);
 	total_bandwidth += 1.021739130434783 * (ceil(1464*fps) + ceil(152*fps) + (ep->video_max_kbps + 1000) * 1000);
+	bmd->total_bandwidth = total_bandwidth;
 
-	r = libusb_control_transfer(
-		bmd->usbdev_handle, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-		current_mode->program_fpga ? VR_SEND_FPGA_COMMAND : VR_CLEAR_FPGA_COMMAND, 0, 0,
-		fpga_command_1, sizeof(fpga_command_1), 1000);
-	if (r < 0) {
-		bmd->status = r;
-		return 0;
-	}
-	r = libusb_control_transfer(
-		bmd->usbdev_handle, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-		VR_CLEAR_FPGA_COMMAND, 0, 0,
-		fpga_command_2, sizeof(fpga_command_2), 1000);
-	if (r < 0) {
-		bmd->status = r;
-		return 0;
-	}
-
-	r = libusb_control_transfer(
-		bmd->usbdev_handle, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,  
-		VR_SET_AUDIO_DELAY, 0, 0, &current_mode->audio_delay, 1, 5000);
-	if (r < 0) {
-		bmd->status = r;
-		return 0;
-	}
+	bmd_ctrl_queue(bmd, 0, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
+		       current_mode->program_fpga ? VR_SEND_FPGA_COMMAND : VR_CLEAR_FPGA_COMMAND, 0, 0,
+		       fpga_command_1, sizeof(fpga_command_1), 1000);
+	bmd_ctrl_queue(bmd, 0, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
+		       VR_CLEAR_FPGA_COMMAND, 0, 0,
+		       fpga_command_2, sizeof(fpga_command_2), 1000);
+	bmd_ctrl_queue(bmd, 0, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
+		       VR_SET_AUDIO_DELAY, 0, 0, &current_mode->audio_delay, 1, 5000);
 
 	/* Group 1 - likely muxing related */
-	bmd_fujitsu_write(bmd, 0x0800ea, 0x0a0c);
-	bmd_fujitsu_write(bmd, 0x0800ec, 0x000d);
-	bmd_fujitsu_write(bmd, 0x0800ee, 0x0000);
-	bmd_fujitsu_write(bmd, 0x0800f0, 0x0504);
-	bmd_fujitsu_write(bmd, 0x0800f2, 0x4844);
-	bmd_fujitsu_write(bmd, 0x0800f4, 0x4d56);
-	bmd_fujitsu_write(bmd, 0x0800f6, 0x8804);
-	bmd_fujitsu_write(bmd, 0x0800f8, 0x0fff);
-	bmd_fujitsu_write(bmd, 0x0800fa, 0xfcfc);
-	bmd_fujitsu_write(bmd, 0x080100, 0x6308);
-	bmd_fujitsu_write(bmd, 0x080102, 0xc000 | ((total_bandwidth/400) >> 8));
-	bmd_fujitsu_write(bmd, 0x080104, 0x00ff | ((total_bandwidth/400) << 8));
-	bmd_fujitsu_write(bmd, 0x080106, 0xffff);
-	bmd_fujitsu_write(bmd, 0x080108, 0xffff);
-	bmd_fujitsu_write(bmd, 0x080110, 0x1bf0);
-	bmd_fujitsu_write(bmd, 0x080112, 0x11f0);
-	bmd_fujitsu_write(bmd, 0x080114, 0x0302);
-	bmd_fujitsu_write(bmd, 0x080116, 0x0102 | (current_mode->fx2_fps << 3));
-	bmd_fujitsu_write(bmd, 0x080118, 0x0ff1); //(audiomode_related_fixed_var << 8) | 0xf1
-	bmd_fujitsu_write(bmd, 0x08011a, 0x00f0);
-	bmd_fujitsu_write(bmd, 0x08011c, 0x0000);
+	fujitsu_regimage_set(&img, 0x0800ea, 0x0a0c);
+	fujitsu_regimage_set(&img, 0x0800ec, 0x000d);
+	fujitsu_regimage_set(&img, 0x0800ee, 0x0000);
+	fujitsu_regimage_set(&img, 0x0800f0, 0x0504);
+	fujitsu_regimage_set(&img, 0x0800f2, 0x4844);
+	fujitsu_regimage_set(&img, 0x0800f4, 0x4d56);
+	fujitsu_regimage_set(&img, 0x0800f6, 0x8804);
+	fujitsu_regimage_set(&img, 0x0800f8, 0x0fff);
+	fujitsu_regimage_set(&img, 0x0800fa, 0xfcfc);
+	fujitsu_regimage_set(&img, 0x080100, 0x6308);
+	fujitsu_regimage_set(&img, 0x080102, 0xc000 | ((total_bandwidth/400) >> 8));
+	fujitsu_regimage_set(&img, 0x080104, 0x00ff | ((total_bandwidth/400) << 8));
+	fujitsu_regimage_set(&img, 0x080106, 0xffff);
+	fujitsu_regimage_set(&img, 0x080108, 0xffff);
+	fujitsu_regimage_set(&img, 0x080110, 0x1bf0);
+	fujitsu_regimage_set(&img, 0x080112, 0x11f0);
+	fujitsu_regimage_set(&img, 0x080114, 0x0302);
+	fujitsu_regimage_set(&img, 0x080116, 0x0102 | (current_mode->fx2_fps << 3));
+	fujitsu_regimage_set(&img, 0x080118, 0x0ff1); //(audiomode_related_fixed_var << 8) | 0xf1
+	fujitsu_regimage_set(&img, 0x08011a, 0x00f0);
+	fujitsu_regimage_set(&img, 0x08011c, 0x0000);
 
 	/* Group 2 - MPEG TS muxer */
-	bmd_fujitsu_write(bmd, 0x001000, current_mode->r1000);
-	bmd_fujitsu_write(bmd, 0x001002, 0x8480);
-	bmd_fujitsu_write(bmd, 0x001004, 0x0002);
-	bmd_fujitsu_write(bmd, 0x001006, total_bandwidth / 1000);
-	bmd_fujitsu_write(bmd, 0x001008, 0x0000);
-	bmd_fujitsu_write(bmd, 0x00100c, 0x0000);
-	bmd_fujitsu_write(bmd, 0x00100e, 0x0000);
-	bmd_fujitsu_write(bmd, 0x001010, 0x0000);
-	bmd_fujitsu_write(bmd, 0x001012, 0x0000);
-	bmd_fujitsu_write(bmd, 0x001014, 0x0000);
-	bmd_fujitsu_write(bmd, 0x001016, 0x1011);	// Video PID
-	bmd_fujitsu_write(bmd, 0x001018, 0x1100);	// Audio PID
-	bmd_fujitsu_write(bmd, 0x00101a, 0x0100);	// Program Map Table PID
-	bmd_fujitsu_write(bmd, 0x00101c, 0x001f);	// DVB SIT PID
-	bmd_fujitsu_write(bmd, 0x00101e, 0x1001);	// Program clock PID
-	bmd_fujitsu_write(bmd, 0x001020, 0x00e0);	// Video PES stream ID
-	bmd_fujitsu_write(bmd, 0x001022, 0x00c0);	// Audio PES stream ID
-	bmd_fujitsu_write(bmd, 0x001146, 0x0101);
-	bmd_fujitsu_write(bmd, 0x001148, 0x0100);
+	fujitsu_regimage_set(&img, 0x001000, current_mode->r1000);
+	fujitsu_regimage_set(&img, 0x001002, 0x8480);
+	fujitsu_regimage_set(&img, 0x001004, 0x0002);
+	fujitsu_regimage_set(&img, 0x001006, total_bandwidth / 1000);
+	fujitsu_regimage_set(&img, 0x001008, 0x0000);
+	fujitsu_regimage_set(&img, 0x00100c, 0x0000);
+	fujitsu_regimage_set(&img, 0x00100e, 0x0000);
+	fujitsu_regimage_set(&img, 0x001010, 0x0000);
+	fujitsu_regimage_set(&img, 0x001012, 0x0000);
+	fujitsu_regimage_set(&img, 0x001014, 0x0000);
+	fujitsu_regimage_set(&img, 0x001016, BMD_PID_VIDEO);	// Video PID
+	fujitsu_regimage_set(&img, 0x001018, BMD_PID_AUDIO);	// Audio PID
+	fujitsu_regimage_set(&img, 0x00101a, BMD_PID_PMT);	// Program Map Table PID
+	fujitsu_regimage_set(&img, 0x00101c, BMD_PID_SIT);	// DVB SIT PID
+	fujitsu_regimage_set(&img, 0x00101e, BMD_PID_PCR);	// Program clock PID
+	fujitsu_regimage_set(&img, 0x001020, 0x00e0);	// Video PES stream ID
+	fujitsu_regimage_set(&img, 0x001022, 0x00c0);	// Audio PES stream ID
+	fujitsu_regimage_set(&img, 0x001146, 0x0101);
+	fujitsu_regimage_set(&img, 0x001148, 0x0100);
 
 	/* Group 3 - H264 encoder, video source tuning */
-	bmd_fujitsu_write(bmd, 0x001404, current_mode->r1404);
-	bmd_fujitsu_write(bmd, 0x001406, ep->video_max_kbps + 1000);
-	bmd_fujitsu_write(bmd, 0x001408, ep->video_kbps);
-	bmd_fujitsu_write(bmd, 0x00140a, current_mode->r140a);
-	bmd_fujitsu_write(bmd, 0x00140c, ep->h264_cabac ? 0x0000 : 0x0100);
-	bmd_fujitsu_write(bmd, 0x00140e, 0xd400 | ((current_mode->fps_denominator == 1) ? 0x0001 : 0x0000));
-	bmd_fujitsu_write(bmd, 0x001418, 0x0001);
-	bmd_fujitsu_write(bmd, 0x001420, 0x0000);
-	bmd_fujitsu_write(bmd, 0x001422, ep->video_max_kbps);
+	fujitsu_regimage_set(&img, 0x001404, current_mode->r1404);
+	fujitsu_regimage_set(&img, 0x001406, ep->video_max_kbps + 1000);
+	fujitsu_regimage_set(&img, 0x001408, ep->video_kbps);
+	fujitsu_regimage_set(&img, 0x00140a, current_mode->r140a);
+	fujitsu_regimage_set(&img, 0x00140c, ep->h264_cabac ? 0x0000 : 0x0100);
+	fujitsu_regimage_set(&img, 0x00140e, 0xd400 | ((current_mode->fps_denominator == 1) ? 0x0001 : 0x0000));
+	fujitsu_regimage_set(&img, 0x001418, 0x0001);
+	fujitsu_regimage_set(&img, 0x001420, 0x0000);
+	fujitsu_regimage_set(&img, 0x001422, ep->video_max_kbps);
 	/* Register 0x1430 lower byte is related to INPUT MODE/TARGET MODE specific.
 	 *  affects directly the output stream resolution, possibly TS mode bits. */
-	bmd_fujitsu_write(bmd, 0x001430, current_mode->r1430_l | (ep->h264_bframes ? 0x0000 : 0x0100));
-	bmd_fujitsu_write(bmd, 0x001470, current_mode->r147x[0]);
-	bmd_fujitsu_write(bmd, 0x001472, current_mode->r147x[1]);
-	bmd_fujitsu_write(bmd, 0x001474, current_mode->r147x[2]);
-	bmd_fujitsu_write(bmd, 0x001476, current_mode->r147x[3]);
-	bmd_fujitsu_write(bmd, 0x001478, 0x0000);
-	bmd_fujitsu_write(bmd, 0x00147a, 0x0000);
-	bmd_fujitsu_write(bmd, 0x00147c, 0x0000);
-	bmd_fujitsu_write(bmd, 0x00147e, 0x0000);
+	fujitsu_regimage_set(&img, 0x001430, current_mode->r1430_l | (ep->h264_bframes ? 0x0000 : 0x0100));
+	fujitsu_regimage_set(&img, 0x001470, current_mode->r147x[0]);
+	fujitsu_regimage_set(&img, 0x001472, current_mode->r147x[1]);
+	fujitsu_regimage_set(&img, 0x001474, current_mode->r147x[2]);
+	fujitsu_regimage_set(&img, 0x001476, current_mode->r147x[3]);
+	fujitsu_regimage_set(&img, 0x001478, 0x0000);
+	fujitsu_regimage_set(&img, 0x00147a, 0x0000);
+	fujitsu_regimage_set(&img, 0x00147c, 0x0000);
+	fujitsu_regimage_set(&img, 0x00147e, 0x0000);
 
 	/* INPUT MODE based constants likely tuning for sync or similar,
 	 * some of these seem to get ignored (and initialized to random
 	 * value by the BMD drivers). */
-	bmd_fujitsu_write(bmd, 0x001540, current_mode->r154x[0]);
-	bmd_fujitsu_write(bmd, 0x001542, current_mode->r154x[1]);
-	bmd_fujitsu_write(bmd, 0x001544, current_mode->r154x[2]);
-	bmd_fujitsu_write(bmd, 0x001546, current_mode->r154x[3]);
-	bmd_fujitsu_write(bmd, 0x001548, current_mode->r154x[4]);
-	bmd_fujitsu_write(bmd, 0x00154a, current_mode->r154x[5]);
-	bmd_fujitsu_write(bmd, 0x00154c, current_mode->r154x[6]);
-	bmd_fujitsu_write(bmd, 0x00154e, current_mode->r154x[7]);
-	bmd_fujitsu_write(bmd, 0x001550, current_mode->r154x[8]);
-	bmd_fujitsu_write(bmd, 0x001552, current_mode->r154x[9]);
-	bmd_fujitsu_write(bmd, 0x001554, current_mode->r154x[10]);
+	fujitsu_regimage_set(&img, 0x001540, current_mode->r154x[0]);
+	fujitsu_regimage_set(&img, 0x001542, current_mode->r154x[1]);
+	fujitsu_regimage_set(&img, 0x001544, current_mode->r154x[2]);
+	fujitsu_regimage_set(&img, 0x001546, current_mode->r154x[3]);
+	fujitsu_regimage_set(&img, 0x001548, current_mode->r154x[4]);
+	fujitsu_regimage_set(&img, 0x00154a, current_mode->r154x[5]);
+	fujitsu_regimage_set(&img, 0x00154c, current_mode->r154x[6]);
+	fujitsu_regimage_set(&img, 0x00154e, current_mode->r154x[7]);
+	fujitsu_regimage_set(&img, 0x001550, current_mode->r154x[8]);
+	fujitsu_regimage_set(&img, 0x001552, current_mode->r154x[9]);
+	fujitsu_regimage_set(&img, 0x001554, current_mode->r154x[10]);
 
 	/* Group 4 - Audio encoder */
 	switch (ep->audio_khz) {
 	case 32000:
-		bmd_fujitsu_write(bmd, 0x001802, 2);
+		fujitsu_regimage_set(&img, 0x001802, 2);
 		break;
 	case 44100:
-		bmd_fujitsu_write(bmd, 0x001802, 1);
+		fujitsu_regimage_set(&img, 0x001802, 1);
 		break;
 	case 48000:
 	default:
-		bmd_fujitsu_write(bmd, 0x001802, 0);
+		fujitsu_regimage_set(&img, 0x001802, 0);
 		break;
 	}
-	bmd_fujitsu_write(bmd, 0x001804, ep->audio_kbps);
-	bmd_fujitsu_write(bmd, 0x001806, 0x02c0);
-	bmd_fujitsu_write(bmd, 0x001810, 0x0000);
-	bmd_fujitsu_write(bmd, 0x001812, current_mode->ain_offset);
+	fujitsu_regimage_set(&img, 0x001804, ep->audio_kbps);
+	fujitsu_regimage_set(&img, 0x001806, 0x02c0);
+	fujitsu_regimage_set(&img, 0x001810, 0x0000);
+	fujitsu_regimage_set(&img, 0x001812, current_mode->ain_offset);
 	if (0 /*audio_format == 5*/) {
-		bmd_fujitsu_write(bmd, 0x001830, 0x0000);
+		fujitsu_regimage_set(&img, 0x001830, 0x0000);
 	} else if (1 /*audio_format == 4 - AAC */) {
-		bmd_fujitsu_write(bmd, 0x001850, 0x0033);
-		bmd_fujitsu_write(bmd, 0x001852, 0x0200);
+		fujitsu_regimage_set(&img, 0x001850, 0x0033);
+		fujitsu_regimage_set(&img, 0x001852, 0x0200);
 	}
 
 	/* Group 5 - Scaler / H.264 encoder */
@@ -918,60 +2642,69 @@ static int bmd_configure_encoder(struct blackmagic_device *bmd, struct encoding_
 		// bit 0x8000 resolution converter enabled
 		// bit 0x00ff conversion target, 0=no conversion, 4=NTSC, 5=PAL, 0xff=progressive
 
-		bmd_fujitsu_write(bmd, 0x001520, 0x80ff);
-		bmd_fujitsu_write(bmd, 0x001522, ep->src_x);	// src x offset
-		bmd_fujitsu_write(bmd, 0x001524, ep->src_y);	// src y offset
-		bmd_fujitsu_write(bmd, 0x001526, ep->src_width?ep->src_width:current_mode->width);	// src width
-		bmd_fujitsu_write(bmd, 0x001528, ep->src_height?ep->src_height:current_mode->height);// src height (1080)
-		bmd_fujitsu_write(bmd, 0x00152e, ep->dst_width?ep->dst_width:current_mode->width);	// dst width
-		bmd_fujitsu_write(bmd, 0x001530, ep->dst_height?ep->dst_height:current_mode->height);// dst height (1088)
+		fujitsu_regimage_set(&img, 0x001520, 0x80ff);
+		fujitsu_regimage_set(&img, 0x001522, ep->src_x);	// src x offset
+		fujitsu_regimage_set(&img, 0x001524, ep->src_y);	// src y offset
+		fujitsu_regimage_set(&img, 0x001526, ep->src_width?ep->src_width:current_mode->width);	// src width
+		fujitsu_regimage_set(&img, 0x001528, ep->src_height?ep->src_height:current_mode->height);// src height (1080)
+		fujitsu_regimage_set(&img, 0x00152e, ep->dst_width?ep->dst_width:current_mode->width);	// dst width
+		fujitsu_regimage_set(&img, 0x001530, ep->dst_height?ep->dst_height:current_mode->height);// dst height (1088)
 	} else if (current_mode->convert_to_1088) {
 		/* Convert to height 1088 */
-		bmd_fujitsu_write(bmd, 0x001520, 0x80ff);
-		bmd_fujitsu_write(bmd, 0x001522, 0);			// src x offset
-		bmd_fujitsu_write(bmd, 0x001524, 0);			// src y offset
-		bmd_fujitsu_write(bmd, 0x001526, current_mode->width);	// src width
-		bmd_fujitsu_write(bmd, 0x001528, current_mode->height);	// src height (1080)
-		bmd_fujitsu_write(bmd, 0x00152e, current_mode->width);	// dst width
-		bmd_fujitsu_write(bmd, 0x001530, 1088);			// dst height (1088)
+		fujitsu_regimage_set(&img, 0x001520, 0x80ff);
+		fujitsu_regimage_set(&img, 0x001522, 0);			// src x offset
+		fujitsu_regimage_set(&img, 0x001524, 0);			// src y offset
+		fujitsu_regimage_set(&img, 0x001526, current_mode->width);	// src width
+		fujitsu_regimage_set(&img, 0x001528, current_mode->height);	// src height (1080)
+		fujitsu_regimage_set(&img, 0x00152e, current_mode->width);	// dst width
+		fujitsu_regimage_set(&img, 0x001530, 1088);			// dst height (1088)
 	} else {
-		bmd_fujitsu_write(bmd, 0x001520, 0);	// 0=conversion
-		bmd_fujitsu_write(bmd, 0x001522, 0);	// src x offset
-		bmd_fujitsu_write(bmd, 0x001524, 0);	// src y offset
-		bmd_fujitsu_write(bmd, 0x001526, 0);	// src width
-		bmd_fujitsu_write(bmd, 0x001528, 0);	// src height
-		bmd_fujitsu_write(bmd, 0x00152e, 0);	// dst width
-		bmd_fujitsu_write(bmd, 0x001530, 0);	// dst height
-	}
-	bmd_fujitsu_write(bmd, 0x0015a0, (ep->h264_profile << 14) | ep->h264_level);
-	bmd_fujitsu_write(bmd, 0x0015a2, ((ep->dst_width?ep->dst_width:current_mode->width) + 15) >> 4);
-	bmd_fujitsu_write(bmd, 0x0015a4, ((ep->dst_height?ep->dst_height:current_mode->height) + 15) >> 4);
-	bmd_fujitsu_write(bmd, 0x0015a6, current_mode->fps_denominator); // divider
-	bmd_fujitsu_write(bmd, 0x0015a8, 2*current_mode->fps_numerator/ep->fps_divider >> 16);
-	bmd_fujitsu_write(bmd, 0x0015aa, 2*current_mode->fps_numerator/ep->fps_divider & 0xffff);
-	bmd_fujitsu_write(bmd, 0x0015ac, 0x0001); // {1=HD,2=PAL,3=NTSC} depends on target resolution
+		fujitsu_regimage_set(&img, 0x001520, 0);	// 0=conversion
+		fujitsu_regimage_set(&img, 0x001522, 0);	// src x offset
+		fujitsu_regimage_set(&img, 0x001524, 0);	// src y offset
+		fujitsu_regimage_set(&img, 0x001526, 0);	// src width
+		fujitsu_regimage_set(&img, 0x001528, 0);	// src height
+		fujitsu_regimage_set(&img, 0x00152e, 0);	// dst width
+		fujitsu_regimage_set(&img, 0x001530, 0);	// dst height
+	}
+	fujitsu_regimage_set(&img, 0x0015a0, (ep->h264_profile << 14) | ep->h264_level);
+	fujitsu_regimage_set(&img, 0x0015a2, ((ep->dst_width?ep->dst_width:current_mode->width) + 15) >> 4);
+	fujitsu_regimage_set(&img, 0x0015a4, ((ep->dst_height?ep->dst_height:current_mode->height) + 15) >> 4);
+	fujitsu_regimage_set(&img, 0x0015a6, current_mode->fps_denominator); // divider
+	fujitsu_regimage_set(&img, 0x0015a8, 2*current_mode->fps_numerator/ep->fps_divider >> 16);
+	fujitsu_regimage_set(&img, 0x0015aa, 2*current_mode->fps_numerator/ep->fps_divider & 0xffff);
+	fujitsu_regimage_set(&img, 0x0015ac, 0x0001); // {1=HD,2=PAL,3=NTSC} depends on target resolution
 	if (ep->fps_divider != 1) {
 		/* Possibly input-output frame ratio */
-		bmd_fujitsu_write(bmd, 0x0015b2, 0x8000 | ep->fps_divider);
-		bmd_fujitsu_write(bmd, 0x0015b4, 1);
+		fujitsu_regimage_set(&img, 0x0015b2, 0x8000 | ep->fps_divider);
+		fujitsu_regimage_set(&img, 0x0015b4, 1);
 	} else {
-		bmd_fujitsu_write(bmd, 0x0015b2, 0);
+		fujitsu_regimage_set(&img, 0x0015b2, 0);
 	}
 
 	/* Group 6 - Enable */
-	bmd_fujitsu_write(bmd, 0x001144, 0x3333);
+	fujitsu_regimage_set(&img, 0x001144, 0x3333);
 
-	return bmd->status == LIBUSB_SUCCESS;
+	bmd_fujitsu_apply(bmd, &img);
 }
 
-static void bmd_encoder_dump(struct blackmagic_device *bmd)
+static const uint32_t bmd_dump_regs[] = {
+	0x0015a8, 0x0015aa, 0x0015a6, 0x080116, 0x001812,
+	0x001000, 0x001404, 0x00140a, 0x001430,
+	0x001470, 0x001472, 0x001474, 0x001476,
+	0x001540, 0x001542, 0x001544, 0x001546, 0x001548, 0x00154a,
+	0x00154c, 0x00154e, 0x001550, 0x001552, 0x001554,
+};
+
+static void bmd_dump_read(struct blackmagic_device *bmd, struct bmd_ctrl *c, int r)
 {
-	uint32_t fps_numerator;
+	if (!bmd_fujitsu_value(c, r, &bmd->dump[c->arg]))
+		bmd->dump[c->arg] = 0;
+}
 
-	fps_numerator = bmd_fujitsu_read(bmd, 0x0015a8);
-	fps_numerator <<= 16;
-	fps_numerator += bmd_fujitsu_read(bmd, 0x0015aa);
-	fps_numerator /= 2;
+static void bmd_dump_print(struct blackmagic_device *bmd, struct bmd_ctrl *c, int r)
+{
+	const uint16_t *d = bmd->dump;
 
 	fprintf(stderr,
 		"-------------------------------------------------------\n"
@@ -984,42 +2717,101 @@ static void bmd_encoder_dump(struct blackmagic_device *bmd)
 		"-------------------------------------------------------\n",
 		bmd->current_display_mode,
 
-		fps_numerator,
-		bmd_fujitsu_read(bmd, 0x0015a6),
-		(bmd_fujitsu_read(bmd, 0x080116) >> 3) & 0xf,
-
-		bmd_fujitsu_read(bmd, 0x001812),
-
-		bmd_fujitsu_read(bmd, 0x001000),
-		bmd_fujitsu_read(bmd, 0x001404),
-		bmd_fujitsu_read(bmd, 0x00140a),
-		bmd_fujitsu_read(bmd, 0x001430) & 0xff,
-
-		bmd_fujitsu_read(bmd, 0x001470),
-		bmd_fujitsu_read(bmd, 0x001472),
-		bmd_fujitsu_read(bmd, 0x001474),
-		bmd_fujitsu_read(bmd, 0x001476),
-
-		bmd_fujitsu_read(bmd, 0x001540),
-		bmd_fujitsu_read(bmd, 0x001542),
-		bmd_fujitsu_read(bmd, 0x001544),
-		bmd_fujitsu_read(bmd, 0x001546),
-		bmd_fujitsu_read(bmd, 0x001548),
-		bmd_fujitsu_read(bmd, 0x00154a),
-		bmd_fujitsu_read(bmd, 0x00154c),
-		bmd_fujitsu_read(bmd, 0x00154e),
-		bmd_fujitsu_read(bmd, 0x001550),
-		bmd_fujitsu_read(bmd, 0x001552),
-		bmd_fujitsu_read(bmd, 0x001554)
+		(((uint32_t) d[0] << 16) + d[1]) / 2,
+		d[2],
+		(d[3] >> 3) & 0xf,
+
+		d[4],
+
+		d[5], d[6], d[7], d[8] & 0xff,
+
+		d[9], d[10], d[11], d[12],
+
+		d[13], d[14], d[15], d[16], d[17], d[18],
+		d[19], d[20], d[21], d[22], d[23]
 		);
 }
 
-static void bmd_encoder_start(struct blackmagic_device *bmd)
+/* What the device holds for the detected mode, not what was written */
+static void bmd_encoder_dump(struct blackmagic_device *bmd)
 {
-	const char *err;
-	uint8_t status;
-	int r;
+	struct bmd_ctrl *c;
+	int i;
+
+	for (i = 0; i < array_size(bmd_dump_regs); i++) {
+		c = bmd_fujitsu_read(bmd, bmd_dump_regs[i], bmd_dump_read);
+		if (c)
+			c->arg = i;
+	}
+	bmd_ctrl_call(bmd, bmd_dump_print);
+	bmd_ctrl_next(bmd);
+}
+
+static void bmd_encoder_started(struct blackmagic_device *bmd, struct bmd_ctrl *c, int r)
+{
+	if (r < 0) {
+		dlog(LOG_ERR, "%s: failed to start encoding: %s", bmd->name, libusb_error_name(r));
+		return;
+	}
+	bmd->first_packet_pending = 1;
+}
+
+static void bmd_encoder_verified(struct blackmagic_device *bmd, struct bmd_ctrl *c, int r)
+{
+	if (bmd->fujitsu_bad)
+		dlog(LOG_WARNING, "%s: encoder registers differ from cache after configuration", bmd->name);
+}
+
+/* The encoder is programmed, get the host side ready for the new stream
+ * and start it */
+static void bmd_encoder_configured(struct blackmagic_device *bmd, struct bmd_ctrl *c, int r)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	bmd->metrics.encoder_starts++;
+	bmd->metrics.last_completion_us = 0;
+	bmd->metrics.configure_us = elapsed_us(&bmd->encode_start, &now);
+	dlog(LOG_INFO, "%s: encoder configured in %.1f ms, %u register transfers, %u unchanged, "
+		"register cache %u hits, %u misses",
+		bmd->name, bmd->metrics.configure_us / 1000.0,
+		bmd->fujitsu_writes, bmd->fujitsu_skipped,
+		bmd->fujitsu_shadow.hits, bmd->fujitsu_shadow.misses);
+	if (verify_registers)
+		bmd_fujitsu_verify(bmd, bmd_encoder_verified);
+
+	/* Reset first, so outputs are not primed with the previous stream */
+	ts_join_init(&bmd->join, bmd->join.pmt_pid, bmd->join.video_pid, bmd->join.sit_pid);
+	if (bmd->num_outputs && !bmd_start_outputs(bmd)) {
+		dlog(LOG_ERR, "%s: failed to start outputs", bmd->name);
+		return;
+	}
+	/* The time line carries on when rebasing, nothing to flag */
+	if (bmd->mpegparser.rebase)
+		ts_rebase_restart(bmd->mpegparser.rebase);
+	else
+		bmd->mpegparser.discontinuity = 1;
+	if (bmd->mpegparser.hls)
+		hls_discontinuity(bmd->mpegparser.hls);
+	if (bmd->mpegparser.rec)
+		rec_split(bmd->mpegparser.rec);
+
+	c = bmd_ctrl_queue(bmd, 0, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
+			   VR_FUJITSU_START_ENCODING, 0x0004, 0, NULL, 1, 2000);
+	if (c)
+		c->done = bmd_encoder_started;
+}
 
+/* Runs once the register cache has been checked against the device, so
+ * that unchanged registers are skipped on what the device really holds */
+static void bmd_encoder_configure(struct blackmagic_device *bmd, struct bmd_ctrl *c, int r)
+{
+	bmd_configure_encoder(bmd, &ep);
+	bmd_ctrl_call(bmd, bmd_encoder_configured);
+}
+
+static void bmd_encoder_start(struct blackmagic_device *bmd)
+{
 	if (bmd->encode_sent || bmd->current_display_mode == DMODE_invalid)
 		return;
 
@@ -1033,61 +2825,40 @@ static void bmd_encoder_start(struct blackmagic_device *bmd)
 
 	dlog(LOG_NOTICE, "%s: configuring and starting encoder", bmd->name);
 
-	if (!bmd_configure_encoder(bmd, &ep)) {
-		err = "configuring encoder";
-		goto error;
-	}
-
-	if (!bmd_start_exec_program(bmd, ep.pipe_sz, ep.exec_program)) {
-		err = "start exec program";
-		goto error;
-	}
-
-	r = libusb_control_transfer(
-		bmd->usbdev_handle, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
-		VR_FUJITSU_START_ENCODING, 0x0004, 0,
-		&status, sizeof(status), 2000);
-	if (r < 0) {
-		err = "start encoding";
-		goto error;
-	}
-	return;
-error:
-	dlog(LOG_ERR, "%s: failed to %s", bmd->name, err);
+	clock_gettime(CLOCK_MONOTONIC, &bmd->encode_start);
+	bmd->fujitsu_writes = bmd->fujitsu_skipped = 0;
+	if (verify_registers)
+		bmd_fujitsu_verify(bmd, NULL);
+	bmd_ctrl_call(bmd, bmd_encoder_configure);
+	bmd_ctrl_next(bmd);
 }
 
 static void bmd_encoder_stop(struct blackmagic_device *bmd)
 {
-	uint8_t status;
-	uint8_t clear_fpga_command[1] = { 0x02 };
-	uint8_t send_fpga_command[1] = { 0x80 };
-	uint32_t fifo_level;
-	int i, r;
+	static const uint8_t clear_fpga_command[1] = { 0x02 };
+	static const uint8_t send_fpga_command[1] = { 0x80 };
+	int i;
 
 	/* Stop recording */
 	dlog(LOG_NOTICE, "%s: stopping encoder", bmd->name);
-	bmd_kill_exec_program(bmd);
-
-	r = libusb_control_transfer(
-		bmd->usbdev_handle, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
-		VR_FUJITSU_STOP_ENCODING, 0, 0, &status, sizeof(status), 1000);
-
-	r = libusb_control_transfer(
-		bmd->usbdev_handle, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-		VR_CLEAR_FPGA_COMMAND, 0, 0,
-		clear_fpga_command, sizeof(clear_fpga_command), 1000);
-
-	r = libusb_control_transfer(
-		bmd->usbdev_handle, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
-		VR_GET_FIFO_LEVEL, 0, 0,
-		(void*)&fifo_level, sizeof(fifo_level), 5000);
-
-	for (i = 0; i < 67; i++) {
-		r = libusb_control_transfer(
-			bmd->usbdev_handle, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-			VR_SEND_FPGA_COMMAND, 0, 0,
-			send_fpga_command, sizeof(send_fpga_command), 1000);
-	}
+	/* The next start programs every register again */
+	fujitsu_shadow_invalidate(&bmd->fujitsu_shadow);
+	if (!ep.persist)
+		bmd_stop_outputs(bmd);
+
+	/* Failures are left to the status messages to show */
+	bmd_ctrl_queue(bmd, BMD_CTRL_IGNORE, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
+		       VR_FUJITSU_STOP_ENCODING, 0, 0, NULL, 1, 1000);
+	bmd_ctrl_queue(bmd, BMD_CTRL_IGNORE, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
+		       VR_CLEAR_FPGA_COMMAND, 0, 0,
+		       clear_fpga_command, sizeof(clear_fpga_command), 1000);
+	bmd_ctrl_queue(bmd, BMD_CTRL_IGNORE, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
+		       VR_GET_FIFO_LEVEL, 0, 0, NULL, 4, 5000);
+	for (i = 0; i < 67; i++)
+		bmd_ctrl_queue(bmd, BMD_CTRL_IGNORE, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
+			       VR_SEND_FPGA_COMMAND, 0, 0,
+			       send_fpga_command, sizeof(send_fpga_command), 1000);
+	bmd_ctrl_next(bmd);
 }
 
 static void bmd_parse_message(struct blackmagic_device *bmd, const uint8_t *msg, int msg_len)
@@ -1097,6 +2868,10 @@ static void bmd_parse_message(struct blackmagic_device *bmd, const uint8_t *msg,
 	switch (msg[0]) {
 	case 0x01: /* Status update */
 		dlog(LOG_DEBUG, "%s: FX2Status: %s (%d)", bmd->name, FX2Status_to_String(msg[5]), msg[5]);
+		/* H56 registers do not survive a reset */
+		if (msg[5] == FX2Status_Booting ||
+		    (msg[5] == FX2Status_Idle && bmd->fxstatus <= FX2Status_Booting))
+			fujitsu_shadow_invalidate(&bmd->fujitsu_shadow);
 		bmd->fxstatus = msg[5];
 		break;
 	case 0x05: /* Input connector */
@@ -1110,6 +2885,7 @@ static void bmd_parse_message(struct blackmagic_device *bmd, const uint8_t *msg,
 		break;
 	case 0x0d:
 		dlog(LOG_ERR, "%s: H56 error; restarting device", bmd->name);
+		fujitsu_shadow_invalidate(&bmd->fujitsu_shadow);
 		break;
 	case 0x0e: /* Timestamp update? */
 		break;
@@ -1123,158 +2899,347 @@ static void bmd_parse_message(struct blackmagic_device *bmd, const uint8_t *msg,
 	}
 }
 
-static void bmd_handle_messages(struct blackmagic_device *bmd, int force)
+static void bmd_message_complete(struct libusb_transfer *transfer)
 {
-	int actual_length, r, i;
-
-	do {
-		r = libusb_bulk_transfer(
-			bmd->usbdev_handle, 0x88,
-			bmd->message_buffer, sizeof(bmd->message_buffer),
-			&actual_length, 10000);
-		if (r != LIBUSB_SUCCESS)
-			break;
+	struct blackmagic_device *bmd = transfer->user_data;
+	int i, r;
 
-		/* The first 16-bits is the length of the full message */
-		if (loglevel >= LOG_DEBUG) {
-			char tmp[512];
-			hexdump(tmp, sizeof(tmp), bmd->message_buffer, actual_length);
-			dlog(LOG_DEBUG, "%s: ep8: %4d bytes: %s", bmd->name, actual_length, tmp);
+	r = transfer_status_to_error(transfer->status);
+	if (r != LIBUSB_SUCCESS) {
+		if (bmd->status == LIBUSB_SUCCESS) {
+			dlog(LOG_INFO, "%s: message reader exiting: %s", bmd->name, libusb_error_name(r));
+			bmd->status = r;
 		}
+		bmd->message_active = 0;
+		return;
+	}
 
-		/* Parse queued messages, especially during boot/first connect
-		 * there can be lot of them, so process them allf irst. */
-		for (i = 2; bmd->message_buffer[i] != 0 && i < actual_length;
-		     i += bmd->message_buffer[i] + 1)
-			bmd_parse_message(bmd, &bmd->message_buffer[i+1], bmd->message_buffer[i]);
-
-		/* Act on status changes */
-		switch (bmd->fxstatus) {
-		case FX2Status_Idle:
-			bmd->encode_sent = 0;
-			if (!bmd->running)
-				break;
+	/* The first 16-bits is the length of the full message */
+	if (loglevel >= LOG_DEBUG) {
+		char tmp[512];
+		hexdump(tmp, sizeof(tmp), bmd->message_buffer, transfer->actual_length);
+		dlog(LOG_DEBUG, "%s: ep8: %4d bytes: %s", bmd->name, transfer->actual_length, tmp);
+	}
 
-			if (!bmd->recognized)
-				bmd_recognize_device(bmd);
-
-			if (bmd->current_mode)
-				dlog(LOG_NOTICE, "%s: display mode: %s", bmd->name, bmd->current_mode->description);
-			else if (bmd->current_display_mode == DMODE_invalid)
-				dlog(LOG_NOTICE, "%s: no signal", bmd->name);
-			else
-				dlog(LOG_ERR, "%s: display mode: 0x%02x; not supported", bmd->name, bmd->current_display_mode);
-
-			if (bmd->current_display_mode != DMODE_invalid)
-				bmd_encoder_start(bmd);
-			else if (bmd->display_mode_changed &&
-				 bmd->desc.idProduct == USB_PID_BMD_H264_PRO_RECORDER &&
-				 ep.input_source >= 0)
-				bmd_set_input_source(bmd, ep.input_source);
-			break;
-		case FX2Status_Encoding:
-			if (bmd->display_mode_changed || !bmd->encode_sent)
-				bmd_encoder_stop(bmd);
-			break;
-		}
-		bmd->display_mode_changed = 0;
+	/* Parse queued messages, especially during boot/first connect
+	 * there can be lot of them, so process them allf irst. Acting on
+	 * them happens from the main loop, outside of libusb callbacks. */
+	for (i = 2; bmd->message_buffer[i] != 0 && i < transfer->actual_length;
+	     i += bmd->message_buffer[i] + 1)
+		bmd_parse_message(bmd, &bmd->message_buffer[i+1], bmd->message_buffer[i]);
+	bmd->status_pending = 1;
+
+	if (bmd->state == BMD_STATE_CLOSING ||
+	    bmd_submit(bmd, transfer) != LIBUSB_SUCCESS)
+		bmd->message_active = 0;
+}
+
+static int bmd_start_messages(struct blackmagic_device *bmd)
+{
+	bmd->message_transfer = libusb_alloc_transfer(0);
+	if (bmd->message_transfer == NULL)
+		return 0;
+	libusb_fill_bulk_transfer(bmd->message_transfer, bmd->usbdev_handle, 0x88,
+		bmd->message_buffer, sizeof(bmd->message_buffer),
+		bmd_message_complete, bmd, 10000);
+	if (bmd_submit(bmd, bmd->message_transfer) != LIBUSB_SUCCESS)
+		return 0;
+	bmd->message_active = 1;
+	return 1;
+}
 
-	} while ((force && bmd->fxstatus != FX2Status_Idle) || (running && bmd->running));
+/* Act on status changes */
+static void bmd_handle_status(struct blackmagic_device *bmd)
+{
+	switch (bmd->fxstatus) {
+	case FX2Status_Idle:
+		bmd->encode_sent = 0;
+		if (!bmd->running)
+			break;
 
-	if (r != LIBUSB_SUCCESS) {
-		dlog(LOG_INFO, "%s: message reader exiting: %s", bmd->name, libusb_error_name(r));
-		bmd->status = r;
+		if (!bmd->recognized)
+			bmd_recognize_device(bmd);
+
+		if (bmd->current_mode)
+			dlog(LOG_NOTICE, "%s: display mode: %s", bmd->name, bmd->current_mode->description);
+		else if (bmd->current_display_mode == DMODE_invalid)
+			dlog(LOG_NOTICE, "%s: no signal", bmd->name);
+		else
+			dlog(LOG_ERR, "%s: display mode: 0x%02x; not supported", bmd->name, bmd->current_display_mode);
+
+		if (bmd->current_display_mode != DMODE_invalid)
+			bmd_encoder_start(bmd);
+		else if (bmd->display_mode_changed &&
+			 bmd->desc.idProduct == USB_PID_BMD_H264_PRO_RECORDER &&
+			 ep.input_source >= 0)
+			bmd_set_input_source(bmd, ep.input_source);
+		break;
+	case FX2Status_Encoding:
+		if (bmd->display_mode_changed || !bmd->encode_sent)
+			bmd_encoder_stop(bmd);
+		break;
 	}
+	bmd->display_mode_changed = 0;
+}
+
+static void bmd_set_state(struct blackmagic_device *bmd, int state)
+{
+	bmd->state = state;
+	clock_gettime(CLOCK_MONOTONIC, &bmd->state_time);
 }
 
-static void *bmd_device_thread(void *ctx)
+static void bmd_record_event(struct event_handler *eh, uint32_t events)
 {
-	struct blackmagic_device *bmd = ctx;
-	int r, i;
+	struct blackmagic_device *bmd = container_of(eh, struct blackmagic_device, rec_event);
 
-	bmd->running = 1;
-	bmd->current_display_mode = DMODE_invalid;
-	bmd->mpegparser.output_fd = -1;
+	rec_reap(&bmd->rec, 0);
+}
 
-	/* Immediately after hotplug, the sysfs device nodes are not yet
-	 * available. Unfortunately, libusb_open will disconnect mark device
-	 * disconnected if the node does not exist... so just wait for
-	 * (hopefully) long enough for the node to become available. */
-	usleep(200 * 1000);
+static void bmd_emu_event(struct event_handler *eh, uint32_t events)
+{
+	struct blackmagic_device *bmd = container_of(eh, struct blackmagic_device, emu_event);
 
-	r = libusb_open(bmd->usbdev, &bmd->usbdev_handle);
-	if (r != LIBUSB_SUCCESS) {
-		dlog(LOG_ERR, "%s: unable to open device: %s", bmd->name, libusb_error_name(r));
-		goto exit;
-	}
+	emu_process(bmd->emu);
+}
 
-	r = libusb_set_configuration(bmd->usbdev_handle, 1);
-	if (r != LIBUSB_SUCCESS) {
-		dlog(LOG_ERR, "%s: failed to set configuration: %s", bmd->name, libusb_error_name(r));
-		goto exit;
+static int bmd_open(struct blackmagic_device *bmd)
+{
+	struct firmware *fw;
+	char path[PATH_MAX];
+	int r;
+
+	if (bmd->emu) {
+		if (!emu_open(bmd->emu, ep.emulate_ts, ep.emulate_kbps)) {
+			dlog(LOG_ERR, "%s: unable to start emulator: %s", bmd->name, strerror(errno));
+			return 0;
+		}
+		bmd->emu_event.fd = bmd->emu->fd;
+		bmd->emu_event.handler = bmd_emu_event;
+		if (event_update(&bmd->emu_event, EPOLLIN) < 0) {
+			dlog(LOG_ERR, "%s: failed to watch emulator: %s", bmd->name, strerror(errno));
+			return 0;
+		}
+	} else {
+		r = libusb_open(bmd->usbdev, &bmd->usbdev_handle);
+		if (r != LIBUSB_SUCCESS) {
+			dlog(LOG_ERR, "%s: unable to open device: %s", bmd->name, libusb_error_name(r));
+			return 0;
+		}
+
+		r = libusb_set_configuration(bmd->usbdev_handle, 1);
+		if (r != LIBUSB_SUCCESS) {
+			dlog(LOG_ERR, "%s: failed to set configuration: %s", bmd->name, libusb_error_name(r));
+			return 0;
+		}
+
+		r = libusb_claim_interface(bmd->usbdev_handle, 0);
+		if (r != LIBUSB_SUCCESS) {
+			dlog(LOG_ERR, "%s: failed to claim interface: %s", bmd->name, libusb_error_name(r));
+			return 0;
+		}
 	}
 
-	r = libusb_claim_interface(bmd->usbdev_handle, 0);
-	if (r != LIBUSB_SUCCESS) {
-		dlog(LOG_ERR, "%s: failed to claim interface: %s", bmd->name, libusb_error_name(r));
-		goto exit;
+	bmd->ctrl_transfer = libusb_alloc_transfer(0);
+	if (!bmd->ctrl_transfer) {
+		dlog(LOG_ERR, "%s: failed to allocate control transfer", bmd->name);
+		return 0;
 	}
 
 	if (bmd->desc.iManufacturer == 0) {
-		const char *desc = "not available";
-
 		dlog(LOG_INFO, "%s: firmware downloaded needed", bmd->name);
-		for (i = 0; i < array_size(firmwares); i++) {
-			if (firmwares[i]->device_id != bmd->desc.idProduct)
-				continue;
-			if (bmd_upload_firmware(bmd, firmwares[i]))
-				desc = "downloaded succesfully";
-			else
-				desc = "failed to download";
-			break;
-		}
-		dlog(LOG_NOTICE, "%s: firmware %s", bmd->name, desc);
-	} else {
-		if (bmd->desc.idProduct == USB_PID_BMD_H264_PRO_RECORDER &&
-		    ep.input_source >= 0)
-			bmd_set_input_source(bmd, ep.input_source);
+		fw = get_firmware(bmd->desc.idProduct);
+		if (fw)
+			bmd_upload_firmware(bmd, fw);
+		else
+			dlog(LOG_NOTICE, "%s: firmware not available", bmd->name);
+		/* The device re-enumerates with the new firmware, once the
+		 * upload has gone out */
+		return 0;
+	}
 
-		r = pthread_create(&bmd->mpegts_thread, NULL, bmd_pump_mpegts, bmd);
-		if (r < 0)
-			goto exit;
+	if (bmd->desc.idProduct == USB_PID_BMD_H264_PRO_RECORDER &&
+	    ep.input_source >= 0)
+		bmd_set_input_source(bmd, ep.input_source);
 
-		r = libusb_control_transfer(
-			bmd->usbdev_handle, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-			VR_SEND_DEVICE_STATUS, 0, 0, 0, 0, 1000);
-		if (r == LIBUSB_SUCCESS)
-			bmd_handle_messages(bmd, 0);
+	if (!ts_ring_init(&bmd->ring, ep.ring_kb)) {
+		dlog(LOG_ERR, "%s: failed to allocate stream ring", bmd->name);
+		return 0;
+	}
+	bmd->ring.video_pid = bmd->join.video_pid;
 
-		bmd->running = 0;
-		if (bmd->mpegts_thread)
-			pthread_join(bmd->mpegts_thread, NULL);
+	if (ep.hls_dir) {
+		if (!hls_open(&bmd->hls, ep.hls_dir, bmd->usb_ports[0] ? bmd->usb_ports : "stream",
+			      ep.hls_time, ep.hls_list_size, bmd->join.pmt_pid, bmd->join.video_pid, dlog)) {
+			dlog(LOG_ERR, "%s: failed to start hls writer: %s", bmd->name, strerror(errno));
+			return 0;
+		}
+		bmd->mpegparser.hls = &bmd->hls;
+	}
 
-		if (bmd->fxstatus == FX2Status_Encoding && bmd->status == LIBUSB_SUCCESS) {
-			bmd_encoder_stop(bmd);
-			while (bmd->fxstatus != FX2Status_Idle && bmd->status == LIBUSB_SUCCESS)
-				bmd_handle_messages(bmd, 1);
+	if (ep.record.dir) {
+		if (!rec_open(&bmd->rec, &ep.record, bmd->usb_ports[0] ? bmd->usb_ports : "stream",
+			      bmd->join.pmt_pid, bmd->join.video_pid, dlog)) {
+			dlog(LOG_ERR, "%s: failed to start recorder: %s", bmd->name, strerror(errno));
+			return 0;
+		}
+		bmd->rec_event.fd = bmd->rec.fd;
+		bmd->rec_event.handler = bmd_record_event;
+		if (event_update(&bmd->rec_event, EPOLLIN) < 0) {
+			dlog(LOG_ERR, "%s: failed to watch recorder: %s", bmd->name, strerror(errno));
+			return 0;
 		}
+		bmd->mpegparser.rec = &bmd->rec;
 	}
 
-exit:
+	if (ep.dvr_dir) {
+		/* Sized for the configured peak rate plus TS and PES
+		 * overhead. The stream is indexed as written, with its
+		 * PIDs remapped. */
+		snprintf(path, sizeof(path), "%s/%s.dvr", ep.dvr_dir,
+			 bmd->usb_ports[0] ? bmd->usb_ports : "stream");
+		if (!dvr_create(&bmd->dvr, path,
+				(uint64_t) ep.dvr_minutes * 60 * (ep.video_max_kbps + ep.audio_kbps) * 1100 / 8,
+				ep.dvr_minutes * 60 * 4, bmd->join.pmt_pid, bmd->join.video_pid,
+				pid_filter.remap[BMD_PID_PCR])) {
+			dlog(LOG_ERR, "%s: failed to create %s: %s", bmd->name, path, strerror(errno));
+			return 0;
+		}
+		bmd->mpegparser.dvr = &bmd->dvr;
+	}
+
+	if (!bmd_start_messages(bmd) || !bmd_start_mpegts(bmd))
+		return 0;
+
+	bmd_ctrl_queue(bmd, 0, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
+		       VR_SEND_DEVICE_STATUS, 0, 0, NULL, 0, 1000);
+	bmd_ctrl_next(bmd);
+	return bmd->status == LIBUSB_SUCCESS;
+}
+
+static void bmd_close(struct blackmagic_device *bmd)
+{
 	dlog(LOG_INFO, "%s: closing device", bmd->name);
-	bmd_kill_exec_program(bmd);
-	libusb_close(bmd->usbdev_handle);
-	libusb_unref_device(bmd->usbdev);
+	bmd_report_stream_stats(bmd, LOG_INFO, 0);
+	bmd_stop_outputs(bmd);
+	while (bmd->http_clients)
+		http_client_close(bmd->http_clients);
+	bmd_free_mpegts(bmd);
+	hls_close(&bmd->hls);
+	event_update(&bmd->rec_event, 0);
+	rec_close(&bmd->rec);
+	dvr_close(&bmd->dvr);
+	libusb_free_transfer(bmd->message_transfer);
+	libusb_free_transfer(bmd->ctrl_transfer);
+	ts_ring_free(&bmd->ring);
+	if (bmd->emu) {
+		event_update(&bmd->emu_event, 0);
+		emu_close(bmd->emu);
+		free(bmd->emu);
+	}
+	if (bmd->usbdev_handle)
+		libusb_close(bmd->usbdev_handle);
+	if (bmd->usbdev)
+		libusb_unref_device(bmd->usbdev);
 	free(bmd);
+}
+
+/* Device state machine, run from the main loop. Returns zero once all
+ * transfers have finished and the device can be closed. */
+static int bmd_process(struct blackmagic_device *bmd, struct timespec *now)
+{
+	switch (bmd->state) {
+	case BMD_STATE_OPENING:
+		/* Immediately after hotplug, the sysfs device nodes are not yet
+		 * available. Unfortunately, libusb_open will disconnect mark device
+		 * disconnected if the node does not exist... so just wait for
+		 * (hopefully) long enough for the node to become available. */
+		if (elapsed_us(&bmd->state_time, now) < 200000)
+			break;
+		if (running && bmd_open(bmd))
+			bmd_set_state(bmd, BMD_STATE_RUNNING);
+		else
+			bmd_set_state(bmd, BMD_STATE_STOPPING);
+		break;
+	case BMD_STATE_RUNNING:
+		if (bmd->status == LIBUSB_SUCCESS && running && bmd->running) {
+			/* Outputs that went away or ran out of time */
+			bmd_mpegts_resume(bmd);
+			/* Status changes wait for the requests already queued */
+			if (bmd->status_pending && !bmd_ctrl_busy(bmd)) {
+				bmd->status_pending = 0;
+				bmd_handle_status(bmd);
+			}
+			break;
+		}
+		bmd->running = 0;
+		bmd_cancel_mpegts(bmd);
+		if (bmd->fxstatus == FX2Status_Encoding && bmd->status == LIBUSB_SUCCESS)
+			bmd_encoder_stop(bmd);
+		bmd_set_state(bmd, BMD_STATE_STOPPING);
+		break;
+	case BMD_STATE_STOPPING:
+		/* Wait for the encoder to go idle before closing */
+		if (bmd->status == LIBUSB_SUCCESS &&
+		    ((bmd->message_active && bmd->fxstatus != FX2Status_Idle &&
+		      bmd->fxstatus != FX2Status_Unknown) || bmd_ctrl_busy(bmd)))
+			break;
+		bmd_cancel_mpegts(bmd);
+		if (bmd->message_active)
+			bmd_cancel(bmd, bmd->message_transfer);
+		if (bmd->ctrl_active)
+			bmd_cancel(bmd, bmd->ctrl_transfer);
+		bmd_set_state(bmd, BMD_STATE_CLOSING);
+		break;
+	case BMD_STATE_CLOSING:
+		if (bmd->message_active || bmd->mpegts_active || bmd->ctrl_active)
+			break;
+		return 0;
+	}
+	return 1;
+}
+
+/* Sets up a device and queues it for opening from the main loop, the
+ * caller fills in the name and how to reach it */
+static void bmd_add(struct blackmagic_device *bmd)
+{
+	int i;
+
+	bmd->status = LIBUSB_SUCCESS;
+	bmd->running = 1;
+	bmd->current_display_mode = DMODE_invalid;
+	bmd->num_outputs = ep.num_outputs;
+	for (i = 0; i < bmd->num_outputs; i++) {
+		bmd->outputs[i].bmd = bmd;
+		bmd->outputs[i].spec = &ep.outputs[i];
+		bmd->outputs[i].fd = -1;
+		bmd->outputs[i].event.handler = bmd_output_event;
+	}
+	bmd->mpegparser.ring = &bmd->ring;
+	bmd->mpegparser.stats = &bmd->ts_stats;
+	bmd->mpegparser.join = &bmd->join;
+	ts_stats_init(&bmd->ts_stats, BMD_PID_PCR);
+	ts_join_init(&bmd->join, pid_filter.remap[BMD_PID_PMT], pid_filter.remap[BMD_PID_VIDEO],
+		     pid_filter.remap[BMD_PID_SIT]);
+	if (ep.rebase) {
+		ts_rebase_init(&bmd->rebase);
+		bmd->mpegparser.rebase = &bmd->rebase;
+	}
+	if (pid_filter.rewrite || pid_filter.keep_null)
+		bmd->mpegparser.filter = &pid_filter;
+	bmd_set_state(bmd, BMD_STATE_OPENING);
 
-	__sync_sub_and_fetch(&num_workers, 1);
+	dlog(LOG_INFO, "%s: device connected", bmd->name);
 
-	return NULL;
+	/* Opening is deferred to the main loop, libusb may not be
+	 * called from within the hotplug callback */
+	bmd->next = devices;
+	devices = bmd;
 }
 
 static int handle_hotplug(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
 {
 	struct blackmagic_device *bmd;
+	uint8_t ports[8];
 	int r;
 
 	if (!running)
@@ -1289,22 +3254,106 @@ static int handle_hotplug(libusb_context *ctx, libusb_device *dev, libusb_hotplu
 		libusb_get_bus_number(dev), libusb_get_device_address(dev),
 		bmd->desc.idVendor, bmd->desc.idProduct);
 	bmd->usbdev = libusb_ref_device(dev);
-	bmd->status = LIBUSB_SUCCESS;
+	r = libusb_get_port_numbers(dev, ports, array_size(ports));
+	format_usb_ports(ports, r > 0 ? r : 0, bmd->usb_ports);
+	bmd_add(bmd);
 
-	dlog(LOG_INFO, "%s: device connected", bmd->name);
+	return 0;
+}
 
-	__sync_add_and_fetch(&num_workers, 1);
+/* An emulated device appears as an ATEM TV Studio with firmware loaded */
+static int emulate_device(int n)
+{
+	struct blackmagic_device *bmd;
 
-	r = pthread_create(&bmd->device_thread, NULL, bmd_device_thread, bmd);
-	if (r != 0) {
-		dlog(LOG_ERR, "%s: failed to create handler thread", bmd->name);
-		libusb_unref_device(bmd->usbdev);
+	bmd = calloc(1, sizeof(struct blackmagic_device));
+	if (bmd == NULL)
+		return 0;
+	bmd->emu = calloc(1, sizeof(struct fx2emu));
+	if (bmd->emu == NULL) {
 		free(bmd);
 		return 0;
 	}
-	pthread_detach(bmd->device_thread);
+	bmd->desc.idVendor = USB_VID_BLACKMAGIC_DESIGN;
+	bmd->desc.idProduct = USB_PID_BMD_ATEM_TV_STUDIO;
+	bmd->desc.iManufacturer = 1;
+	snprintf(bmd->name, sizeof(bmd->name), "[emu/%d %04x:%04x]",
+		n, bmd->desc.idVendor, bmd->desc.idProduct);
+	snprintf(bmd->usb_ports, sizeof(bmd->usb_ports), "emu%d", n);
+	bmd_add(bmd);
+	return 1;
+}
+
+static void handle_usb_event(struct event_handler *eh, uint32_t events)
+{
+	struct timeval tv = { 0, 0 };
+
+	libusb_handle_events_timeout_completed(usb_ctx, &tv, NULL);
+}
+
+static struct event_handler usb_events[16];
+
+static void usb_pollfd_added(int fd, short events, void *user_data)
+{
+	struct event_handler *eh;
+	int i;
+
+	for (i = 0; i < array_size(usb_events) && usb_events[i].handler; i++);
+	if (i >= array_size(usb_events)) {
+		dlog(LOG_ERR, "too many usb fds to watch");
+		return;
+	}
 
-	return 0;
+	eh = &usb_events[i];
+	eh->fd = fd;
+	eh->events = 0;
+	eh->handler = handle_usb_event;
+	if (event_update(eh, (events & POLLIN ? EPOLLIN : 0) | (events & POLLOUT ? EPOLLOUT : 0)) < 0) {
+		dlog(LOG_ERR, "failed to watch usb fd %d: %s", fd, strerror(errno));
+		eh->handler = NULL;
+	}
+}
+
+static void usb_pollfd_removed(int fd, void *user_data)
+{
+	int i;
+
+	for (i = 0; i < array_size(usb_events); i++) {
+		if (usb_events[i].handler && usb_events[i].fd == fd) {
+			event_update(&usb_events[i], 0);
+			usb_events[i].handler = NULL;
+		}
+	}
+}
+
+/* Process CPU time since the previous report, shared out over the
+ * devices streaming, for sizing hosts with many devices */
+static void report_cpu(void)
+{
+	static struct timespec last;
+	static double last_cpu;
+	struct blackmagic_device *bmd;
+	struct timespec now;
+	struct rusage ru;
+	double cpu, wall;
+	int streaming = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		return;
+	cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	      ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	for (bmd = devices; bmd; bmd = bmd->next)
+		if (bmd->state == BMD_STATE_RUNNING && bmd->fxstatus == FX2Status_Encoding)
+			streaming++;
+	if (last.tv_sec) {
+		wall = elapsed_us(&last, &now) / 1e6;
+		dlog(LOG_NOTICE, "cpu: %.2f%% over %.1f s, %d devices streaming, %.3f%% per device",
+			wall > 0 ? (cpu - last_cpu) * 100 / wall : 0, wall, streaming,
+			wall > 0 && streaming ? (cpu - last_cpu) * 100 / wall / streaming : 0);
+	}
+	last = now;
+	last_cpu = cpu;
 }
 
 static int usage(void)
@@ -1328,14 +3377,105 @@ static int usage(void)
 		"	-S,--input-source	Set input source (component, sdi, hdmi,\n"
 		"				composite, s-video, or 0-4)\n"
 		"	-f,--firmware-dir	Directory for firmware images\n"
-		"	-z,--pipe-size		Set stream output pipe size in kB\n"
-		"	-x,--exec		Program to execute for each connected stream\n"
+		"	-z,--pipe-size		Set stream output pipe or socket buffer size in kB\n"
+		"	-x,--exec		Program to execute for each connected stream,\n"
+		"				repeat to feed several programs the same stream\n"
+		"	-u,--udp HOST:PORT	Send the stream as UDP datagrams of 7 packets\n"
+		"	--rtp HOST:PORT		Send the stream as RTP (RFC 2250)\n"
+		"	--mcast-ttl TTL		Multicast TTL for the --udp and --rtp that follow\n"
+		"	--mcast-if IFNAME	Multicast interface for the --udp and --rtp that follow\n"
+		"	--udp-gso		Use UDP segmentation offload for the --udp that follow\n"
+		"	--http [HOST:]PORT	Serve GET /device/<usb-ports>.ts to any number of\n"
+		"				clients, lag options given before apply to them,\n"
+		"				and GET /metrics; a /path listens on a Unix socket\n"
+		"	--hls DIR		Write HLS segments and a <usb-ports>.m3u8 playlist\n"
+		"	--hls-time SECONDS	Target HLS segment duration (6)\n"
+		"	--hls-list-size N	Segments listed in the HLS playlist (6)\n"
+		"	--record DIR		Record to <usb-ports>-<date>-<time>.ts files\n"
+		"	--record-size MB	Start a new file at the next keyframe past this size\n"
+		"	--record-time SECONDS	Start a new file at the next keyframe past this time\n"
+		"	--record-prealloc MB	Preallocate record files, trimmed when closed\n"
+		"	--record-direct		Record with O_DIRECT, bypassing the page cache\n"
+		"	--record-buffers N	Record buffers of 1 MB, data is dropped once all\n"
+		"				are waiting for the disk (16)\n"
+		"	--dvr DIR		Keep the latest stream in <usb-ports>.dvr for\n"
+		"				bmd-dvrcat, DIR must be a tmpfs like /dev/shm\n"
+		"	--dvr-minutes N		Minutes held in the time-shift buffer (10)\n"
 		"	-R,--respawn		Restart execute program if it exits\n"
-		"	-s,--syslog		Log to syslog\n"
+		"	--persist		Keep outputs open across encoder restarts, the\n"
+		"				stream continues with a flagged discontinuity\n"
+		"	--rebase		Rewrite timestamps and continuity counters to\n"
+		"				carry on across encoder restarts\n"
+		"	-T,--usb-transfers	Number of MPEG-TS USB transfers in flight (1-32)\n"
+		"	-r,--ring-size		Set stream buffer size between USB and output in kB\n"
+		"	-s,--syslog		Log to syslog (SIGUSR1 logs the stream statistics\n"
+		"				and latency histograms)\n"
+		"	--verify-registers	Check the encoder register cache against the device\n"
+		"	--vmsplice		Hand stream buffers to the pipe of each -x program without\n"
+		"				copying (the program must consume it with read(), not\n"
+		"				splice; stdout is shared by all devices and always copied)\n"
+		"	--no-audio		Drop the audio stream\n"
+		"	--no-sit		Drop the DVB SIT table\n"
+		"	--keep-stuffing		Keep null packets for constant bitrate output\n"
+		"	--drop-pid PID		Drop packets with the given PID\n"
+		"	--remap-pid OLD=NEW	Renumber a PID, PAT and PMT are updated to match\n"
+		"	--emulate N		Add N emulated devices, for testing without hardware\n"
+		"	--emulate-ts FILE	Stream a recorded TS file, looped, from the emulated\n"
+		"				devices instead of a synthetic stream\n"
+		"	--emulate-kbps KBPS	Rate of the emulated devices (video + audio kbps)\n"
+		"	--lag-limit KB		How far an output may fall behind the device\n"
+		"	--lag-policy POLICY	What to do with an output over its lag limit:\n"
+		"				drop (oldest data), skip (to live), close,\n"
+		"				gop (drop to the next keyframe), nonref (drop\n"
+		"				B-frames, then as gop), block (stop reading the\n"
+		"				device for up to 100 ms, then as gop)\n"
+		"				(both apply to the outputs that follow them)\n"
 		"\n");
 	return 1;
 }
 
+/* Output options given so far apply to the new output */
+static int set_output_spec(struct output_spec *spec, int type, char *arg)
+{
+	memset(spec, 0, sizeof(*spec));
+	spec->type = type;
+	if (type == OUTPUT_PIPE) {
+		spec->exec_program = arg;
+	} else if (type == OUTPUT_HTTP && arg[0] == '/') {
+		struct sockaddr_un *sun = (struct sockaddr_un *) &spec->addr;
+
+		spec->dest = arg;
+		if (strlen(arg) >= sizeof(sun->sun_path)) {
+			fprintf(stderr, "socket path too long: %s\n", arg);
+			return 0;
+		}
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, arg);
+		spec->addrlen = sizeof(*sun);
+	} else {
+		spec->dest = arg;
+		if (!ts_udp_parse(arg, &spec->addr, &spec->addrlen)) {
+			fprintf(stderr, "invalid address: %s\n", arg);
+			return 0;
+		}
+	}
+	spec->lag_kb = ep.lag_kb;
+	spec->lag_policy = ep.lag_policy;
+	spec->mcast_ttl = ep.mcast_ttl;
+	spec->mcast_if = ep.mcast_if;
+	spec->udp_gso = ep.udp_gso;
+	return 1;
+}
+
+static int add_output(int type, char *arg)
+{
+	if (ep.num_outputs >= BMD_MAX_OUTPUTS ||
+	    !set_output_spec(&ep.outputs[ep.num_outputs], type, arg))
+		return 0;
+	ep.num_outputs++;
+	return 1;
+}
+
 static int profile_string_to_int(const char *str)
 {
 	if (!strcmp(str, "high")) return FX2_H264_HIGH;
@@ -1363,6 +3503,10 @@ int main(int argc, char **argv)
 		{ "pipe-size",		required_argument, NULL, 'z' },
 		{ "exec",		required_argument, NULL, 'x' },
 		{ "respawn",		no_argument, NULL, 'R' },
+		{ "persist",		no_argument, NULL, 'p' },
+		{ "rebase",		no_argument, NULL, 'g' },
+		{ "usb-transfers",	required_argument, NULL, 'T' },
+		{ "ring-size",		required_argument, NULL, 'r' },
 		{ "syslog",		no_argument, NULL, 's' },
 		{ "src-x",		required_argument, NULL, '0' },
 		{ "src-y",		required_argument, NULL, '1' },
@@ -1370,26 +3514,97 @@ int main(int argc, char **argv)
 		{ "src-height",		required_argument, NULL, '3' },
 		{ "dst-width",		required_argument, NULL, '4' },
 		{ "dst-height",		required_argument, NULL, '5' },
+		{ "verify-registers",	no_argument, NULL, '6' },
+		{ "vmsplice",		no_argument, NULL, '7' },
+		{ "no-audio",		no_argument, NULL, '8' },
+		{ "no-sit",		no_argument, NULL, '9' },
+		{ "keep-stuffing",	no_argument, NULL, 'N' },
+		{ "drop-pid",		required_argument, NULL, 'D' },
+		{ "remap-pid",		required_argument, NULL, 'M' },
+		{ "lag-limit",		required_argument, NULL, 'G' },
+		{ "lag-policy",		required_argument, NULL, 'Y' },
+		{ "udp",		required_argument, NULL, 'u' },
+		{ "rtp",		required_argument, NULL, 'E' },
+		{ "mcast-ttl",		required_argument, NULL, 'W' },
+		{ "mcast-if",		required_argument, NULL, 'I' },
+		{ "udp-gso",		no_argument, NULL, 'O' },
+		{ "http",		required_argument, NULL, 'H' },
+		{ "hls",		required_argument, NULL, 'J' },
+		{ "hls-time",		required_argument, NULL, 'Q' },
+		{ "hls-list-size",	required_argument, NULL, 'V' },
+		{ "record",		required_argument, NULL, 'A' },
+		{ "record-size",	required_argument, NULL, 'Z' },
+		{ "record-time",	required_argument, NULL, 'X' },
+		{ "record-prealloc",	required_argument, NULL, 'U' },
+		{ "record-direct",	no_argument, NULL, 'd' },
+		{ "record-buffers",	required_argument, NULL, 'y' },
+		{ "dvr",		required_argument, NULL, 'e' },
+		{ "dvr-minutes",	required_argument, NULL, 'm' },
+		{ "emulate",		required_argument, NULL, 'n' },
+		{ "emulate-ts",		required_argument, NULL, 't' },
+		{ "emulate-kbps",	required_argument, NULL, 'w' },
 		{ NULL }
 	};
-	static const char short_options[] = "vk:K:a:P:L:bcBCF:f:S:z:x:Rs";
+	static const char short_options[] = "vk:K:a:P:L:bcBCF:f:S:z:x:u:RT:r:s";
 
-	libusb_context *ctx;
+	libusb_context *ctx = NULL;
 	libusb_hotplug_callback_handle cbhandle;
+	const struct libusb_pollfd **pollfds;
 	const char *msg = NULL;
-	int i, r, ec = 0, opt, optindex, status;
+	struct statfs sfs;
+	int i, r, ec = 0, opt, optindex, status, pid, new_pid;
+	char *end, http_port[32];
 
 	signal(SIGCHLD, reapchildren);
 	signal(SIGTERM, dostop);
 	signal(SIGINT, dostop);
+	signal(SIGUSR1, dodump);
 	signal(SIGPIPE, SIG_IGN);
 
+	ts_filter_init(&pid_filter);
+	ts_filter_pmt(&pid_filter, BMD_PID_PMT);
+
 	optindex = 0;
 	while ((opt=getopt_long(argc, argv, short_options, long_options, &optindex)) > 0) {
 		switch (opt) {
 		case 's': do_syslog = 1; break;
-		case 'x': ep.exec_program = optarg; break;
+		case 'x':
+			if (!add_output(OUTPUT_PIPE, optarg))
+				return usage();
+			break;
+		case 'u':
+		case 'E':
+			if (!add_output(opt == 'u' ? OUTPUT_UDP : OUTPUT_RTP, optarg))
+				return usage();
+			break;
+		case 'W': ep.mcast_ttl = atoi(optarg); break;
+		case 'I': ep.mcast_if = optarg; break;
+		case 'O': ep.udp_gso = 1; break;
+		case 'J': ep.hls_dir = optarg; break;
+		case 'Q': ep.hls_time = atof(optarg); break;
+		case 'V': ep.hls_list_size = atoi(optarg); break;
+		case 'A': ep.record.dir = optarg; break;
+		case 'Z': ep.record.max_bytes = (uint64_t) atoi(optarg) << 20; break;
+		case 'X': ep.record.max_seconds = atof(optarg); break;
+		case 'U': ep.record.prealloc = (uint64_t) atoi(optarg) << 20; break;
+		case 'd': ep.record.direct = 1; break;
+		case 'y': ep.record.buffers = atoi(optarg); break;
+		case 'e': ep.dvr_dir = optarg; break;
+		case 'm': ep.dvr_minutes = atoi(optarg); break;
+		case 'n': ep.emulate = atoi(optarg); break;
+		case 't': ep.emulate_ts = optarg; break;
+		case 'w': ep.emulate_kbps = atoi(optarg); break;
+		case 'H':
+			if (!strchr(optarg, ':') && optarg[0] != '/') {
+				snprintf(http_port, sizeof(http_port), "0.0.0.0:%s", optarg);
+				optarg = http_port;
+			}
+			if (!set_output_spec(&http_spec, OUTPUT_HTTP, optarg))
+				return usage();
+			break;
 		case 'R': ep.respawn = 1; break;
+		case 'p': ep.persist = 1; break;
+		case 'g': ep.rebase = 1; break;
 		case 'f':
 			if ((firmware_fd = open(optarg, O_DIRECTORY|O_RDONLY|O_CLOEXEC)) < 0) {
 				perror("open");
@@ -1419,12 +3634,43 @@ int main(int argc, char **argv)
 			ep.input_source = i;
 			break;
 		case 'z': ep.pipe_sz = atoi(optarg); break;
+		case 'T': ep.usb_transfers = atoi(optarg); break;
+		case 'r': ep.ring_kb = atoi(optarg); break;
 		case '0': ep.src_x = atoi(optarg); break;
 		case '1': ep.src_y = atoi(optarg); break;
 		case '2': ep.src_width = atoi(optarg); break;
 		case '3': ep.src_height = atoi(optarg); break;
 		case '4': ep.dst_width = atoi(optarg); break;
 		case '5': ep.dst_height = atoi(optarg); break;
+		case '6': verify_registers = 1; break;
+		case '7': ep.vmsplice = 1; break;
+		case '8': ts_filter_drop(&pid_filter, BMD_PID_AUDIO); break;
+		case '9': ts_filter_drop(&pid_filter, BMD_PID_SIT); break;
+		case 'N': pid_filter.keep_null = 1; break;
+		case 'D':
+			pid = strtol(optarg, &end, 0);
+			if (*end || pid < 0 || pid > TS_NULL_PID)
+				return usage();
+			ts_filter_drop(&pid_filter, pid);
+			break;
+		case 'M':
+			pid = strtol(optarg, &end, 0);
+			if ((*end != '=' && *end != ':') || pid < 0 || pid > TS_NULL_PID)
+				return usage();
+			new_pid = strtol(end + 1, &end, 0);
+			if (*end || new_pid < 0 || new_pid >= TS_NULL_PID)
+				return usage();
+			ts_filter_remap(&pid_filter, pid, new_pid);
+			break;
+		case 'G': ep.lag_kb = atoi(optarg); break;
+		case 'Y':
+			for (i = 0; i < array_size(ts_lag_policy_names); i++)
+				if (strcmp(optarg, ts_lag_policy_names[i]) == 0)
+					break;
+			if (i >= array_size(ts_lag_policy_names))
+				return usage();
+			ep.lag_policy = i;
+			break;
 		default:
 			return usage();
 		}
@@ -1432,39 +3678,118 @@ int main(int argc, char **argv)
 
 	if (ep.fps_divider <= 0 || ep.fps_divider > 2) ep.fps_divider = 1;
 	if (ep.video_max_kbps < ep.video_kbps) ep.video_max_kbps = ep.video_kbps + 100;
+	if (ep.usb_transfers < 1 || ep.usb_transfers > 32) ep.usb_transfers = 8;
+	if (ep.dvr_minutes < 1) ep.dvr_minutes = 1;
+	/* The buffer is a shared mapping, on a disk file system writeback of
+	 * its dirty pages would stall the stream */
+	if (ep.dvr_dir && (statfs(ep.dvr_dir, &sfs) < 0 ||
+	    (sfs.f_type != TMPFS_MAGIC && sfs.f_type != RAMFS_MAGIC))) {
+		fprintf(stderr, "--dvr %s: not a tmpfs (like /dev/shm)\n", ep.dvr_dir);
+		return 1;
+	}
+	if (ep.emulate_kbps == 0) ep.emulate_kbps = ep.video_kbps + ep.audio_kbps;
+	if (ep.num_outputs == 0 && !http_spec.dest && !ep.hls_dir && !ep.record.dir &&
+	    !ep.dvr_dir)
+		add_output(OUTPUT_PIPE, NULL);
+
+	if (do_syslog)
+		openlog("bmd-tools", 0, LOG_DAEMON);
 
-	firmwares[0] = load_firmware("bmd-atemtvstudio.bin", USB_PID_BMD_ATEM_TV_STUDIO);
-	firmwares[1] = load_firmware("bmd-h264prorecorder.bin", USB_PID_BMD_H264_PRO_RECORDER);
+	dlog(LOG_INFO, "mpeg-ts scanner: %s", ts_scan_select(NULL));
 
-	if (!firmwares[0] || !firmwares[1]) {
-		msg = "load firmware", ec = 1;
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		msg = "create event loop", ec = 1;
 		goto error;
 	}
 
-	if (do_syslog)
-		openlog("bmd-tools", 0, LOG_DAEMON);
+	if (http_spec.dest && !http_start()) {
+		dlog(LOG_ERR, "failed to start http server on %s: %s", http_spec.dest, strerror(errno));
+		ec = 1;
+		goto error;
+	}
+
+	for (i = 0; i < ep.emulate; i++) {
+		if (!emulate_device(i)) {
+			dlog(LOG_ERR, "failed to add emulated device: out of memory");
+			ec = 1;
+			goto error;
+		}
+	}
 
+	/* Emulated devices do without USB, say in a container */
 	r = libusb_init(&ctx);
 	if (r != LIBUSB_SUCCESS) {
-		msg = "initialize usb library", ec = 1;
-		goto error;
+		if (!ep.emulate) {
+			msg = "initialize usb library", ec = 1;
+			goto error;
+		}
+		dlog(LOG_WARNING, "usb not available: %s", libusb_error_name(r));
+		ctx = NULL;
 	}
+	usb_ctx = ctx;
+
+	if (ctx) {
+		r = libusb_hotplug_register_callback(
+			ctx,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+			LIBUSB_HOTPLUG_ENUMERATE,
+			USB_VID_BLACKMAGIC_DESIGN,
+			LIBUSB_HOTPLUG_MATCH_ANY,
+			LIBUSB_HOTPLUG_MATCH_ANY,
+			handle_hotplug, NULL, &cbhandle);
+		if (r != LIBUSB_SUCCESS) {
+			msg = "register callback", ec = 1;
+			goto error;
+		}
 
-	r = libusb_hotplug_register_callback(
-		ctx,
-		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
-		LIBUSB_HOTPLUG_ENUMERATE,
-		USB_VID_BLACKMAGIC_DESIGN,
-		LIBUSB_HOTPLUG_MATCH_ANY,
-		LIBUSB_HOTPLUG_MATCH_ANY,
-		handle_hotplug, NULL, &cbhandle);
-	if (r != LIBUSB_SUCCESS) {
-		msg = "register callback", ec = 1;
-		goto error;
+		pollfds = libusb_get_pollfds(ctx);
+		for (i = 0; pollfds && pollfds[i]; i++)
+			usb_pollfd_added(pollfds[i]->fd, pollfds[i]->events, NULL);
+		libusb_free_pollfds(pollfds);
+		libusb_set_pollfd_notifiers(ctx, usb_pollfd_added, usb_pollfd_removed, NULL);
 	}
 
-	while (running || num_workers)
-		libusb_handle_events(ctx);
+	while (running || devices) {
+		struct epoll_event events[32];
+		struct event_handler *eh;
+		struct blackmagic_device *bmd, *next, **pbmd;
+		struct timespec now;
+		struct timeval tv;
+		int n, timeout = devices ? 100 : 1000;
+
+		if (ctx && libusb_get_next_timeout(ctx, &tv) == 1 &&
+		    tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000 < timeout)
+			timeout = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+
+		n = epoll_wait(epoll_fd, events, array_size(events), timeout);
+		for (i = 0; i < n; i++) {
+			eh = events[i].data.ptr;
+			if (eh->handler)
+				eh->handler(eh, events[i].events);
+		}
+		if (n == 0 && ctx)
+			handle_usb_event(NULL, 0);
+
+		if (dump_stats) {
+			dump_stats = 0;
+			for (bmd = devices; bmd; bmd = bmd->next)
+				bmd_report_stream_stats(bmd, LOG_NOTICE, 1);
+			report_cpu();
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		http_expire(&now);
+		for (bmd = devices; bmd; bmd = next) {
+			next = bmd->next;
+			if (bmd_process(bmd, &now))
+				continue;
+			for (pbmd = &devices; *pbmd != bmd; pbmd = &(*pbmd)->next);
+			*pbmd = bmd->next;
+			bmd_close(bmd);
+		}
+		http_reap();
+	}
 
 error:
 	// wait child processes to terminate
@@ -0,0 +1,1013 @@
+/* BlackMagic Design tools - MPEG-TS scanner benchmark
+ *
+ * Runs recorded captures through the packet scanner implementations and
+ * the original byte-at-a-time parser loop, checks that they agree and
+ * reports throughput. Without capture files a synthetic stream with null
+ * packets, zero fill and occasional garbage is used.
+ *
+ * With --udp the UDP/RTP sender is measured instead, sending the stream
+ * over loopback to a local socket. With --hls the stream is cut into HLS
+ * segments in the given directory, for comparison with the same done by
+ * "ffmpeg -i capture.ts -c copy -f hls". With --record the stream is
+ * recorded --streams times over at once, each copy at its real time
+ * rate, and the time spent in the recorder calls is reported.
+ *
+ * With --pipeline the stream goes through mpegparser_parse() and the
+ * stream buffer into each output as fast as the output takes it, fed in
+ * USB transfer sized and in odd sized chunks. Without capture files the
+ * parser's worst cases run as well: a stray byte after every packet and
+ * nothing but null packets. System calls are those made for the output
+ * on the parser's thread; the HLS writer thread's are not counted. The
+ * http output is a loopback TCP connection sent to the way bmd-streamer
+ * sends to its HTTP clients; on loopback the kernel copies zero copy
+ * sends anyway, so after the first completion they are plain sends.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mpegts.h"
+#include "tsnet.h"
+#include "hls.h"
+#include "record.h"
+#include "dvr.h"
+#include "tsring.h"
+#include "tsout.h"
+
+#define array_size(x)	(sizeof(x) / sizeof(x[0]))
+
+/* Chunk size matching the USB bulk transfers of bmd-streamer */
+#define CHUNK_SIZE	(16*1024)
+
+/* Stream bitrate the UDP sender CPU time is scaled to, and that of the
+ * synthetic stream */
+#define STREAM_KBPS	30000
+
+/* Synthetic stream: video PES with an IDR and a PTS every second */
+#define SYNTH_PID_VIDEO	0x1011
+#define SYNTH_PID_AUDIO	0x1111
+#define SYNTH_RAP_PACKETS (STREAM_KBPS * 1000 / 8 / TS_PACKET_SIZE)
+
+/* Pipeline: PIDs and buffer sizes as bmd-streamer uses by default */
+#define PIPE_PID_PMT	0x0100
+#define PIPE_PID_SIT	0x001f
+#define PIPE_PID_PCR	0x1001
+#define PIPE_RING_KB	4096
+#define PIPE_SIZE	(1024*1024)
+#define PIPE_DVR_MB	64
+
+struct result {
+	uint64_t packets, runs, hash;
+};
+
+/* The loop mpegparser_parse used before the vectorized scanner */
+static int legacy_scan(unsigned char *buf, int len, const struct ts_filter *f, struct ts_stats *st,
+		       struct iovec *iov, int maxiov, int *pos)
+{
+	int i = 0, ioc = 0, nomerge = 1;
+
+	while (i + 0xbc <= len) {
+		if (memcmp(&buf[i], "\x00\x00\x00\x00", 4) == 0) goto skip_block;
+		if (buf[i] != 0x47) {
+			while (i < len && buf[i] != 0x47)
+				i++;
+			goto skip;
+		}
+		if (buf[i+1] == 0x1f && buf[i+2] == 0xff) {
+		skip_block:
+			i += 0xbc;
+		skip:
+			nomerge = 1;
+			continue;
+		}
+
+		if (nomerge) {
+			if (ioc >= maxiov)
+				break;
+			nomerge = 0;
+			iov[ioc].iov_base = (void *) &buf[i];
+			iov[ioc].iov_len = 0xbc;
+			ioc++;
+		} else {
+			iov[ioc-1].iov_len += 0xbc;
+		}
+		i += 0xbc;
+	}
+
+	*pos = i;
+	return ioc;
+}
+
+/* Feeds the capture in CHUNK_SIZE pieces the way bmd-streamer does. The
+ * partial packet carried over to the next transfer is already in front
+ * of it in the capture, so the chunks are scanned in place. */
+static void run(int (*scan)(unsigned char *, int, const struct ts_filter *, struct ts_stats *,
+			    struct iovec *, int, int *),
+		unsigned char *data, size_t size, const struct ts_filter *f, struct ts_stats *st,
+		struct result *res)
+{
+	struct iovec iov[64];
+	size_t cur = 0, end;
+	int j, ioc, pos;
+
+	memset(res, 0, sizeof(*res));
+	for (end = 0; end < size; ) {
+		end = size - end < CHUNK_SIZE ? size : end + CHUNK_SIZE;
+		do {
+			ioc = scan(&data[cur], end - cur, f, st, iov, array_size(iov), &pos);
+			for (j = 0; j < ioc; j++) {
+				res->packets += iov[j].iov_len / TS_PACKET_SIZE;
+				res->hash = (res->hash ^ ((unsigned char *) iov[j].iov_base - data)) * 0x100000001b3ULL;
+				res->hash = (res->hash ^ iov[j].iov_len) * 0x100000001b3ULL;
+			}
+			res->runs += ioc;
+			cur += pos;
+		} while (ioc == array_size(iov));
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fastest of 'iterations' passes: on a shared or single core machine the
+ * total is mostly a measure of what else ran meanwhile */
+static double run_best(int (*scan)(unsigned char *, int, const struct ts_filter *, struct ts_stats *,
+				   struct iovec *, int, int *),
+		       unsigned char *data, size_t size, struct ts_stats *st, struct result *res,
+		       int iterations)
+{
+	double t, best = 0;
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		t = now();
+		run(scan, data, size, NULL, st, res);
+		t = now() - t;
+		if (!i || t < best)
+			best = t;
+	}
+	return best;
+}
+
+static unsigned char *synthesize(size_t size)
+{
+	unsigned char *data, *p, cc[2] = { 0, 0 };
+	unsigned int n, seed = 1;
+	uint64_t pts;
+	size_t off;
+
+	data = malloc(size);
+	if (!data)
+		return NULL;
+
+	for (off = 0, n = 0; off + TS_PACKET_SIZE <= size; off += TS_PACKET_SIZE, n++) {
+		p = &data[off];
+		seed = seed * 1103515245 + 12345;
+		memset(p, seed >> 16, TS_PACKET_SIZE);
+		if (n % 1000 == 999) {
+			/* zero fill */
+			memset(p, 0, TS_PACKET_SIZE);
+		} else if (n % 10 == 9) {
+			p[0] = TS_SYNC_BYTE;
+			p[1] = 0x1f;
+			p[2] = 0xff;
+		} else if (n % SYNTH_RAP_PACKETS == 1) {
+			/* PES start, SPS and IDR NAL units */
+			pts = (uint64_t) n * 90000 / SYNTH_RAP_PACKETS;
+			p[0] = TS_SYNC_BYTE;
+			p[1] = 0x40 | (SYNTH_PID_VIDEO >> 8);
+			p[2] = SYNTH_PID_VIDEO & 0xff;
+			p[3] = 0x10 | (cc[0]++ & 15);
+			memcpy(&p[4], "\x00\x00\x01\xe0\x00\x00\x80\x80\x05", 9);
+			p[13] = 0x21 | ((pts >> 29) & 0x0e);
+			p[14] = pts >> 22;
+			p[15] = (pts >> 14) | 1;
+			p[16] = pts >> 7;
+			p[17] = (pts << 1) | 1;
+			memcpy(&p[18], "\x00\x00\x00\x01\x67\x00\x00\x00\x01\x65", 10);
+		} else {
+			p[0] = TS_SYNC_BYTE;
+			p[1] = 0x10 | ((n % 7) == 0);
+			p[2] = 0x11;
+			p[3] = 0x10 | (cc[p[1] & 1]++ & 15);
+		}
+		if (n % 5000 == 4999) {
+			/* lose sync for a while */
+			memset(p, 0, 100);
+			memset(p + 1, 0x55, 99);
+			off += 100;
+		}
+	}
+	memset(&data[off], 0, size - off);
+	return data;
+}
+
+/* Parser worst cases: a stray byte after every packet, so that each one
+ * is only found by resyncing and is a run of its own */
+static unsigned char *synthesize_resync(size_t size)
+{
+	unsigned char *data;
+	unsigned int n;
+	size_t off;
+
+	data = malloc(size);
+	if (!data)
+		return NULL;
+	memset(data, 0x55, size);
+	for (off = 0, n = 0; off + TS_PACKET_SIZE <= size; off += TS_PACKET_SIZE + 1, n++) {
+		data[off] = TS_SYNC_BYTE;
+		data[off + 1] = SYNTH_PID_VIDEO >> 8;
+		data[off + 2] = SYNTH_PID_VIDEO & 0xff;
+		data[off + 3] = 0x10 | (n & 15);
+	}
+	return data;
+}
+
+/* ... and nothing but null packets */
+static unsigned char *synthesize_null(size_t size)
+{
+	unsigned char *data;
+	size_t off;
+
+	data = malloc(size);
+	if (!data)
+		return NULL;
+	memset(data, 0xff, size);
+	for (off = 0; off + TS_PACKET_SIZE <= size; off += TS_PACKET_SIZE)
+		memcpy(&data[off], "\x47\x1f\xff\x10", 4);
+	return data;
+}
+
+static int usage(void)
+{
+	fprintf(stderr,
+		"usage: bmd-tsbench [-n iterations] [-s synthetic-megabytes] [-u] [-p] [-H dir] [-R dir [-N streams] [-D] [-P MB]] [capture.ts...]\n"
+		"	-u,--udp	Benchmark the UDP/RTP sender over loopback\n"
+		"	-p,--pipeline	Benchmark the parser feeding each output at full speed,\n"
+		"			with -H and -R also the HLS segmenter and the recorder\n"
+		"	-H,--hls DIR	Benchmark the HLS segmenter writing to DIR\n"
+		"	-R,--record DIR	Benchmark the disk recorder writing to DIR\n"
+		"	-N,--streams N	Streams recorded at once (16)\n"
+		"	-D,--direct	Record with O_DIRECT\n"
+		"	-P,--prealloc MB	Preallocate recorded files\n");
+	return 1;
+}
+
+/* Runs the capture through the scanner and the HLS segmenter once; the
+ * cost is given as CPU time per second of stream */
+static int bench_hls(const char *name, const char *dir, unsigned char *data, size_t size)
+{
+	struct iovec iov[64];
+	struct hls h;
+	struct hls_stats st;
+	size_t cur = 0, end;
+	double t;
+	int ioc, pos;
+
+	if (!hls_open(&h, dir, "bench", 6, 6, 0x100, SYNTH_PID_VIDEO, NULL)) {
+		perror("hls");
+		return 1;
+	}
+	t = now();
+	for (end = 0; end < size; ) {
+		end = size - end < CHUNK_SIZE ? size : end + CHUNK_SIZE;
+		do {
+			ioc = ts_scan(&data[cur], end - cur, NULL, NULL, iov, array_size(iov), &pos);
+			hls_write(&h, iov, ioc);
+			cur += pos;
+		} while (ioc == array_size(iov));
+	}
+	hls_close(&h);
+	t = now() - t;
+	hls_get_stats(&h, &st);
+
+	printf("%s: hls %llu segments, %.1f s of stream in %.3f s\n", name,
+	       (unsigned long long) st.segments, st.media_s, t);
+	if (st.media_s > 0)
+		printf("  time per stream: %.3f%% segmenting, %.3f%% writing (%llu dropped, %llu errors)\n",
+		       st.cut_s * 100 / st.media_s, st.write_s * 100 / st.media_s,
+		       (unsigned long long) st.dropped, (unsigned long long) st.errors);
+	return st.errors != 0;
+}
+
+static double cpu_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_us(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/* Feeds one chunk to every recorder per chunk period of a STREAM_KBPS
+ * stream, as the USB completions of as many devices would, and times
+ * each rec_write() call */
+static int bench_record(const char *name, const struct rec_config *cfg, int streams,
+			unsigned char *data, size_t size)
+{
+	struct iovec iov[64];
+	struct recorder *rec;
+	struct timespec next, t0, t1;
+	int64_t *lat, period_ns = (int64_t) CHUNK_SIZE * 8 * 1000000 / STREAM_KBPS;
+	size_t cur = 0, end, nlat = 0, chunks = size / CHUNK_SIZE + 1;
+	uint64_t bytes = 0, dropped = 0, errors = 0, writes = 0, write_us = 0, write_max_us = 0;
+	double t, cpu;
+	int i, ioc, pos, queued_max = 0, ec = 0;
+	char rname[32];
+
+	rec = calloc(streams, sizeof(*rec));
+	lat = calloc(chunks * streams * 2, sizeof(*lat));
+	if (!rec || !lat)
+		return 1;
+	for (i = 0; i < streams; i++) {
+		snprintf(rname, sizeof(rname), "bench-%d", i);
+		if (!rec_open(&rec[i], cfg, rname, 0x100, SYNTH_PID_VIDEO, NULL)) {
+			perror("record");
+			return 1;
+		}
+	}
+
+	printf("%s: recording %d streams of %d Mbit/s, %.1f s%s\n", name, streams, STREAM_KBPS / 1000,
+	       size * 8.0 / STREAM_KBPS / 1000, cfg->direct ? ", O_DIRECT" : "");
+	t = now();
+	cpu = cpu_now();
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (end = 0; end < size; ) {
+		end = size - end < CHUNK_SIZE ? size : end + CHUNK_SIZE;
+		do {
+			ioc = ts_scan(&data[cur], end - cur, NULL, NULL, iov, array_size(iov), &pos);
+			for (i = 0; i < streams; i++) {
+				clock_gettime(CLOCK_MONOTONIC, &t0);
+				rec_write(&rec[i], iov, ioc);
+				clock_gettime(CLOCK_MONOTONIC, &t1);
+				if (nlat < chunks * streams * 2)
+					lat[nlat++] = (t1.tv_sec - t0.tv_sec) * 1000000LL +
+						      (t1.tv_nsec - t0.tv_nsec) / 1000;
+			}
+			cur += pos;
+		} while (ioc == array_size(iov));
+		for (i = 0; i < streams; i++)
+			rec_reap(&rec[i], 0);
+
+		next.tv_nsec += period_ns;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+	cpu = cpu_now() - cpu;
+	for (i = 0; i < streams; i++) {
+		rec_close(&rec[i]);
+		bytes += rec[i].stats.bytes;
+		dropped += rec[i].stats.dropped;
+		errors += rec[i].stats.errors;
+		writes += rec[i].stats.writes;
+		write_us += rec[i].stats.write_us;
+		if (rec[i].stats.write_max_us > write_max_us)
+			write_max_us = rec[i].stats.write_max_us;
+		if (rec[i].stats.queued_max > queued_max)
+			queued_max = rec[i].stats.queued_max;
+	}
+	t = now() - t;
+
+	qsort(lat, nlat, sizeof(*lat), cmp_us);
+	if (nlat)
+		printf("  rec_write: p50 %lld us, p99 %lld us, p99.9 %lld us, max %lld us\n",
+		       (long long) lat[nlat / 2], (long long) lat[nlat * 99 / 100],
+		       (long long) lat[nlat * 999 / 1000], (long long) lat[nlat - 1]);
+	printf("  disk: %.1f MB/s, %llu writes, avg %.1f ms, max %.1f ms in flight, %d of %d buffers used\n",
+	       bytes / t / 1e6, (unsigned long long) writes,
+	       writes ? write_us / 1e3 / writes : 0, write_max_us / 1e3, queued_max, cfg->buffers);
+	printf("  cpu per stream: %.3f%%, %llu bytes dropped, %llu errors\n",
+	       cpu * 100 / (size * 8.0 / STREAM_KBPS / 1000) / streams,
+	       (unsigned long long) dropped, (unsigned long long) errors);
+	if (dropped || errors)
+		ec = 1;
+	free(lat);
+	free(rec);
+	return ec;
+}
+
+static uint64_t udp_drain(int fd)
+{
+	static unsigned char buf[16][TS_RTP_HEADER + TS_UDP_PAYLOAD];
+	struct mmsghdr msg[16];
+	struct iovec iov[16];
+	uint64_t n = 0;
+	int i, r;
+
+	do {
+		memset(msg, 0, sizeof(msg));
+		for (i = 0; i < 16; i++) {
+			iov[i].iov_base = buf[i];
+			iov[i].iov_len = sizeof(buf[i]);
+			msg[i].msg_hdr.msg_iov = &iov[i];
+			msg[i].msg_hdr.msg_iovlen = 1;
+		}
+		r = recvmmsg(fd, msg, 16, MSG_DONTWAIT, NULL);
+		if (r > 0)
+			n += r;
+	} while (r > 0);
+	return n;
+}
+
+/* Sends the data as packets in CHUNK_SIZE pieces like bmd-streamer does
+ * for each USB transfer. The "send" mode is the one datagram per system
+ * call baseline. CPU time is that of the sending calls, which on
+ * loopback includes delivery to the receiving socket. */
+static int bench_udp(unsigned char *data, size_t size, int iterations)
+{
+	static const char *modes[] = { "send", "sendmmsg", "rtp", "gso" };
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	struct ts_udp u;
+	unsigned int packets = size / TS_PACKET_SIZE, chunk = CHUNK_SIZE / TS_PACKET_SIZE;
+	unsigned int off, n, done;
+	uint64_t datagrams, received;
+	double t, cpu, c;
+	int i, k, r, rx, rcvbuf = 8 << 20;
+
+	rx = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (rx < 0 || bind(rx, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+	    getsockname(rx, (struct sockaddr *) &sin, &len) < 0) {
+		perror("udp receiver");
+		return 1;
+	}
+	setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	printf("udp loopback: %u packets, %d iterations\n", packets, iterations);
+	for (k = 0; k < array_size(modes); k++) {
+		if (!ts_udp_open(&u, (struct sockaddr *) &sin, sizeof(sin), k == 2, 0, NULL,
+				 1 << 20, k == 3)) {
+			perror("udp sender");
+			return 1;
+		}
+		if (k == 3 && !u.gso) {
+			printf("  %-10s not supported\n", modes[k]);
+			ts_udp_close(&u);
+			continue;
+		}
+
+		datagrams = received = 0;
+		cpu = 0;
+		t = now();
+		for (i = 0; i < iterations; i++) {
+			for (off = 0; off + TS_UDP_PACKETS <= packets; off += done) {
+				n = packets - off < chunk ? packets - off : chunk;
+				c = cpu_now();
+				if (k == 0) {
+					for (done = 0; done + TS_UDP_PACKETS <= n; done += TS_UDP_PACKETS)
+						if (send(u.fd, &data[(off + done) * TS_PACKET_SIZE],
+							 TS_UDP_PAYLOAD, 0) < 0)
+							break;
+					r = done ? done : -1;
+				} else {
+					r = ts_udp_send(&u, &data[off * TS_PACKET_SIZE], n, NULL, 0);
+				}
+				cpu += cpu_now() - c;
+				done = r > 0 ? r : 0;
+				datagrams += done / TS_UDP_PACKETS;
+				received += udp_drain(rx);
+				if (r < 0 && errno != EAGAIN && errno != ENOBUFS) {
+					perror("send");
+					return 1;
+				}
+			}
+		}
+		t = now() - t;
+		received += udp_drain(rx);
+		ts_udp_close(&u);
+
+		printf("  %-10s %8.0f kpps %8.0f Mbit/s  %6.3f%% CPU per %d Mbit/s stream%s\n",
+		       modes[k], datagrams / t / 1e3,
+		       datagrams * TS_UDP_PAYLOAD * 8.0 / t / 1e6,
+		       cpu * 100 * STREAM_KBPS * 1e3 / (datagrams * TS_UDP_PAYLOAD * 8.0),
+		       STREAM_KBPS / 1000, received < datagrams ? "  LOSS" : "");
+		if (received < datagrams)
+			printf("  %llu of %llu datagrams lost\n",
+			       (unsigned long long) (datagrams - received), (unsigned long long) datagrams);
+	}
+
+	close(rx);
+	return 0;
+}
+
+enum PIPE_OUTPUT {
+	OUT_RING = 0,		/* parser and ring only */
+	OUT_PIPE,
+	OUT_SPLICE,
+	OUT_HTTP,
+	OUT_UDP,
+	OUT_RTP,
+	OUT_DVR,
+	OUT_HLS,
+	OUT_RECORD,
+};
+
+static const char *pipe_outputs[] = {
+	[OUT_RING] = "ring",
+	[OUT_PIPE] = "pipe",
+	[OUT_SPLICE] = "vmsplice",
+	[OUT_HTTP] = "http",
+	[OUT_UDP] = "udp",
+	[OUT_RTP] = "rtp",
+	[OUT_DVR] = "dvr",
+	[OUT_HLS] = "hls",
+	[OUT_RECORD] = "record",
+};
+
+/* Chunk sizes fed to the parser: those of the USB transfers, or odd
+ * sizes from a single byte up so that packets straddle nearly every
+ * chunk boundary */
+static const char *pipe_chunkings[] = { "usb", "misaligned" };
+
+struct pipeline {
+	int output;
+	struct ts_ring ring;
+	struct ts_reader rd;
+	struct ts_stats stats;
+	struct ts_join join;
+	struct mpeg_parser_buffer pb;
+	int fd[2];
+	pthread_t drain;
+	struct ts_tcp tcp;
+	struct ts_udp udp;
+	int rx;
+	struct dvr dvr;
+	struct hls hls;
+	struct recorder rec;
+	uint64_t calls, datagrams, received;
+};
+
+/* Reads what is in the pipe or socket, as a consumer would; with
+ * vmsplice that is what copies the ring pages out */
+static void *pipe_drain(void *arg)
+{
+	struct pipeline *pl = arg;
+	unsigned char *buf = malloc(PIPE_SIZE);
+	ssize_t r;
+
+	while (buf && ((r = read(pl->fd[0], buf, PIPE_SIZE)) > 0 || (r < 0 && errno == EINTR)))
+		;
+	free(buf);
+	return NULL;
+}
+
+/* Sends as bmd-streamer does to an HTTP client, except that a full
+ * socket is waited for here */
+static int tcp_write(struct pipeline *pl)
+{
+	struct pollfd pfd = { .fd = pl->fd[1], .events = POLLOUT };
+	ssize_t r;
+
+	if (pl->rd.pinning) {
+		pl->calls++;
+		ts_tcp_completions(&pl->tcp);
+		ts_tcp_update_pin(&pl->tcp);
+	}
+	while ((r = ts_pipe_write(&pl->ring, &pl->rd, pl->fd[1], 1, ts_tcp_send, &pl->tcp))) {
+		pl->calls++;
+		if (r > 0 || errno == EINTR)
+			continue;
+		if (errno != EAGAIN) {
+			perror("send");
+			return 0;
+		}
+		pl->calls++;
+		if (poll(&pfd, 1, -1) > 0 && (pfd.revents & POLLERR) && pl->rd.pinning) {
+			ts_tcp_completions(&pl->tcp);
+			ts_tcp_update_pin(&pl->tcp);
+		}
+	}
+	return 1;
+}
+
+/* Drains the ring to the output with the writes bmd_output_write() makes,
+ * except that they block: the consumer keeps up as fast as it can */
+static int pipe_write(struct pipeline *pl)
+{
+	struct ts_ring *ring = &pl->ring;
+	struct ts_reader *rd = &pl->rd;
+	ssize_t r;
+
+	if (pl->output == OUT_UDP || pl->output == OUT_RTP) {
+		while (ring->head - rd->cursor >= TS_UDP_PACKETS) {
+			r = ts_udp_write(&pl->udp, ring, rd);
+			if (r > 0) {
+				pl->datagrams += r / TS_UDP_PACKETS;
+			} else if (r < 0 && errno != EAGAIN && errno != ENOBUFS) {
+				perror("send");
+				return 0;
+			}
+			pl->received += udp_drain(pl->rx);
+		}
+		return 1;
+	}
+
+	if (pl->output == OUT_HTTP)
+		return tcp_write(pl);
+
+	if (rd->pinning) {
+		pl->calls++;
+		ts_pipe_update_pin(rd, pl->fd[1]);
+	}
+	while ((r = ts_pipe_write(ring, rd, pl->fd[1], 0, NULL, NULL))) {
+		pl->calls++;
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
+			perror("pipe");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* A connected loopback TCP socket pair, fd[1] the accepted end */
+static int tcp_pair(int fd[2])
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int l;
+
+	l = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fd[0] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	fd[1] = -1;
+	if (l >= 0 && fd[0] >= 0 &&
+	    bind(l, (struct sockaddr *) &sin, sizeof(sin)) == 0 && listen(l, 1) == 0 &&
+	    getsockname(l, (struct sockaddr *) &sin, &len) == 0 &&
+	    connect(fd[0], (struct sockaddr *) &sin, sizeof(sin)) == 0)
+		fd[1] = accept4(l, NULL, NULL, SOCK_CLOEXEC);
+	if (l >= 0)
+		close(l);
+	return fd[1] >= 0;
+}
+
+static int pipe_open(struct pipeline *pl, const char *hls_dir, const struct rec_config *rc)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	char path[PATH_MAX];
+	int rcvbuf = 8 << 20;
+
+	if (!ts_ring_init(&pl->ring, PIPE_RING_KB))
+		return 0;
+	pl->ring.video_pid = SYNTH_PID_VIDEO;
+	ts_stats_init(&pl->stats, PIPE_PID_PCR);
+	ts_join_init(&pl->join, PIPE_PID_PMT, SYNTH_PID_VIDEO, PIPE_PID_SIT);
+	pl->pb.ring = &pl->ring;
+	pl->pb.stats = &pl->stats;
+	pl->pb.join = &pl->join;
+
+	switch (pl->output) {
+	case OUT_PIPE:
+	case OUT_SPLICE:
+		if (pipe2(pl->fd, O_CLOEXEC) < 0)
+			return 0;
+		fcntl(pl->fd[1], F_SETPIPE_SZ, PIPE_SIZE);
+		if (pthread_create(&pl->drain, NULL, pipe_drain, pl) != 0)
+			return 0;
+		ts_ring_attach(&pl->ring, &pl->rd, 0, TS_LAG_DROP, pl->output == OUT_SPLICE);
+		break;
+	case OUT_HTTP:
+		if (!tcp_pair(pl->fd))
+			return 0;
+		if (pthread_create(&pl->drain, NULL, pipe_drain, pl) != 0)
+			return 0;
+		ts_ring_attach(&pl->ring, &pl->rd, 0, TS_LAG_DROP,
+			       ts_tcp_init(&pl->tcp, pl->fd[1], &pl->rd));
+		break;
+	case OUT_UDP:
+	case OUT_RTP:
+		pl->rx = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (pl->rx < 0 || bind(pl->rx, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+		    getsockname(pl->rx, (struct sockaddr *) &sin, &len) < 0)
+			return 0;
+		setsockopt(pl->rx, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+		if (!ts_udp_open(&pl->udp, (struct sockaddr *) &sin, sizeof(sin), pl->output == OUT_RTP,
+				 0, NULL, 1 << 20, 1))
+			return 0;
+		ts_ring_attach(&pl->ring, &pl->rd, 0, TS_LAG_DROP, 0);
+		break;
+	case OUT_DVR:
+		snprintf(path, sizeof(path), "%s/bmd-tsbench.dvr", getenv("TMPDIR") ?: "/tmp");
+		if (!dvr_create(&pl->dvr, path, (uint64_t) PIPE_DVR_MB << 20, 4096,
+				PIPE_PID_PMT, SYNTH_PID_VIDEO, PIPE_PID_PCR))
+			return 0;
+		unlink(path);
+		pl->pb.dvr = &pl->dvr;
+		break;
+	case OUT_HLS:
+		if (!hls_open(&pl->hls, hls_dir, "bench", 6, 6, PIPE_PID_PMT, SYNTH_PID_VIDEO, NULL))
+			return 0;
+		pl->pb.hls = &pl->hls;
+		break;
+	case OUT_RECORD:
+		if (!rec_open(&pl->rec, rc, "bench", PIPE_PID_PMT, SYNTH_PID_VIDEO, NULL))
+			return 0;
+		pl->pb.rec = &pl->rec;
+		break;
+	}
+	return 1;
+}
+
+/* Returns the packets the output lost */
+static uint64_t pipe_close(struct pipeline *pl)
+{
+	struct hls_stats hs;
+	uint64_t lost = pl->rd.overruns;
+
+	switch (pl->output) {
+	case OUT_PIPE:
+	case OUT_SPLICE:
+	case OUT_HTTP:
+		close(pl->fd[1]);
+		pthread_join(pl->drain, NULL);
+		close(pl->fd[0]);
+		break;
+	case OUT_UDP:
+	case OUT_RTP:
+		pl->received += udp_drain(pl->rx);
+		pl->calls = pl->udp.calls;
+		ts_udp_close(&pl->udp);
+		close(pl->rx);
+		lost += (pl->datagrams - pl->received) * TS_UDP_PACKETS;
+		break;
+	case OUT_DVR:
+		dvr_close(&pl->dvr);
+		break;
+	case OUT_HLS:
+		hls_close(&pl->hls);
+		hls_get_stats(&pl->hls, &hs);
+		lost += hs.dropped;
+		break;
+	case OUT_RECORD:
+		rec_close(&pl->rec);
+		pl->calls = pl->rec.stats.writes;
+		lost += pl->rec.stats.dropped / 0xbc;
+		break;
+	}
+	ts_ring_free(&pl->ring);
+	return lost;
+}
+
+/* Feeds the data to mpegparser_parse() in place, there is always a
+ * packet's worth of headroom in front of a chunk but the first one, and
+ * what the parser copies there is what is there already. Each chunk is
+ * followed by a pass over the output, as bmd-streamer does after each
+ * USB transfer. */
+static int bench_pipeline(const char *name, unsigned char *data, size_t size, int iterations,
+			  const char *hls_dir, const struct rec_config *rc)
+{
+	struct pipeline *pl;
+	struct timespec ts;
+	size_t cur, n;
+	unsigned int k;
+	uint64_t lost;
+	double t;
+	int c, i, out, ec = 0;
+
+	printf("%s: %zu bytes, %d iterations\n", name, size, iterations);
+	for (c = 0; c < array_size(pipe_chunkings); c++) {
+		for (out = 0; out < array_size(pipe_outputs); out++) {
+			if ((out == OUT_HLS && !hls_dir) || (out == OUT_RECORD && !rc->dir))
+				continue;
+			pl = calloc(1, sizeof(*pl));
+			if (!pl)
+				return 1;
+			pl->output = out;
+			if (!pipe_open(pl, hls_dir, rc)) {
+				fprintf(stderr, "%s: %s\n", pipe_outputs[out], strerror(errno));
+				free(pl);
+				return 1;
+			}
+
+			t = now();
+			for (i = 0; i < iterations; i++) {
+				pl->pb.oldlen = 0;
+				for (cur = 0, k = 0; cur < size; cur += n, k++) {
+					n = c ? 1 + k * 7919 % CHUNK_SIZE : CHUNK_SIZE;
+					if (n > size - cur)
+						n = size - cur;
+					clock_gettime(CLOCK_MONOTONIC, &ts);
+					pl->stats.arrival_us = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+					mpegparser_parse(&pl->pb, &data[cur], n);
+					if (pl->ring.readers && !pipe_write(pl))
+						ec = 1;
+					if (out == OUT_RECORD)
+						rec_reap(&pl->rec, 0);
+				}
+			}
+			lost = pipe_close(pl);
+			t = now() - t;
+
+			printf("  %-10s %-9s %7.2f GB/s %8.2f Mpackets/s ", pipe_chunkings[c],
+			       pipe_outputs[out], (double) size * iterations / t / 1e9,
+			       pl->stats.packets / t / 1e6);
+			if (out == OUT_HLS)
+				printf("%8s syscalls/MB", "-");
+			else
+				printf("%8.1f syscalls/MB", pl->calls * 1e6 / ((double) size * iterations));
+			if (lost)
+				printf("  %llu packets lost", (unsigned long long) lost);
+			printf("\n");
+			free(pl);
+		}
+	}
+	return ec;
+}
+
+static int bench(const char *name, unsigned char *data, size_t size, int iterations)
+{
+	static const char *scanners[] = { "scalar", "sse2", "avx2" };
+	static struct ts_stats stats, remapped;
+	struct ts_filter swap;
+	struct ts_stats *st;
+	struct result ref, res;
+	unsigned char *copy;
+	char label[16];
+	double t, base;
+	int k, ec = 0;
+
+	printf("%s: %zu bytes, best of %d iterations\n", name, size, iterations);
+
+	base = run_best(legacy_scan, data, size, NULL, &ref, iterations);
+	printf("  %-12s %8.2f GB/s  %10llu packets %8llu runs\n", "legacy",
+	       (double) size / base / 1e9,
+	       (unsigned long long) ref.packets, (unsigned long long) ref.runs);
+
+	/* Each scanner without and with the integrity counters */
+	for (k = 0; k < 2 * array_size(scanners); k++) {
+		if (!ts_scan_select(scanners[k / 2]))
+			continue;
+		st = (k & 1) ? &stats : NULL;
+		snprintf(label, sizeof(label), "%s%s", scanners[k / 2], st ? "+stats" : "");
+		t = run_best(ts_scan, data, size, st, &res, iterations);
+		printf("  %-12s %8.2f GB/s  %10llu packets %8llu runs  %5.2fx%s\n", label,
+		       (double) size / t / 1e9,
+		       (unsigned long long) res.packets, (unsigned long long) res.runs,
+		       base / t, memcmp(&res, &ref, sizeof(res)) ? "  MISMATCH" : "");
+		if (memcmp(&res, &ref, sizeof(res)))
+			ec = 1;
+	}
+
+	memset(&stats, 0, sizeof(stats));
+	run(ts_scan, data, size, NULL, &stats, &res);
+	printf("  %llu cc errors, %llu tei, %llu resyncs (%llu bytes), %llu zero-fill, %llu null packets\n",
+	       (unsigned long long) stats.cc_errors, (unsigned long long) stats.tei,
+	       (unsigned long long) stats.resyncs, (unsigned long long) stats.resync_bytes,
+	       (unsigned long long) stats.zero_packets, (unsigned long long) stats.null_packets);
+
+	/* With the video and audio PIDs swapped, the counters must still
+	 * come out under the PIDs as sent. The rewrite is done in place. */
+	copy = malloc(size);
+	if (copy) {
+		memcpy(copy, data, size);
+		ts_filter_init(&swap);
+		ts_filter_remap(&swap, SYNTH_PID_VIDEO, SYNTH_PID_AUDIO);
+		ts_filter_remap(&swap, SYNTH_PID_AUDIO, SYNTH_PID_VIDEO);
+		memset(&remapped, 0, sizeof(remapped));
+		run(ts_scan, copy, size, &swap, &remapped, &res);
+		if (memcmp(remapped.pid, stats.pid, sizeof(stats.pid)) ||
+		    remapped.cc_errors != stats.cc_errors) {
+			printf("  per-PID counters with remapped PIDs: MISMATCH\n");
+			ec = 1;
+		}
+		free(copy);
+	}
+
+	return ec;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option long_options[] = {
+		{ "iterations",	required_argument, NULL, 'n' },
+		{ "synthetic",	required_argument, NULL, 's' },
+		{ "udp",	no_argument, NULL, 'u' },
+		{ "pipeline",	no_argument, NULL, 'p' },
+		{ "hls",	required_argument, NULL, 'H' },
+		{ "record",	required_argument, NULL, 'R' },
+		{ "streams",	required_argument, NULL, 'N' },
+		{ "direct",	no_argument, NULL, 'D' },
+		{ "prealloc",	required_argument, NULL, 'P' },
+		{ NULL }
+	};
+	const char *optstring = "n:s:upH:R:N:DP:";
+	struct rec_config rc = { .buffer_kb = REC_BUFFER_KB, .buffers = REC_BUFFERS };
+	struct stat st;
+	static const char *worst_cases[] = { "synthetic", "resync", "null" };
+	unsigned char *data;
+	const char *hls_dir = NULL;
+	size_t size;
+	int i, fd, opt, iterations = 20, synthetic_mb = 64, udp = 0, pipeline = 0, streams = 16, ec = 0;
+
+	while ((opt = getopt_long(argc, argv, optstring, long_options, NULL)) > 0) {
+		switch (opt) {
+		case 'n': iterations = atoi(optarg); break;
+		case 's': synthetic_mb = atoi(optarg); break;
+		case 'u': udp = 1; break;
+		case 'p': pipeline = 1; break;
+		case 'H': hls_dir = optarg; break;
+		case 'R': rc.dir = optarg; break;
+		case 'N': streams = atoi(optarg); break;
+		case 'D': rc.direct = 1; break;
+		case 'P': rc.prealloc = (uint64_t) atoi(optarg) << 20; break;
+		default:
+			return usage();
+		}
+	}
+	if (iterations < 1 || streams < 1)
+		return usage();
+
+	if (optind >= argc && pipeline) {
+		size = (size_t) synthetic_mb * 1024 * 1024;
+		for (i = 0; i < array_size(worst_cases); i++) {
+			data = i == 0 ? synthesize(size) : i == 1 ? synthesize_resync(size) : synthesize_null(size);
+			if (!data)
+				return 1;
+			ec |= bench_pipeline(worst_cases[i], data, size, iterations, hls_dir, &rc);
+			free(data);
+		}
+		return ec;
+	}
+
+	if (optind >= argc) {
+		data = synthesize((size_t) synthetic_mb * 1024 * 1024);
+		if (!data)
+			return 1;
+		if (rc.dir)
+			ec = bench_record("synthetic", &rc, streams, data, (size_t) synthetic_mb * 1024 * 1024);
+		else if (hls_dir)
+			ec = bench_hls("synthetic", hls_dir, data, (size_t) synthetic_mb * 1024 * 1024);
+		else if (udp)
+			ec = bench_udp(data, (size_t) synthetic_mb * 1024 * 1024, iterations);
+		else
+			ec = bench("synthetic", data, (size_t) synthetic_mb * 1024 * 1024, iterations);
+		free(data);
+		return ec;
+	}
+
+	for (i = optind; i < argc; i++) {
+		fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+		if (fd < 0 || fstat(fd, &st) < 0) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			ec = 1;
+			continue;
+		}
+		data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			ec = 1;
+			continue;
+		}
+		if (pipeline)
+			ec |= bench_pipeline(argv[i], data, st.st_size, iterations, hls_dir, &rc);
+		else if (rc.dir)
+			ec |= bench_record(argv[i], &rc, streams, data, st.st_size);
+		else if (hls_dir)
+			ec |= bench_hls(argv[i], hls_dir, data, st.st_size);
+		else if (udp)
+			ec |= bench_udp(data, st.st_size, iterations);
+		else
+			ec |= bench(argv[i], data, st.st_size, iterations);
+		munmap(data, st.st_size);
+	}
+
+	return ec;
+}
@@ -0,0 +1,273 @@
+/* BlackMagic Design tools - time-shift buffer
+ *
+ * The writer runs on the stream parser's packet runs: each run is
+ * looked at for PCRs, PSI and random access points, copied into the
+ * mapping with at most two memcpy()s and published, then the index
+ * entries of the random access points in it are added. The file lives
+ * on a tmpfs, nothing is ever written explicitly; bmd-streamer refuses
+ * other file systems, whose writeback would block the writer.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mpegts.h"
+#include "dvr.h"
+
+#define DVR_PAGE		4096
+#define DVR_RUN_RAPS		16
+#define DVR_PSI_TRIES		1000	/* before a writer mid-update is given up on */
+
+static uint64_t dvr_round(uint64_t v, uint64_t to)
+{
+	return (v + to - 1) / to * to;
+}
+
+static int dvr_map(struct dvr *d, int fd, size_t size, int prot)
+{
+	void *map;
+
+	map = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return 0;
+	d->hdr = map;
+	d->map_size = size;
+	d->index = (void *) ((char *) map + d->hdr->index_offset);
+	d->data = (unsigned char *) map + d->hdr->data_offset;
+	return 1;
+}
+
+int dvr_create(struct dvr *d, const char *path, uint64_t data_size, unsigned int index_size,
+	       int pmt_pid, int video_pid, int pcr_pid)
+{
+	struct dvr_header h;
+	char tmp[PATH_MAX];
+	unsigned int n;
+	int fd, err;
+
+	memset(d, 0, sizeof(*d));
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, DVR_MAGIC, sizeof(DVR_MAGIC));
+	h.version = DVR_VERSION;
+	h.header_size = sizeof(h);
+	for (n = 64; n < index_size && n < (1u << 24); n *= 2);
+	h.index_size = n;
+	h.index_offset = dvr_round(sizeof(h), DVR_PAGE);
+	h.data_offset = dvr_round(h.index_offset + n * sizeof(struct dvr_index), DVR_PAGE);
+	h.data_size = dvr_round(data_size ?: 1, DVR_ALIGN);
+	h.pmt_pid = pmt_pid;
+	h.video_pid = video_pid;
+	h.pcr_pid = pcr_pid;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return 0;
+	if (ftruncate(fd, h.data_offset + h.data_size) < 0 ||
+	    pwrite(fd, &h, sizeof(h), 0) != sizeof(h) ||
+	    !dvr_map(d, fd, h.data_offset + h.data_size, PROT_READ | PROT_WRITE) ||
+	    rename(tmp, path) < 0) {
+		err = errno;
+		if (d->hdr)
+			munmap(d->hdr, d->map_size);
+		d->hdr = NULL;
+		close(fd);
+		unlink(tmp);
+		errno = err;
+		return 0;
+	}
+	close(fd);
+	return 1;
+}
+
+int dvr_open(struct dvr *d, const char *path)
+{
+	struct dvr_header h;
+	struct stat st;
+	int fd, ok = 0;
+
+	memset(d, 0, sizeof(*d));
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	errno = EINVAL;
+	if (fstat(fd, &st) == 0 && pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+	    memcmp(h.magic, DVR_MAGIC, sizeof(DVR_MAGIC)) == 0 && h.version == DVR_VERSION &&
+	    h.index_offset + (uint64_t) h.index_size * sizeof(struct dvr_index) <= h.data_offset &&
+	    h.data_offset + h.data_size <= (uint64_t) st.st_size && h.data_size &&
+	    (h.index_size & (h.index_size - 1)) == 0)
+		ok = dvr_map(d, fd, h.data_offset + h.data_size, PROT_READ);
+	close(fd);
+	return ok;
+}
+
+void dvr_close(struct dvr *d)
+{
+	if (d->hdr)
+		munmap(d->hdr, d->map_size);
+	d->hdr = NULL;
+}
+
+static void dvr_psi_update(struct dvr_header *h, unsigned char *dst, const unsigned char *p)
+{
+	__atomic_store_n(&h->psi_seq, h->psi_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(dst, p, TS_PACKET_SIZE);
+	__atomic_store_n(&h->psi_seq, h->psi_seq + 1, __ATOMIC_RELEASE);
+}
+
+static void dvr_clock(struct dvr *d, const unsigned char *p)
+{
+	int64_t pcr = ts_pcr(p);
+	uint64_t delta;
+
+	if (pcr < 0)
+		return;
+	delta = (pcr + TS_PCR_WRAP - d->last_pcr) % TS_PCR_WRAP;
+	if (d->have_pcr && !(p[5] & 0x80) && delta <= TS_PCR_HZ)
+		d->hdr->pcr += delta;
+	d->have_pcr = 1;
+	d->last_pcr = pcr;
+}
+
+void dvr_write(struct dvr *d, const struct iovec *iov, int ioc)
+{
+	struct dvr_header *h = d->hdr;
+	struct dvr_index raps[DVR_RUN_RAPS];
+	const unsigned char *p, *end;
+	struct timespec ts;
+	uint64_t head = h->head, off;
+	size_t len, n;
+	int64_t now_us;
+	int i, k, nraps, pid;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now_us = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+
+	for (i = 0; i < ioc; i++) {
+		p = iov[i].iov_base;
+		len = iov[i].iov_len;
+		end = p + len;
+		for (nraps = 0; p < end; p += TS_PACKET_SIZE) {
+			pid = ((p[1] & 0x1f) << 8) | p[2];
+			if (pid == h->pcr_pid && (p[3] & 0x20))
+				dvr_clock(d, p);
+			if (!(p[1] & 0x40))
+				continue;
+			if (pid == 0) {
+				dvr_psi_update(h, h->pat, p);
+			} else if (pid == h->pmt_pid) {
+				dvr_psi_update(h, h->pmt, p);
+			} else if (pid == h->video_pid && nraps < DVR_RUN_RAPS && ts_random_access(p)) {
+				raps[nraps].pos = head + (p - (const unsigned char *) iov[i].iov_base);
+				raps[nraps].pcr = h->pcr;
+				raps[nraps].time_us = now_us;
+				nraps++;
+			}
+		}
+
+		/* Announce, copy, publish */
+		__atomic_store_n(&h->reserve, head + len, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		off = head % h->data_size;
+		n = len < h->data_size - off ? len : h->data_size - off;
+		memcpy(&d->data[off], iov[i].iov_base, n);
+		memcpy(d->data, (const unsigned char *) iov[i].iov_base + n, len - n);
+		head += len;
+		__atomic_store_n(&h->head, head, __ATOMIC_RELEASE);
+
+		for (k = 0; k < nraps; k++) {
+			d->index[h->index_head & (h->index_size - 1)] = raps[k];
+			__atomic_store_n(&h->index_head, h->index_head + 1, __ATOMIC_RELEASE);
+		}
+	}
+	h->time_us = now_us;
+}
+
+uint64_t dvr_head(const struct dvr *d)
+{
+	return __atomic_load_n(&d->hdr->head, __ATOMIC_ACQUIRE);
+}
+
+ssize_t dvr_read(const struct dvr *d, uint64_t pos, void *buf, size_t len)
+{
+	const struct dvr_header *h = d->hdr;
+	uint64_t head = dvr_head(d), off;
+	size_t n;
+
+	if (pos >= head)
+		return 0;
+	if (head - pos > h->data_size)
+		return -1;
+	if (len > head - pos)
+		len = head - pos;
+	off = pos % h->data_size;
+	n = len < h->data_size - off ? len : h->data_size - off;
+	memcpy(buf, &d->data[off], n);
+	memcpy((unsigned char *) buf + n, d->data, len - n);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&h->reserve, __ATOMIC_RELAXED) > pos + h->data_size)
+		return -1;
+	return len;
+}
+
+int dvr_psi(const struct dvr *d, unsigned char *pat, unsigned char *pmt)
+{
+	const struct dvr_header *h = d->hdr;
+	uint32_t seq;
+	int i;
+
+	for (i = 0; i < DVR_PSI_TRIES; i++) {
+		seq = __atomic_load_n(&h->psi_seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		memcpy(pat, h->pat, TS_PACKET_SIZE);
+		memcpy(pmt, h->pmt, TS_PACKET_SIZE);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&h->psi_seq, __ATOMIC_RELAXED) == seq)
+			return pat[0] == TS_SYNC_BYTE && pmt[0] == TS_SYNC_BYTE;
+	}
+	return 0;
+}
+
+int dvr_find(const struct dvr *d, int key, int64_t value, int after, struct dvr_index *e)
+{
+	const struct dvr_header *h = d->hdr;
+	struct dvr_index cur;
+	uint64_t i, top = __atomic_load_n(&h->index_head, __ATOMIC_ACQUIRE);
+	uint64_t low = top > h->index_size ? top - h->index_size : 0;
+	int64_t v;
+	int found = 0;
+
+	for (i = top; i-- > low; ) {
+		cur = d->index[i & (h->index_size - 1)];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		/* Entry or its data overwritten, as are all older ones */
+		if (__atomic_load_n(&h->index_head, __ATOMIC_RELAXED) - i >= h->index_size ||
+		    __atomic_load_n(&h->reserve, __ATOMIC_RELAXED) > cur.pos + h->data_size)
+			break;
+		v = key == DVR_KEY_PCR ? (int64_t) cur.pcr : cur.time_us;
+		if (!after && v <= value) {
+			*e = cur;
+			return 1;
+		}
+		if (after) {
+			if (v < value)
+				break;
+			*e = cur;
+			found = 1;
+		}
+	}
+	return found;
+}
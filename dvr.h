@@ -0,0 +1,97 @@
+/* BlackMagic Design tools - time-shift buffer
+ *
+ * The latest stretch of a device's stream kept in a circular file that
+ * is mapped shared, so that local consumers can map it read-only and
+ * pull data from any point in it without bmd-streamer's involvement.
+ * Next to the data the file keeps an index of the random access points
+ * on the video PID with the stream time (PCR) and the wall clock time
+ * they were seen at.
+ *
+ * Positions count bytes since the file was created; data at position
+ * 'pos' is at data[pos % data_size]. The writer announces the range it
+ * is about to overwrite in 'reserve' before copying, and publishes it
+ * in 'head' once done. Readers copy first and check 'reserve' after,
+ * like a seqlock: the copy is good if reserve - data_size <= pos.
+ */
+
+#ifndef DVR_H
+#define DVR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define DVR_MAGIC		"BMDDVR1"
+#define DVR_VERSION		1
+#define DVR_ALIGN		(4096 * 0xbc)	/* data size granularity */
+
+struct dvr_index {
+	uint64_t	pos;		/* of the random access point packet */
+	uint64_t	pcr;		/* stream clock, 27 MHz */
+	int64_t		time_us;	/* CLOCK_REALTIME */
+};
+
+struct dvr_header {
+	char		magic[8];
+	uint32_t	version, header_size;
+	uint64_t	data_offset, data_size;
+	uint64_t	index_offset;
+	uint32_t	index_size;	/* entries, a power of two */
+	uint32_t	pmt_pid, video_pid, pcr_pid;
+
+	/* Updated by the writer */
+	uint64_t	reserve, head;
+	uint64_t	index_head;	/* entries written */
+	uint64_t	pcr;		/* stream clock at 'head' */
+	int64_t		time_us;	/* wall clock of the last write */
+	uint32_t	psi_seq;	/* odd while pat and pmt change */
+	unsigned char	pat[0xbc], pmt[0xbc];
+};
+
+enum DVR_KEY {
+	DVR_KEY_PCR,
+	DVR_KEY_TIME,
+};
+
+struct dvr {
+	struct dvr_header *hdr;
+	unsigned char	*data;
+	struct dvr_index *index;
+	size_t		map_size;
+
+	/* Writer: the stream clock is the PCR with wraps and jumps (encoder
+	 * restarts) taken out, so that it only ever moves forward */
+	int		have_pcr;
+	uint64_t	last_pcr;
+};
+
+/* Creates 'path' for 'data_size' bytes (rounded up to DVR_ALIGN) and
+ * 'index_size' random access points. The file is set up under a
+ * temporary name and renamed over any previous one. Returns zero with
+ * errno set on failure. */
+int dvr_create(struct dvr *d, const char *path, uint64_t data_size, unsigned int index_size,
+	       int pmt_pid, int video_pid, int pcr_pid);
+
+void dvr_write(struct dvr *d, const struct iovec *iov, int ioc);
+
+/* Maps an existing file read-only. Returns zero with errno set on failure. */
+int dvr_open(struct dvr *d, const char *path);
+
+void dvr_close(struct dvr *d);
+
+uint64_t dvr_head(const struct dvr *d);
+
+/* Copies up to 'len' bytes from 'pos' up to the head. Returns the number
+ * of bytes copied, or -1 if the data at 'pos' has been overwritten. */
+ssize_t dvr_read(const struct dvr *d, uint64_t pos, void *buf, size_t len);
+
+/* Copies the latest PAT and PMT. Returns zero if there are none yet, or
+ * if the writer keeps them mid-update (it died while changing them). */
+int dvr_psi(const struct dvr *d, unsigned char *pat, unsigned char *pmt);
+
+/* Looks up the newest random access point with a 'key' value at or
+ * before 'value', or with 'after' set the oldest one at or past it.
+ * Returns zero if there is no such entry still in the buffer. */
+int dvr_find(const struct dvr *d, int key, int64_t value, int after, struct dvr_index *e);
+
+#endif
@@ -0,0 +1,501 @@
+/* BlackMagic Design tools - device emulator
+ *
+ * The encoder state follows the requests: START_ENCODING goes through
+ * "Preparing for Encode" to "Encoding" after EMU_START_US, and data is
+ * due from then on at the configured rate, STOP_ENCODING back to
+ * "Idle" through "Preparing for Stop". The one timerfd is armed for the
+ * earliest of the next status change, a message or cancellation to
+ * deliver and the time the oldest stream transfer is full.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include "blackmagic.h"
+#include "mpegts.h"
+#include "fx2emu.h"
+
+#define EMU_REG_USED		0x80000000
+#define EMU_INPUT_MODE		0x83		/* 1080p25 */
+#define EMU_START_US		100000
+#define EMU_STOP_US		20000
+#define EMU_FIFO		(1024*1024)	/* data held while no transfer is pending */
+
+/* Synthetic stream: PIDs as the encoder is programmed by bmd-streamer,
+ * a frame of EMU_FPS every frame_pkts packets starting with a PCR, an
+ * IDR every EMU_GOP frames with B and P frames alternating between */
+#define EMU_FPS			25
+#define EMU_GOP			25
+#define EMU_PSI_FRAMES		5
+#define EMU_PTS_DELAY		27000		/* 90 kHz, ahead of the PCR */
+#define EMU_PID_PMT		0x0100
+#define EMU_PID_PCR		0x1001
+#define EMU_PID_VIDEO		0x1011
+#define EMU_PID_AUDIO		0x1100
+
+enum { EMU_CC_PAT, EMU_CC_PMT, EMU_CC_VIDEO, EMU_CC_AUDIO };
+
+static int64_t emu_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void emu_psi(unsigned char *p, int pid, const unsigned char *sec, int len)
+{
+	uint32_t crc;
+
+	memset(p, 0xff, TS_PACKET_SIZE);
+	p[0] = TS_SYNC_BYTE;
+	p[1] = 0x40 | (pid >> 8);
+	p[2] = pid;
+	p[3] = 0x10;
+	p[4] = 0;
+	memcpy(&p[5], sec, len);
+	crc = ts_crc32(sec, len);
+	p[5 + len] = crc >> 24;
+	p[6 + len] = crc >> 16;
+	p[7 + len] = crc >> 8;
+	p[8 + len] = crc;
+}
+
+static void emu_put_pts(unsigned char *q, uint64_t pts)
+{
+	q[0] = 0x21 | ((pts >> 29) & 0x0e);
+	q[1] = pts >> 22;
+	q[2] = (pts >> 14) | 1;
+	q[3] = pts >> 7;
+	q[4] = (pts << 1) | 1;
+}
+
+static void emu_packet(struct fx2emu *e, unsigned char *p)
+{
+	static const unsigned char pes[] = { 0x00, 0x00, 0x01, 0xe0, 0x00, 0x00, 0x80, 0x80, 0x05 };
+	unsigned int n = e->pkt % e->frame_pkts, f = e->pkt / e->frame_pkts;
+	uint64_t pcr, pts;
+	int pid, cc;
+
+	/* Stream time of the packet, and of the frame for the PTS */
+	pcr = (e->pkt * TS_PACKET_SIZE * 8 * 27000 / e->kbps) % TS_PCR_WRAP;
+	pts = ((e->pkt - n) * TS_PACKET_SIZE * 8 * 90 / e->kbps + EMU_PTS_DELAY) & ((1ULL << 33) - 1);
+	e->pkt++;
+
+	if (n == 0) {
+		memset(p, 0xff, TS_PACKET_SIZE);
+		p[0] = TS_SYNC_BYTE;
+		p[1] = EMU_PID_PCR >> 8;
+		p[2] = EMU_PID_PCR & 0xff;
+		p[3] = 0x20;
+		p[4] = TS_PACKET_SIZE - 5;
+		p[5] = 0x10;
+		p[6] = pcr / 300 >> 25;
+		p[7] = pcr / 300 >> 17;
+		p[8] = pcr / 300 >> 9;
+		p[9] = pcr / 300 >> 1;
+		p[10] = (pcr / 300 & 1) << 7 | 0x7e | (pcr % 300) >> 8;
+		p[11] = pcr % 300;
+		return;
+	}
+	if ((n == 1 || n == 2) && f % EMU_PSI_FRAMES == 0) {
+		cc = n == 1 ? EMU_CC_PAT : EMU_CC_PMT;
+		memcpy(p, n == 1 ? e->pat : e->pmt, TS_PACKET_SIZE);
+		p[3] |= e->cc[cc]++ & 15;
+		return;
+	}
+
+	pid = n == 3 ? EMU_PID_AUDIO : EMU_PID_VIDEO;
+	cc = n == 3 ? EMU_CC_AUDIO : EMU_CC_VIDEO;
+	p[0] = TS_SYNC_BYTE;
+	p[1] = pid >> 8;
+	p[2] = pid & 0xff;
+	p[3] = 0x10 | (e->cc[cc]++ & 15);
+	memset(&p[4], e->pkt, TS_PACKET_SIZE - 4);
+	if (n != 3 && n != 4)
+		return;
+
+	/* PES start: audio, or video with an access unit delimiter and
+	 * the first NAL unit of the picture */
+	p[1] |= 0x40;
+	memcpy(&p[4], pes, sizeof(pes));
+	emu_put_pts(&p[13], pts);
+	if (n == 3) {
+		p[7] = 0xc0;
+		return;
+	}
+	memcpy(&p[18], "\x00\x00\x00\x01\x09\xf0\x00\x00\x00\x01", 10);
+	p[28] = f % EMU_GOP == 0 ? 0x67 : f % 2 ? 0x01 : 0x41;
+}
+
+static void emu_fill(struct fx2emu *e, unsigned char *buf, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		if (e->file) {
+			n = e->file_end - e->file_pos;
+			if (n > len)
+				n = len;
+			memcpy(buf, &e->file[e->file_pos], n);
+			e->file_pos += n;
+			if (e->file_pos == e->file_end)
+				e->file_pos = e->file_start;
+		} else {
+			if (e->cur_off == TS_PACKET_SIZE) {
+				emu_packet(e, e->cur);
+				e->cur_off = 0;
+			}
+			n = TS_PACKET_SIZE - e->cur_off;
+			if (n > len)
+				n = len;
+			memcpy(buf, &e->cur[e->cur_off], n);
+			e->cur_off += n;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void emu_message(struct fx2emu *e, const unsigned char *msg, int len)
+{
+	if (e->msg_len + 1 + len > sizeof(e->msg))
+		return;
+	e->msg[e->msg_len] = len;
+	memcpy(&e->msg[e->msg_len + 1], msg, len);
+	e->msg_len += 1 + len;
+}
+
+static void emu_set_status(struct fx2emu *e, int status)
+{
+	unsigned char msg[6] = { 0x01, 0, 0, 0, 0, status };
+
+	e->status = status;
+	emu_message(e, msg, sizeof(msg));
+	if (status == FX2Status_Encoding) {
+		e->start_us = emu_now_us();
+		e->due = e->sent = 0;
+	}
+}
+
+static void emu_send_mode(struct fx2emu *e)
+{
+	unsigned char msg[2] = { 0x05, e->input_mode };
+
+	emu_message(e, msg, sizeof(msg));
+}
+
+static void emu_change_status(struct fx2emu *e, int now_status, int next_status, int64_t delay_us)
+{
+	emu_set_status(e, now_status);
+	e->next_status = next_status;
+	e->next_status_us = emu_now_us() + delay_us;
+}
+
+static int emu_reg_slot(struct fx2emu *e, uint32_t reg)
+{
+	unsigned int i = (reg * 2654435761u) % EMU_REGS, n;
+
+	for (n = 0; n < EMU_REGS; n++, i = (i + 1) % EMU_REGS)
+		if (e->reg[i] == (reg | EMU_REG_USED) || e->reg[i] == 0)
+			return i;
+	return -1;
+}
+
+static uint16_t emu_reg_get(struct fx2emu *e, uint32_t reg)
+{
+	int i = emu_reg_slot(e, reg);
+
+	return i >= 0 && e->reg[i] ? e->value[i] : 0;
+}
+
+static void emu_reg_set(struct fx2emu *e, uint32_t reg, uint16_t value)
+{
+	int i = emu_reg_slot(e, reg);
+
+	if (i < 0)
+		return;
+	e->reg[i] = reg | EMU_REG_USED;
+	e->value[i] = value;
+}
+
+/* Arms the timer for the next thing to do. Something due now is armed
+ * at an absolute time in the past, which expires at once. */
+static void emu_schedule(struct fx2emu *e)
+{
+	struct itimerspec it = { { 0, 0 }, { 0, 0 } };
+	struct libusb_transfer *t;
+	int64_t when = -1, w;
+	int i, data = 0;
+
+	if (e->next_status >= 0)
+		when = e->next_status_us;
+	for (i = 0; i < e->queued; i++) {
+		t = e->queue[i].transfer;
+		w = -1;
+		if (e->queue[i].cancelled || t->type == LIBUSB_TRANSFER_TYPE_CONTROL ||
+		    (t->endpoint == 0x88 && e->msg_len))
+			w = 1;
+		else if (t->endpoint == 0x86 && e->status == FX2Status_Encoding && !data++)
+			w = e->start_us + (int64_t) ((e->sent + t->length) * 8000 / e->kbps);
+		if (w >= 0 && (when < 0 || w < when))
+			when = w;
+	}
+	if (when == e->armed_us)
+		return;
+	e->armed_us = when;
+	if (when >= 0) {
+		it.it_value.tv_sec = when / 1000000;
+		it.it_value.tv_nsec = when % 1000000 * 1000;
+	}
+	timerfd_settime(e->fd, TFD_TIMER_ABSTIME, &it, NULL);
+}
+
+int emu_open(struct fx2emu *e, const char *file, unsigned int kbps)
+{
+	static const unsigned char pat[] = {
+		0x00, 0xb0, 13, 0x00, 0x01, 0xc1, 0x00, 0x00,
+		0x00, 0x01, 0xe0 | (EMU_PID_PMT >> 8), EMU_PID_PMT & 0xff,
+	};
+	static const unsigned char pmt[] = {
+		0x02, 0xb0, 23, 0x00, 0x01, 0xc1, 0x00, 0x00,
+		0xe0 | (EMU_PID_PCR >> 8), EMU_PID_PCR & 0xff, 0xf0, 0x00,
+		0x1b, 0xe0 | (EMU_PID_VIDEO >> 8), EMU_PID_VIDEO & 0xff, 0xf0, 0x00,
+		0x0f, 0xe0 | (EMU_PID_AUDIO >> 8), EMU_PID_AUDIO & 0xff, 0xf0, 0x00,
+	};
+	struct stat st;
+	size_t i;
+	int fd, err;
+
+	memset(e, 0, sizeof(*e));
+	e->status = FX2Status_Idle;
+	e->next_status = -1;
+	e->armed_us = -1;
+	e->input_mode = EMU_INPUT_MODE;
+	e->kbps = kbps ?: 1;
+	e->frame_pkts = (uint64_t) e->kbps * 1000 / 8 / TS_PACKET_SIZE / EMU_FPS;
+	if (e->frame_pkts < 8)
+		e->frame_pkts = 8;
+	e->cur_off = TS_PACKET_SIZE;
+	emu_psi(e->pat, 0, pat, sizeof(pat));
+	emu_psi(e->pmt, EMU_PID_PMT, pmt, sizeof(pmt));
+
+	if (file) {
+		fd = open(file, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return 0;
+		if (fstat(fd, &st) < 0) {
+			err = errno;
+			close(fd);
+			errno = err;
+			return 0;
+		}
+		e->file_map = st.st_size;
+		e->file = mmap(NULL, e->file_map, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (e->file == MAP_FAILED) {
+			e->file = NULL;
+			return 0;
+		}
+		/* Whole packets from the first sync */
+		for (i = 0; i + TS_PACKET_SIZE < e->file_map; i++)
+			if (e->file[i] == TS_SYNC_BYTE && e->file[i + TS_PACKET_SIZE] == TS_SYNC_BYTE)
+				break;
+		e->file_start = e->file_pos = i;
+		e->file_end = i + (e->file_map - i) / TS_PACKET_SIZE * TS_PACKET_SIZE;
+		if (e->file_end == e->file_start) {
+			emu_close(e);
+			errno = EINVAL;
+			return 0;
+		}
+	}
+
+	e->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (e->fd < 0) {
+		err = errno;
+		emu_close(e);
+		errno = err;
+		return 0;
+	}
+	return 1;
+}
+
+void emu_close(struct fx2emu *e)
+{
+	if (e->file)
+		munmap(e->file, e->file_map);
+	e->file = NULL;
+	if (e->fd > 0)
+		close(e->fd);
+	e->fd = -1;
+}
+
+/* Answers a vendor request, returning the length transferred or a
+ * libusb error */
+static int emu_control(struct fx2emu *e, uint8_t request_type, uint8_t request, uint16_t value,
+		       uint16_t index, unsigned char *data, uint16_t length)
+{
+	int i, r = length;
+
+	switch (request) {
+	case VR_FUJITSU_READ:
+		if (length < 2)
+			return LIBUSB_ERROR_OVERFLOW;
+		value = emu_reg_get(e, (index << 16) | value);
+		data[0] = value >> 8;
+		data[1] = value;
+		r = 2;
+		break;
+	case VR_FUJITSU_WRITE:
+		if (length < 5)
+			return LIBUSB_ERROR_PIPE;
+		emu_reg_set(e, (data[0] << 16) | (data[1] << 8) | data[2], (data[3] << 8) | data[4]);
+		break;
+	case VX_CSR_WRITE_MEM_BLOCK:
+		for (i = 0; i + 1 < length; i += 2)
+			emu_reg_set(e, ((index << 16) | value) + i, (data[i] << 8) | data[i + 1]);
+		break;
+	case VR_READ_REGISTER:
+		/* A locally administered MAC address, nothing else */
+		if (length)
+			data[0] = (index >> 8) == 0x88 ? 0x02 : 0;
+		break;
+	case VR_SEND_DEVICE_STATUS:
+		emu_set_status(e, e->status);
+		emu_send_mode(e);
+		break;
+	case VR_SET_INPUT_SOURCE:
+		emu_send_mode(e);
+		break;
+	case VR_FUJITSU_START_ENCODING:
+		if (e->status == FX2Status_Idle)
+			emu_change_status(e, FX2Status_PreparingEncode, FX2Status_Encoding, EMU_START_US);
+		if (request_type & LIBUSB_ENDPOINT_IN)
+			memset(data, 0, length);
+		break;
+	case VR_FUJITSU_STOP_ENCODING:
+		if (e->status == FX2Status_Encoding || e->status == FX2Status_PreparingEncode)
+			emu_change_status(e, FX2Status_PreparingStop, FX2Status_Idle, EMU_STOP_US);
+		if (request_type & LIBUSB_ENDPOINT_IN)
+			memset(data, 0, length);
+		break;
+	default:
+		if (request < CYPRESS_VR_FIRMWARE_LOAD || request > VR_SET_AUDIO_DELAY)
+			return LIBUSB_ERROR_PIPE;
+		/* FIFO level, FPGA commands, audio delay, ... */
+		if (request_type & LIBUSB_ENDPOINT_IN)
+			memset(data, 0, length);
+		break;
+	}
+	return r;
+}
+
+int emu_submit(struct fx2emu *e, struct libusb_transfer *t)
+{
+	if (t->type != LIBUSB_TRANSFER_TYPE_CONTROL && t->endpoint != 0x86 && t->endpoint != 0x88)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	if (e->queued >= EMU_QUEUE)
+		return LIBUSB_ERROR_BUSY;
+	t->actual_length = 0;
+	e->queue[e->queued].transfer = t;
+	e->queue[e->queued].cancelled = 0;
+	e->queued++;
+	emu_schedule(e);
+	return LIBUSB_SUCCESS;
+}
+
+int emu_cancel(struct fx2emu *e, struct libusb_transfer *t)
+{
+	int i;
+
+	for (i = 0; i < e->queued; i++) {
+		if (e->queue[i].transfer != t || e->queue[i].cancelled)
+			continue;
+		e->queue[i].cancelled = 1;
+		emu_schedule(e);
+		return LIBUSB_SUCCESS;
+	}
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+/* Takes the transfer off the queue before calling back, which may
+ * submit it again */
+static void emu_complete(struct fx2emu *e, int i, enum libusb_transfer_status status)
+{
+	struct libusb_transfer *t = e->queue[i].transfer;
+
+	memmove(&e->queue[i], &e->queue[i + 1], (e->queued - i - 1) * sizeof(e->queue[0]));
+	e->queued--;
+	t->status = status;
+	t->callback(t);
+}
+
+void emu_process(struct fx2emu *e)
+{
+	struct libusb_control_setup *setup;
+	struct libusb_transfer *t;
+	uint64_t expirations;
+	int64_t now;
+	int i, len, r, data = 0;
+
+	if (read(e->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		return;
+	e->armed_us = -1;
+	now = emu_now_us();
+
+	if (e->next_status >= 0 && now >= e->next_status_us) {
+		emu_set_status(e, e->next_status);
+		e->next_status = -1;
+	}
+	if (e->status == FX2Status_Encoding && now > e->start_us) {
+		e->due = (uint64_t) (now - e->start_us) * e->kbps / 8000;
+		if (e->due - e->sent > EMU_FIFO) {
+			e->overflow += e->due - e->sent - EMU_FIFO;
+			e->sent = e->due - EMU_FIFO;
+		}
+	}
+
+	for (i = 0; i < e->queued; ) {
+		t = e->queue[i].transfer;
+		if (e->queue[i].cancelled) {
+			emu_complete(e, i, LIBUSB_TRANSFER_CANCELLED);
+		} else if (t->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+			setup = libusb_control_transfer_get_setup(t);
+			r = emu_control(e, setup->bmRequestType, setup->bRequest,
+					libusb_le16_to_cpu(setup->wValue), libusb_le16_to_cpu(setup->wIndex),
+					libusb_control_transfer_get_data(t), libusb_le16_to_cpu(setup->wLength));
+			t->actual_length = r < 0 ? 0 : r;
+			emu_complete(e, i, r == LIBUSB_ERROR_OVERFLOW ? LIBUSB_TRANSFER_OVERFLOW :
+					   r < 0 ? LIBUSB_TRANSFER_STALL : LIBUSB_TRANSFER_COMPLETED);
+		} else if (t->endpoint == 0x88 && e->msg_len) {
+			/* Length, the messages and a terminating zero */
+			len = e->msg_len + 3 <= t->length ? e->msg_len : t->length - 3;
+			t->buffer[0] = len + 3;
+			t->buffer[1] = (len + 3) >> 8;
+			memcpy(&t->buffer[2], e->msg, len);
+			t->buffer[2 + len] = 0;
+			t->actual_length = len + 3;
+			e->msg_len = 0;
+			emu_complete(e, i, LIBUSB_TRANSFER_COMPLETED);
+		} else if (t->endpoint == 0x86 && e->status == FX2Status_Encoding && !data &&
+			   e->due - e->sent >= t->length) {
+			emu_fill(e, t->buffer, t->length);
+			e->sent += t->length;
+			t->actual_length = t->length;
+			emu_complete(e, i, LIBUSB_TRANSFER_COMPLETED);
+		} else {
+			/* Stream data goes to the oldest transfer first */
+			if (t->endpoint == 0x86)
+				data = 1;
+			i++;
+		}
+	}
+	emu_schedule(e);
+}
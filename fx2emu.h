@@ -0,0 +1,80 @@
+/* BlackMagic Design tools - device emulator
+ *
+ * Software stand-in for the FX2 USB controller and the MB86H56 encoder
+ * behind it, so that bmd-streamer can run without hardware. Vendor
+ * requests are answered from a register file, status (0x01) and input
+ * mode (0x05) messages are sent on endpoint 0x88, and while encoding a
+ * transport stream goes out on endpoint 0x86 at a fixed rate: a
+ * recorded file, looped, or a synthetic stream of 1080p25 H.264 and
+ * audio PES with PAT, PMT and PCR.
+ *
+ * Transfers are libusb_transfer structures as with a real device, vendor
+ * requests included. They complete from emu_process(), to be called
+ * when 'fd' is readable; the other calls never call back. Transfers
+ * never time out.
+ */
+
+#ifndef FX2EMU_H
+#define FX2EMU_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <libusb.h>
+
+#define EMU_QUEUE		64	/* transfers submitted at once */
+#define EMU_REGS		1024	/* encoder registers kept */
+#define EMU_MESSAGES		64	/* bytes of messages queued */
+
+struct emu_transfer {
+	struct libusb_transfer *transfer;
+	int		cancelled;
+};
+
+struct fx2emu {
+	int		fd;		/* timerfd */
+	int		status;		/* FX2Status_* */
+	int		next_status;	/* pending at 'next_status_us', or -1 */
+	int64_t		next_status_us;
+	int64_t		armed_us;
+	uint8_t		input_mode;
+	unsigned int	kbps;
+
+	struct emu_transfer queue[EMU_QUEUE];
+	int		queued;
+	unsigned char	msg[EMU_MESSAGES];
+	int		msg_len;
+
+	uint32_t	reg[EMU_REGS];	/* address | EMU_REG_USED */
+	uint16_t	value[EMU_REGS];
+
+	/* Stream: bytes due since the start of encoding and sent */
+	int64_t		start_us;
+	uint64_t	due, sent;
+	unsigned char	*file;		/* mapped, NULL for synthetic */
+	size_t		file_map, file_start, file_end, file_pos;
+
+	/* Synthetic stream */
+	uint64_t	pkt;
+	unsigned int	frame_pkts;
+	uint8_t		cc[4];
+	unsigned char	pat[188], pmt[188];
+	unsigned char	cur[188];
+	int		cur_off;
+
+	uint64_t	overflow;	/* bytes the encoder could not hand over */
+};
+
+/* Sets up an idle device streaming 'file' (NULL for the synthetic
+ * stream) at 'kbps'. Returns zero with errno set on failure. */
+int emu_open(struct fx2emu *e, const char *file, unsigned int kbps);
+void emu_close(struct fx2emu *e);
+
+/* Same as libusb_submit_transfer() and libusb_cancel_transfer(), for
+ * control transfers as well as those on the stream and message
+ * endpoints */
+int emu_submit(struct fx2emu *e, struct libusb_transfer *t);
+int emu_cancel(struct fx2emu *e, struct libusb_transfer *t);
+
+void emu_process(struct fx2emu *e);
+
+#endif
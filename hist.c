@@ -0,0 +1,48 @@
+/* BlackMagic Design tools - latency histograms */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "hist.h"
+
+void hist_reset(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+/* Largest value that falls into bucket 'i' */
+static uint64_t hist_upper(unsigned int i)
+{
+	unsigned int e = i / HIST_SUB;
+
+	if (e == 0)
+		return i;
+	e += HIST_SUB_BITS - 1;
+	return ((uint64_t) (HIST_SUB + i % HIST_SUB + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+uint64_t hist_quantile(const struct hist *h, double q)
+{
+	uint64_t rank, seen = 0, v;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+	rank = q * h->count;
+	if (rank >= h->count)
+		rank = h->count - 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen > rank)
+			break;
+	}
+	v = hist_upper(i);
+	return v < h->max ? v : h->max;
+}
+
+void hist_format(const struct hist *h, char *buf, size_t size)
+{
+	snprintf(buf, size, "p50 %.2f ms, p99 %.2f ms, p99.9 %.2f ms, max %.2f ms",
+		 hist_quantile(h, 0.5) / 1e3, hist_quantile(h, 0.99) / 1e3,
+		 hist_quantile(h, 0.999) / 1e3, h->max / 1e3);
+}
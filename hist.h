@@ -0,0 +1,57 @@
+/* BlackMagic Design tools - latency histograms
+ *
+ * Fixed size log-linear histograms of microsecond values, in the manner
+ * of HdrHistogram: 32 buckets per power of two, so any value is
+ * recorded to within about 3%, from 1 us up to over an hour. Adding a
+ * value is a few instructions and never allocates.
+ */
+
+#ifndef HIST_H
+#define HIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HIST_SUB_BITS		5
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS		((32 - HIST_SUB_BITS + 1) * HIST_SUB)
+#define HIST_MAX		0xffffffffULL
+
+struct hist {
+	uint64_t	count, sum, max;
+	uint64_t	bucket[HIST_BUCKETS];
+};
+
+static inline unsigned int hist_index(uint64_t v)
+{
+	int e;
+
+	if (v < HIST_SUB)
+		return v;
+	if (v > HIST_MAX)
+		v = HIST_MAX;
+	e = 63 - __builtin_clzll(v);
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static inline void hist_add(struct hist *h, int64_t us)
+{
+	if (us < 0)
+		us = 0;
+	h->count++;
+	h->sum += us;
+	if ((uint64_t) us > h->max)
+		h->max = us;
+	h->bucket[hist_index(us)]++;
+}
+
+void hist_reset(struct hist *h);
+
+/* Value at quantile 'q' (0-1): the upper end of its bucket, at most the
+ * largest value recorded. Zero when empty. */
+uint64_t hist_quantile(const struct hist *h, double q);
+
+/* "p50 X ms, p99 X ms, p99.9 X ms, max X ms" into 'buf' */
+void hist_format(const struct hist *h, char *buf, size_t size);
+
+#endif
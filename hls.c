@@ -0,0 +1,401 @@
+/* BlackMagic Design tools - HLS segmenter
+ *
+ * The segmenter runs on the stream parser's packet runs and only copies
+ * them into the current segment; a segment is cut when a video PES with
+ * a random access point and a PTS at least the target duration past the
+ * segment start arrives. Each segment starts with the latest PAT and PMT.
+ * File system work happens on the writer thread, which the parser only
+ * hands complete segments to. If the writer falls HLS_QUEUE_MAX segments
+ * behind, or a segment could not be held in memory, it is dropped and
+ * a discontinuity is flagged.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpegts.h"
+#include "hls.h"
+
+#define PTS_MASK	((1LL << 33) - 1)
+
+static double hls_since(const struct timespec *t0)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec - t0->tv_sec) + (t.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static void hls_path(struct hls *h, char *buf, size_t size, unsigned int seq, const char *suffix)
+{
+	snprintf(buf, size, "%s/%s-%u.ts%s", h->dir, h->name, seq, suffix);
+}
+
+/* Writes 'len' bytes to 'path' through a temporary file renamed over it */
+static int hls_write_file(const char *path, const void *data, size_t len)
+{
+	char tmp[PATH_MAX];
+	const char *p = data;
+	ssize_t r;
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return 0;
+	while (len) {
+		r = write(fd, p, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		p += r;
+		len -= r;
+	}
+	if (close(fd) < 0 || len || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return 0;
+	}
+	return 1;
+}
+
+static int hls_write_playlist(struct hls *h)
+{
+	char path[PATH_MAX], name[PATH_MAX], *buf;
+	int i, target = ceil(h->target), n = 0, size = 256 + h->win_len * (64 + strlen(h->name));
+	int ok;
+
+	for (i = 0; i < h->win_len; i++)
+		if (lround(h->win_duration[i]) > target)
+			target = lround(h->win_duration[i]);
+
+	buf = malloc(size);
+	if (!buf)
+		return 0;
+	n += snprintf(&buf[n], size - n,
+		"#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:%d\n#EXT-X-MEDIA-SEQUENCE:%u\n"
+		"#EXT-X-DISCONTINUITY-SEQUENCE:%u\n",
+		target, h->win_len ? h->win_seq[0] : 0, h->win_disc_seq);
+	for (i = 0; i < h->win_len; i++) {
+		snprintf(name, sizeof(name), "%s-%u.ts", h->name, h->win_seq[i]);
+		n += snprintf(&buf[n], size - n, "%s#EXTINF:%.3f,\n%s\n",
+			h->win_disc[i] ? "#EXT-X-DISCONTINUITY\n" : "",
+			h->win_duration[i], name);
+	}
+	if (h->ended)
+		n += snprintf(&buf[n], size - n, "#EXT-X-ENDLIST\n");
+
+	snprintf(path, sizeof(path), "%s/%s.m3u8", h->dir, h->name);
+	ok = hls_write_file(path, buf, n);
+	free(buf);
+	return ok;
+}
+
+/* Adds a written segment to the playlist window. The file of the one
+ * falling out is removed a segment later, so that clients that just
+ * loaded the previous playlist can still fetch it. */
+static void hls_window_add(struct hls *h, struct hls_segment *seg)
+{
+	char path[PATH_MAX];
+
+	if (h->win_len == h->window) {
+		if (h->win_have_evicted) {
+			hls_path(h, path, sizeof(path), h->win_evicted, "");
+			unlink(path);
+		}
+		h->win_evicted = h->win_seq[0];
+		h->win_have_evicted = 1;
+		if (h->win_disc[0])
+			h->win_disc_seq++;
+		memmove(&h->win_seq[0], &h->win_seq[1], (h->win_len - 1) * sizeof(h->win_seq[0]));
+		memmove(&h->win_duration[0], &h->win_duration[1], (h->win_len - 1) * sizeof(h->win_duration[0]));
+		memmove(&h->win_disc[0], &h->win_disc[1], (h->win_len - 1) * sizeof(h->win_disc[0]));
+		h->win_len--;
+	}
+	h->win_seq[h->win_len] = seg->seq;
+	h->win_duration[h->win_len] = seg->duration;
+	h->win_disc[h->win_len] = seg->discontinuity;
+	h->win_len++;
+}
+
+static void *hls_writer(void *arg)
+{
+	struct hls *h = arg;
+	struct hls_segment *seg;
+	struct timespec t0;
+	char path[PATH_MAX];
+	int ok, failing = 0;
+
+	pthread_mutex_lock(&h->lock);
+	for (;;) {
+		while (!h->queue && !h->stop)
+			pthread_cond_wait(&h->cond, &h->lock);
+		seg = h->queue;
+		if (!seg)
+			break;
+		h->queue = seg->next;
+		if (!h->queue)
+			h->queue_tail = &h->queue;
+		h->queued--;
+		pthread_mutex_unlock(&h->lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		hls_path(h, path, sizeof(path), seg->seq, "");
+		ok = hls_write_file(path, seg->data, seg->len);
+		if (ok) {
+			hls_window_add(h, seg);
+			ok = hls_write_playlist(h);
+		}
+		if (!ok && !failing && h->log)
+			h->log(LOG_ERR, "hls: writing %s failed: %s", path, strerror(errno));
+		failing = !ok;
+
+		pthread_mutex_lock(&h->lock);
+		if (ok) {
+			h->stats.segments++;
+			h->stats.bytes += seg->len;
+			h->stats.media_s += seg->duration;
+		} else {
+			h->stats.errors++;
+		}
+		h->stats.write_s += hls_since(&t0);
+		free(seg->data);
+		free(seg);
+	}
+	if (h->ended && h->win_len)
+		hls_write_playlist(h);
+	pthread_mutex_unlock(&h->lock);
+	return NULL;
+}
+
+/* Lists the segments of the playlist a previous run left again and
+ * carries on after them. The first new segment follows a restart of
+ * the stream and is marked as a discontinuity. */
+static void hls_resume(struct hls *h)
+{
+	struct hls_segment seg;
+	char path[PATH_MAX], line[PATH_MAX];
+	size_t len = strlen(h->name);
+	unsigned int n;
+	int found = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s.m3u8", h->dir, h->name);
+	f = fopen(path, "re");
+	if (!f)
+		return;
+	memset(&seg, 0, sizeof(seg));
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "#EXT-X-DISCONTINUITY-SEQUENCE:%u", &n) == 1) {
+			h->win_disc_seq = n;
+		} else if (strcmp(line, "#EXT-X-DISCONTINUITY\n") == 0) {
+			seg.discontinuity = 1;
+		} else if (sscanf(line, "#EXTINF:%lf,", &seg.duration) == 1) {
+			continue;
+		} else if (strncmp(line, h->name, len) == 0 && line[len] == '-' &&
+			   sscanf(&line[len + 1], "%u.ts", &seg.seq) == 1) {
+			/* the one removed last is a segment behind */
+			if (!found && seg.seq) {
+				h->win_evicted = seg.seq - 1;
+				h->win_have_evicted = 1;
+			}
+			hls_window_add(h, &seg);
+			h->seq = seg.seq + 1;
+			seg.discontinuity = 0;
+			found = 1;
+		}
+	}
+	fclose(f);
+	if (!found)
+		return;
+	h->discontinuity = 1;
+	if (h->log)
+		h->log(LOG_INFO, "hls: %s continues at segment %u", path, h->seq);
+}
+
+int hls_open(struct hls *h, const char *dir, const char *name, double target, int window,
+	     int pmt_pid, int video_pid, void (*log)(int prio, const char *fmt, ...))
+{
+	memset(h, 0, sizeof(*h));
+	h->dir = strdup(dir);
+	h->name = strdup(name);
+	h->target = target > 0 ? target : 6;
+	h->window = window < 1 ? 1 : window > HLS_WINDOW_MAX ? HLS_WINDOW_MAX : window;
+	h->pmt_pid = pmt_pid;
+	h->video_pid = video_pid;
+	h->log = log;
+	h->queue_tail = &h->queue;
+	pthread_mutex_init(&h->lock, NULL);
+	pthread_cond_init(&h->cond, NULL);
+	if (h->dir && h->name)
+		hls_resume(h);
+	if (!h->dir || !h->name || (errno = pthread_create(&h->thread, NULL, hls_writer, h)) != 0) {
+		free(h->dir);
+		free(h->name);
+		h->dir = h->name = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+static void hls_queue(struct hls *h, struct hls_segment *seg)
+{
+	pthread_mutex_lock(&h->lock);
+	if (seg->failed || h->queued >= HLS_QUEUE_MAX) {
+		h->stats.dropped++;
+		h->discontinuity = 1;
+		free(seg->data);
+		free(seg);
+	} else {
+		seg->next = NULL;
+		*h->queue_tail = seg;
+		h->queue_tail = &seg->next;
+		h->queued++;
+		pthread_cond_signal(&h->cond);
+	}
+	pthread_mutex_unlock(&h->lock);
+}
+
+static void hls_end_segment(struct hls *h, int64_t pts)
+{
+	struct hls_segment *seg = h->cur;
+
+	if (!seg)
+		return;
+	h->cur = NULL;
+	seg->duration = ((pts - h->start_pts) & PTS_MASK) / 90000.0;
+	hls_queue(h, seg);
+}
+
+static int hls_append(struct hls_segment *seg, const void *data, size_t len)
+{
+	unsigned char *p;
+	size_t size;
+
+	if (seg->failed)
+		return 0;
+	if (seg->len + len > seg->size) {
+		for (size = seg->size ?: 1 << 20; size < seg->len + len; size *= 2);
+		p = realloc(seg->data, size);
+		if (!p) {
+			seg->failed = 1;
+			return 0;
+		}
+		seg->data = p;
+		seg->size = size;
+	}
+	memcpy(&seg->data[seg->len], data, len);
+	seg->len += len;
+	return 1;
+}
+
+static void hls_start_segment(struct hls *h, int64_t pts, size_t size_hint)
+{
+	struct hls_segment *seg;
+
+	seg = calloc(1, sizeof(*seg));
+	if (!seg) {
+		/* the stream up to the next random access point is lost */
+		h->discontinuity = 1;
+		return;
+	}
+	seg->seq = h->seq++;
+	seg->discontinuity = h->discontinuity;
+	seg->data = size_hint ? malloc(size_hint) : NULL;
+	seg->size = seg->data ? size_hint : 0;
+	h->discontinuity = 0;
+	if (h->have_pat)
+		hls_append(seg, h->pat, TS_PACKET_SIZE);
+	if (h->have_pmt)
+		hls_append(seg, h->pmt, TS_PACKET_SIZE);
+	h->cur = seg;
+	h->start_pts = h->last_pts = pts;
+}
+
+void hls_write(struct hls *h, const struct iovec *iov, int ioc)
+{
+	const unsigned char *p, *end, *run;
+	struct timespec t0;
+	size_t hint;
+	int64_t pts;
+	int i, pid;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < ioc; i++) {
+		run = p = iov[i].iov_base;
+		end = p + iov[i].iov_len;
+		for (; p < end; p += TS_PACKET_SIZE) {
+			if (!(p[1] & 0x40))
+				continue;
+			pid = ((p[1] & 0x1f) << 8) | p[2];
+			if (pid == 0) {
+				memcpy(h->pat, p, TS_PACKET_SIZE);
+				h->have_pat = 1;
+				continue;
+			}
+			if (pid == h->pmt_pid) {
+				memcpy(h->pmt, p, TS_PACKET_SIZE);
+				h->have_pmt = 1;
+				continue;
+			}
+			if (pid != h->video_pid || (pts = ts_pes_pts(p)) < 0)
+				continue;
+			if (ts_random_access(p) &&
+			    (!h->cur || ((pts - h->start_pts) & PTS_MASK) >= h->target * 90000)) {
+				hint = 0;
+				if (h->cur) {
+					hls_append(h->cur, run, p - run);
+					hint = h->cur->size;
+				}
+				hls_end_segment(h, pts);
+				hls_start_segment(h, pts, hint);
+				run = p;
+			}
+			h->last_pts = pts;
+		}
+		if (h->cur)
+			hls_append(h->cur, run, end - run);
+	}
+	h->stats.cut_s += hls_since(&t0);
+}
+
+void hls_discontinuity(struct hls *h)
+{
+	if (!h->cur && !h->seq)
+		return;
+	hls_end_segment(h, h->last_pts);
+	h->discontinuity = 1;
+}
+
+void hls_close(struct hls *h)
+{
+	if (!h->dir)
+		return;
+	hls_end_segment(h, h->last_pts);
+	pthread_mutex_lock(&h->lock);
+	h->stop = h->ended = 1;
+	pthread_cond_signal(&h->cond);
+	pthread_mutex_unlock(&h->lock);
+	pthread_join(h->thread, NULL);
+	pthread_mutex_destroy(&h->lock);
+	pthread_cond_destroy(&h->cond);
+	free(h->dir);
+	free(h->name);
+	h->dir = h->name = NULL;
+}
+
+void hls_get_stats(struct hls *h, struct hls_stats *st)
+{
+	pthread_mutex_lock(&h->lock);
+	*st = h->stats;
+	pthread_mutex_unlock(&h->lock);
+}
@@ -0,0 +1,88 @@
+/* BlackMagic Design tools - HLS segmenter
+ *
+ * Cuts the transport stream into .ts segments at H.264 random access
+ * points once the target duration is reached, and keeps a rolling
+ * .m3u8 playlist of the latest ones. Segments are collected in memory
+ * and written by a thread of their own, each file under a temporary
+ * name first and renamed into place. A playlist left by a previous run
+ * is picked up, so that segment numbers carry on across restarts.
+ */
+
+#ifndef HLS_H
+#define HLS_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define HLS_QUEUE_MAX		4	/* segments waiting to be written */
+#define HLS_WINDOW_MAX		32
+
+struct hls_segment {
+	struct hls_segment *next;
+	unsigned int	seq;
+	int		discontinuity;
+	int		failed;		/* out of memory, incomplete */
+	double		duration;
+	size_t		len, size;
+	unsigned char	*data;
+};
+
+struct hls_stats {
+	uint64_t	segments, bytes;
+	uint64_t	dropped, errors;
+	double		cut_s, write_s;		/* time spent segmenting and writing */
+	double		media_s;		/* stream time segmented */
+};
+
+struct hls {
+	char		*dir, *name;
+	double		target;
+	int		window;
+	int		video_pid, pmt_pid;
+	void		(*log)(int prio, const char *fmt, ...);
+
+	/* segmenter, called from the stream parser */
+	struct hls_segment *cur;
+	int64_t		start_pts, last_pts;
+	unsigned int	seq;
+	int		discontinuity;
+	unsigned char	pat[0xbc], pmt[0xbc];
+	int		have_pat, have_pmt;
+
+	/* writer thread */
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	struct hls_segment *queue, **queue_tail;
+	int		queued, stop, ended;
+	unsigned int	win_seq[HLS_WINDOW_MAX];
+	double		win_duration[HLS_WINDOW_MAX];
+	int		win_disc[HLS_WINDOW_MAX];
+	int		win_len;
+	unsigned int	win_evicted;
+	int		win_have_evicted;
+	unsigned int	win_disc_seq;	/* discontinuities fallen out of the window */
+
+	struct hls_stats stats;
+};
+
+/* Files are written as <dir>/<name>.m3u8 and <dir>/<name>-<seq>.ts.
+ * 'window' segments are listed in the playlist, 'target' is the target
+ * duration in seconds. Returns zero with errno set on failure. */
+int hls_open(struct hls *h, const char *dir, const char *name, double target, int window,
+	     int pmt_pid, int video_pid, void (*log)(int prio, const char *fmt, ...));
+
+/* Flushes the last segment, ends the playlist and stops the writer */
+void hls_close(struct hls *h);
+
+void hls_write(struct hls *h, const struct iovec *iov, int ioc);
+
+/* Ends the current segment; the next one starts at the next random
+ * access point and is marked as a discontinuity */
+void hls_discontinuity(struct hls *h);
+
+/* Snapshot of the counters, taken under the writer lock */
+void hls_get_stats(struct hls *h, struct hls_stats *st);
+
+#endif
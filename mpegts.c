@@ -0,0 +1,893 @@
+/* BlackMagic Design tools - MPEG-TS helpers
+ *
+ * The scanner classifies TS_SCAN_BATCH packets at a time: the first four
+ * header bytes of each packet are gathered into one vector and compared
+ * against the sync byte, the null PID and zero fill in parallel. The
+ * resulting bitmasks are turned into iovec runs directly. Lost sync is
+ * searched for a vector at a time as well.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+
+#include "mpegts.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TS_SCAN_X86
+#endif
+
+#define TS_SCAN_BATCH	16
+
+/* Header words are loaded little endian: sync byte in the low byte,
+ * followed by the flags/PID high bits and the PID low bits */
+#define TS_HDR_SYNC_MASK	0x000000ff
+#define TS_HDR_SYNC		TS_SYNC_BYTE
+#define TS_HDR_NULL_MASK	0x00ffffff
+#define TS_HDR_NULL		(TS_SYNC_BYTE | 0x1f00 | 0xff0000)
+
+struct ts_class {
+	uint32_t sync, null, bad;
+};
+
+static inline uint32_t ts_header(const unsigned char *p)
+{
+	uint32_t w;
+	memcpy(&w, p, sizeof(w));
+	return w;
+}
+
+static inline __attribute__((always_inline))
+void ts_classify_word(struct ts_class *c, uint32_t w, int n)
+{
+	if (w == 0)
+		return;
+	if ((w & TS_HDR_SYNC_MASK) != TS_HDR_SYNC) {
+		c->bad |= 1u << n;
+		return;
+	}
+	c->sync |= 1u << n;
+	if ((w & TS_HDR_NULL_MASK) == TS_HDR_NULL)
+		c->null |= 1u << n;
+}
+
+/* Also used for the last packets of a buffer, short of a whole batch */
+static inline __attribute__((always_inline))
+struct ts_class ts_classify_count(const unsigned char *p, int count)
+{
+	struct ts_class c = { 0, 0, 0 };
+	int n;
+
+	for (n = 0; n < count; n++)
+		ts_classify_word(&c, ts_header(&p[n * TS_PACKET_SIZE]), n);
+	return c;
+}
+
+static inline __attribute__((always_inline))
+struct ts_class ts_classify_scalar(const unsigned char *p)
+{
+	return ts_classify_count(p, TS_SCAN_BATCH);
+}
+
+static inline __attribute__((always_inline))
+const unsigned char *ts_find_sync_scalar(const unsigned char *p, const unsigned char *end)
+{
+	p = memchr(p, TS_SYNC_BYTE, end - p);
+	return p ? p : end;
+}
+
+#ifdef TS_SCAN_X86
+static inline __attribute__((always_inline, target("sse2")))
+struct ts_class ts_classify_sse2(const unsigned char *p)
+{
+	const __m128i sync_mask = _mm_set1_epi32(TS_HDR_SYNC_MASK), sync = _mm_set1_epi32(TS_HDR_SYNC);
+	const __m128i null_mask = _mm_set1_epi32(TS_HDR_NULL_MASK), null = _mm_set1_epi32(TS_HDR_NULL);
+	const __m128i zero = _mm_setzero_si128();
+	struct ts_class c = { 0, 0, 0 };
+	__m128i w, is_sync, is_null, is_zero;
+	int n;
+
+	for (n = 0; n < TS_SCAN_BATCH; n += 4, p += 4 * TS_PACKET_SIZE) {
+		w = _mm_setr_epi32(ts_header(&p[0]), ts_header(&p[TS_PACKET_SIZE]),
+				   ts_header(&p[2*TS_PACKET_SIZE]), ts_header(&p[3*TS_PACKET_SIZE]));
+		is_sync = _mm_cmpeq_epi32(_mm_and_si128(w, sync_mask), sync);
+		is_null = _mm_cmpeq_epi32(_mm_and_si128(w, null_mask), null);
+		is_zero = _mm_cmpeq_epi32(w, zero);
+		c.sync |= _mm_movemask_ps(_mm_castsi128_ps(is_sync)) << n;
+		c.null |= _mm_movemask_ps(_mm_castsi128_ps(is_null)) << n;
+		c.bad |= (~_mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(is_sync, is_zero))) & 0xf) << n;
+	}
+	return c;
+}
+
+static inline __attribute__((always_inline, target("sse2")))
+const unsigned char *ts_find_sync_sse2(const unsigned char *p, const unsigned char *end)
+{
+	const __m128i sync = _mm_set1_epi8(TS_SYNC_BYTE);
+	unsigned int m;
+
+	for (; p + 16 <= end; p += 16) {
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), sync));
+		if (m)
+			return p + __builtin_ctz(m);
+	}
+	for (; p < end && *p != TS_SYNC_BYTE; p++)
+		;
+	return p;
+}
+
+static inline __attribute__((always_inline, target("avx2")))
+struct ts_class ts_classify_avx2(const unsigned char *p)
+{
+	const __m256i idx = _mm256_setr_epi32(0, TS_PACKET_SIZE, 2*TS_PACKET_SIZE, 3*TS_PACKET_SIZE,
+					      4*TS_PACKET_SIZE, 5*TS_PACKET_SIZE, 6*TS_PACKET_SIZE, 7*TS_PACKET_SIZE);
+	const __m256i sync_mask = _mm256_set1_epi32(TS_HDR_SYNC_MASK), sync = _mm256_set1_epi32(TS_HDR_SYNC);
+	const __m256i null_mask = _mm256_set1_epi32(TS_HDR_NULL_MASK), null = _mm256_set1_epi32(TS_HDR_NULL);
+	const __m256i zero = _mm256_setzero_si256();
+	struct ts_class c = { 0, 0, 0 };
+	__m256i w, is_sync, is_null, is_zero;
+	int n;
+
+	for (n = 0; n < TS_SCAN_BATCH; n += 8, p += 8 * TS_PACKET_SIZE) {
+		w = _mm256_i32gather_epi32((const int *) p, idx, 1);
+		is_sync = _mm256_cmpeq_epi32(_mm256_and_si256(w, sync_mask), sync);
+		is_null = _mm256_cmpeq_epi32(_mm256_and_si256(w, null_mask), null);
+		is_zero = _mm256_cmpeq_epi32(w, zero);
+		c.sync |= _mm256_movemask_ps(_mm256_castsi256_ps(is_sync)) << n;
+		c.null |= _mm256_movemask_ps(_mm256_castsi256_ps(is_null)) << n;
+		c.bad |= (~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_or_si256(is_sync, is_zero))) & 0xff) << n;
+	}
+	return c;
+}
+
+static inline __attribute__((always_inline, target("avx2")))
+const unsigned char *ts_find_sync_avx2(const unsigned char *p, const unsigned char *end)
+{
+	const __m256i sync = _mm256_set1_epi8(TS_SYNC_BYTE);
+	unsigned int m;
+
+	for (; p + 32 <= end; p += 32) {
+		m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p), sync));
+		if (m)
+			return p + __builtin_ctz(m);
+	}
+	return ts_find_sync_sse2(p, end);
+}
+#endif
+
+static inline int ts_pid(const unsigned char *p)
+{
+	return ((p[1] & 0x1f) << 8) | p[2];
+}
+
+static inline int ts_pid_test(const uint64_t *map, int pid)
+{
+	return (map[pid / 64] >> (pid % 64)) & 1;
+}
+
+static inline void ts_pid_set(uint64_t *map, int pid)
+{
+	map[pid / 64] |= 1ULL << (pid % 64);
+}
+
+static inline __attribute__((always_inline))
+uint32_t ts_filter_mask(const struct ts_filter *f, const unsigned char *p, uint32_t valid)
+{
+	uint32_t m = valid;
+	int b;
+
+	while (m) {
+		b = __builtin_ctz(m);
+		m &= m - 1;
+		if (ts_pid_test(f->drop, ts_pid(&p[b * TS_PACKET_SIZE])))
+			valid &= ~(1u << b);
+	}
+	return valid;
+}
+
+static uint32_t crc32_table[256];
+
+uint32_t ts_crc32(const unsigned char *p, int len)
+{
+	uint32_t crc = 0xffffffff, c;
+	int i, j;
+
+	if (!crc32_table[1]) {
+		for (i = 0; i < 256; i++) {
+			for (c = i << 24, j = 0; j < 8; j++)
+				c = (c << 1) ^ (c & 0x80000000 ? 0x04c11db7 : 0);
+			crc32_table[i] = c;
+		}
+	}
+	while (len--)
+		crc = (crc << 8) ^ crc32_table[(crc >> 24) ^ *p++];
+	return crc;
+}
+
+/* Rewrites the PAT or a PMT in place: PIDs are remapped and PMT
+ * elementary streams that are dropped are removed. Only sections that
+ * start and end within the packet are handled, which is all the encoder
+ * produces. */
+static void ts_psi_rewrite(const struct ts_filter *f, unsigned char *p)
+{
+	unsigned char *sec, *end, *e;
+	int off, len, pid, eslen;
+	uint32_t crc;
+
+	if (!(p[1] & 0x40) || !(p[3] & 0x10))
+		return;
+	off = 4;
+	if (p[3] & 0x20)
+		off += 1 + p[4];
+	if (off >= TS_PACKET_SIZE)
+		return;
+	off += 1 + p[off];
+	if (off + 3 > TS_PACKET_SIZE)
+		return;
+	sec = &p[off];
+	len = ((sec[1] & 0x0f) << 8) | sec[2];
+	if (off + 3 + len > TS_PACKET_SIZE || len < 9)
+		return;
+	end = &sec[3 + len - 4];
+
+	switch (sec[0]) {
+	case 0x00:
+		for (e = &sec[8]; e + 4 <= end; e += 4) {
+			pid = ((e[2] & 0x1f) << 8) | e[3];
+			pid = f->remap[pid];
+			e[2] = (e[2] & 0xe0) | (pid >> 8);
+			e[3] = pid;
+		}
+		break;
+	case 0x02:
+		if (len < 13)
+			return;
+		pid = f->remap[((sec[8] & 0x1f) << 8) | sec[9]];
+		sec[8] = (sec[8] & 0xe0) | (pid >> 8);
+		sec[9] = pid;
+		e = &sec[12 + (((sec[10] & 0x0f) << 8) | sec[11])];
+		while (e + 5 <= end) {
+			pid = ((e[1] & 0x1f) << 8) | e[2];
+			eslen = 5 + (((e[3] & 0x0f) << 8) | e[4]);
+			if (e + eslen > end)
+				return;
+			if (ts_pid_test(f->drop, pid)) {
+				memmove(e, e + eslen, end + 4 - (e + eslen));
+				end -= eslen;
+				len -= eslen;
+				continue;
+			}
+			pid = f->remap[pid];
+			e[1] = (e[1] & 0xe0) | (pid >> 8);
+			e[2] = pid;
+			e += eslen;
+		}
+		sec[1] = (sec[1] & 0xf0) | (len >> 8);
+		sec[2] = len;
+		break;
+	default:
+		return;
+	}
+
+	crc = ts_crc32(sec, end - sec);
+	end[0] = crc >> 24;
+	end[1] = crc >> 16;
+	end[2] = crc >> 8;
+	end[3] = crc;
+	memset(end + 4, 0xff, &p[TS_PACKET_SIZE] - (end + 4));
+}
+
+static void ts_filter_rewrite(const struct ts_filter *f, unsigned char *p, int n)
+{
+	int pid;
+
+	for (; n; n--, p += TS_PACKET_SIZE) {
+		pid = ts_pid(p);
+		if (ts_pid_test(f->psi, pid))
+			ts_psi_rewrite(f, p);
+		if (f->remap[pid] != pid) {
+			p[1] = (p[1] & 0xe0) | (f->remap[pid] >> 8);
+			p[2] = f->remap[pid];
+		}
+	}
+}
+
+void ts_filter_init(struct ts_filter *f)
+{
+	int i;
+
+	memset(f, 0, sizeof(*f));
+	for (i = 0; i < TS_PID_MAX; i++)
+		f->remap[i] = i;
+	ts_pid_set(f->psi, 0);
+}
+
+void ts_filter_drop(struct ts_filter *f, int pid)
+{
+	ts_pid_set(f->drop, pid & TS_NULL_PID);
+	f->active = 1;
+	f->rewrite = 1;
+}
+
+void ts_filter_remap(struct ts_filter *f, int pid, int new_pid)
+{
+	f->remap[pid & TS_NULL_PID] = new_pid & TS_NULL_PID;
+	f->rewrite = 1;
+}
+
+void ts_filter_pmt(struct ts_filter *f, int pid)
+{
+	ts_pid_set(f->psi, pid & TS_NULL_PID);
+}
+
+int64_t ts_pcr(const unsigned char *h)
+{
+	if (!(h[3] & 0x20) || h[4] < 7 || !(h[5] & 0x10))
+		return -1;
+	return ((uint64_t) h[6] << 25 | h[7] << 17 | h[8] << 9 | h[9] << 1 | h[10] >> 7) * 300 +
+	       ((h[10] & 1) << 8 | h[11]);
+}
+
+int ts_set_discontinuity(unsigned char *h)
+{
+	if (!(h[3] & 0x20) || h[4] == 0)
+		return 0;
+	h[5] |= 0x80;
+	return 1;
+}
+
+void ts_discontinuity_packet(unsigned char *p, const unsigned char *next)
+{
+	p[0] = TS_SYNC_BYTE;
+	p[1] = next[1] & 0x1f;
+	p[2] = next[2];
+	p[3] = (next[3] & 0xc0) | 0x20 | ((next[3] - 1) & 0x0f);
+	p[4] = TS_PACKET_SIZE - 5;
+	p[5] = 0x80;
+	memset(&p[6], 0xff, TS_PACKET_SIZE - 6);
+}
+
+static void ts_pcr_update(struct ts_stats *st, const unsigned char *h, uint64_t packet)
+{
+	struct ts_pcr_stats *p = &st->pcr;
+	uint64_t pcr, delta;
+	int64_t offset;
+
+	if ((offset = ts_pcr(h)) < 0)
+		return;
+
+	pcr = offset;
+	delta = (pcr + TS_PCR_WRAP - p->last_pcr) % TS_PCR_WRAP;
+
+	/* Restart on a signalled discontinuity or a jump of over a second */
+	if (!p->valid || (h[5] & 0x80) || delta > TS_PCR_HZ) {
+		if (p->valid)
+			p->discontinuities++;
+		p->valid = 1;
+		p->first_host_us = st->arrival_us;
+		p->elapsed = 0;
+		p->offset_min = INT64_MAX;
+		p->offset_max = INT64_MIN;
+	} else {
+		p->elapsed += delta;
+		p->window += delta;
+		p->window_packets += packet - p->last_packet;
+		p->pcrs++;
+		if (delta > p->interval_max)
+			p->interval_max = delta;
+
+		/* Host time against encoder time since the anchor */
+		offset = st->arrival_us - p->first_host_us - (int64_t) (p->elapsed / 27);
+		if (offset < p->offset_min)
+			p->offset_min = offset;
+		if (offset > p->offset_max)
+			p->offset_max = offset;
+	}
+	p->last_pcr = pcr;
+	p->last_packet = packet;
+	p->last_host_us = st->arrival_us;
+}
+
+int ts_pcr_report(struct ts_pcr_stats *p, struct ts_pcr_report *r)
+{
+	int64_t host;
+
+	memset(r, 0, sizeof(*r));
+	r->discontinuities = p->discontinuities;
+	if (!p->pcrs)
+		return 0;
+
+	r->pcrs = p->pcrs;
+	r->bitrate = p->window_packets * TS_PACKET_SIZE * 8.0 * TS_PCR_HZ / p->window;
+	r->interval_avg_ms = p->window * 1000.0 / TS_PCR_HZ / p->pcrs;
+	r->interval_max_ms = p->interval_max * 1000.0 / TS_PCR_HZ;
+	r->jitter_ms = (p->offset_max - p->offset_min) / 1000.0;
+	host = p->last_host_us - p->first_host_us;
+	r->drift_span_s = host / 1e6;
+	if (p->elapsed)
+		r->drift_ppm = (host * 27.0 / p->elapsed - 1.0) * 1e6;
+
+	p->window = p->window_packets = p->pcrs = 0;
+	p->interval_max = 0;
+	p->offset_min = INT64_MAX;
+	p->offset_max = INT64_MIN;
+	return 1;
+}
+
+void ts_stats_init(struct ts_stats *st, int pcr_pid)
+{
+	memset(st, 0, sizeof(*st));
+	st->pcr.pid = pcr_pid;
+}
+
+void ts_join_init(struct ts_join *j, int pmt_pid, int video_pid, int sit_pid)
+{
+	memset(j, 0, sizeof(*j));
+	j->pmt_pid = pmt_pid;
+	j->video_pid = video_pid;
+	j->sit_pid = sit_pid;
+}
+
+/* Start of the PES header in a packet starting a PES, or NULL */
+static const unsigned char *ts_pes_header(const unsigned char *p)
+{
+	const unsigned char *q = p + 4;
+
+	if (!(p[1] & 0x40) || !(p[3] & 0x10))
+		return NULL;
+	if (p[3] & 0x20)
+		q += 1 + p[4];
+	if (q + 9 > p + TS_PACKET_SIZE || q[0] || q[1] || q[2] != 1)
+		return NULL;
+	return q;
+}
+
+/* Header byte of the first slice or SPS NAL unit in a packet starting a
+ * PES, or -1 */
+static int ts_pes_nal(const unsigned char *p)
+{
+	const unsigned char *q, *end = p + TS_PACKET_SIZE;
+	int nal;
+
+	q = ts_pes_header(p);
+	if (!q)
+		return -1;
+
+	for (q += 9 + q[8]; q + 3 < end; q++) {
+		if (q[0] || q[1] || q[2] != 1)
+			continue;
+		nal = q[3] & 0x1f;
+		if ((nal >= 1 && nal <= 5) || nal == 7)
+			return q[3];
+		q += 3;
+	}
+	return -1;
+}
+
+int ts_random_access(const unsigned char *p)
+{
+	int nal;
+
+	if ((p[1] & 0x40) && (p[3] & 0x30) == 0x30 && p[4] && (p[5] & 0x40))
+		return 1;
+	nal = ts_pes_nal(p);
+	return nal >= 0 && ((nal & 0x1f) == 5 || (nal & 0x1f) == 7);
+}
+
+int ts_disposable(const unsigned char *p)
+{
+	int nal = ts_pes_nal(p);
+
+	/* Non-IDR slice with nal_ref_idc zero */
+	return nal >= 0 && (nal & 0x1f) == 1 && !(nal & 0x60);
+}
+
+static int64_t ts_timestamp(const unsigned char *q)
+{
+	return ((int64_t)(q[0] & 0x0e) << 29) | (q[1] << 22) | ((q[2] & 0xfe) << 14) |
+		(q[3] << 7) | (q[4] >> 1);
+}
+
+int64_t ts_pes_pts(const unsigned char *p)
+{
+	const unsigned char *q = ts_pes_header(p);
+
+	if (!q || !(q[7] & 0x80) || q + 14 > p + TS_PACKET_SIZE)
+		return -1;
+	return ts_timestamp(&q[9]);
+}
+
+void ts_join_update(struct ts_join *j, unsigned int pos, const struct iovec *iov, int ioc)
+{
+	const unsigned char *p, *end;
+	int i, pid;
+
+	for (i = 0; i < ioc; i++) {
+		p = iov[i].iov_base;
+		end = p + iov[i].iov_len;
+		for (; p < end; p += TS_PACKET_SIZE, pos++) {
+			if (!(p[1] & 0x40))
+				continue;
+			pid = ts_pid(p);
+			if (pid == 0) {
+				memcpy(j->pat, p, TS_PACKET_SIZE);
+				j->have_pat = 1;
+			} else if (pid == j->pmt_pid) {
+				memcpy(j->pmt, p, TS_PACKET_SIZE);
+				j->have_pmt = 1;
+			} else if (pid == j->sit_pid) {
+				memcpy(j->sit, p, TS_PACKET_SIZE);
+				j->have_sit = 1;
+			} else if (pid == j->video_pid && ts_random_access(p)) {
+				j->rap = pos;
+				j->have_rap = 1;
+			}
+		}
+	}
+}
+
+#define TS_PTS_WRAP		(1LL << 33)
+
+void ts_rebase_init(struct ts_rebase *rb)
+{
+	memset(rb, 0, sizeof(*rb));
+	rb->step = TS_PCR_HZ / 25;
+}
+
+void ts_rebase_restart(struct ts_rebase *rb)
+{
+	int pid;
+
+	rb->pending = 1;
+	for (pid = 0; pid < TS_PID_MAX; pid++)
+		rb->cc[pid] &= ~TS_REBASE_CC_SYNC;
+}
+
+/* Decode timestamp of the PES starting in the packet, or -1 */
+static int64_t ts_pes_dts(const unsigned char *p)
+{
+	const unsigned char *q = ts_pes_header(p);
+
+	if (!q || !(q[7] & 0x80) || q + ((q[7] & 0x40) ? 19 : 14) > p + TS_PACKET_SIZE)
+		return -1;
+	return ts_timestamp((q[7] & 0x40) ? &q[14] : &q[9]);
+}
+
+/* Puts input clock 'pcr' one PCR interval after the last output PCR */
+static void ts_rebase_set(struct ts_rebase *rb, uint64_t pcr)
+{
+	int64_t off = 0;
+
+	if (rb->have_out) {
+		off = (int64_t) ((rb->last_out + rb->step) % TS_PCR_WRAP) - (int64_t) pcr;
+		off -= off % 300;
+		rb->rebases++;
+	}
+	rb->offset = off;
+	rb->pending = 0;
+	rb->last_in = pcr;
+	rb->have_in = 1;
+}
+
+/* The new input clock after a restart: the first PCR, or else estimated
+ * from the first decode timestamp */
+static int ts_rebase_find(struct ts_rebase *rb, const struct iovec *iov, int ioc, uint64_t *pcr)
+{
+	const unsigned char *p, *end;
+	int64_t v, dts = -1;
+	int i;
+
+	for (i = 0; i < ioc; i++) {
+		end = (const unsigned char *) iov[i].iov_base + iov[i].iov_len;
+		for (p = iov[i].iov_base; p < end; p += TS_PACKET_SIZE) {
+			if ((v = ts_pcr(p)) >= 0) {
+				*pcr = v;
+				return 1;
+			}
+			if (dts < 0)
+				dts = ts_pes_dts(p);
+		}
+	}
+	if (dts < 0)
+		return 0;
+	*pcr = ((dts * 300 - rb->delay) % (int64_t) TS_PCR_WRAP + TS_PCR_WRAP) % TS_PCR_WRAP;
+	return 1;
+}
+
+static void ts_rebase_stamp(unsigned char *q, int64_t off)
+{
+	int64_t t = ((ts_timestamp(q) + off / 300) % TS_PTS_WRAP + TS_PTS_WRAP) % TS_PTS_WRAP;
+
+	q[0] = (q[0] & 0xf1) | ((t >> 29) & 0x0e);
+	q[1] = t >> 22;
+	q[2] = ((t >> 14) & 0xfe) | 1;
+	q[3] = t >> 7;
+	q[4] = (t << 1) | 1;
+}
+
+static uint64_t ts_rebase_pcr(unsigned char *h, uint64_t pcr, int64_t off)
+{
+	uint64_t base, ext;
+
+	pcr = ((int64_t) (pcr % TS_PCR_WRAP) + off % (int64_t) TS_PCR_WRAP + TS_PCR_WRAP) % TS_PCR_WRAP;
+	base = pcr / 300;
+	ext = pcr % 300;
+	h[6] = base >> 25;
+	h[7] = base >> 17;
+	h[8] = base >> 9;
+	h[9] = base >> 1;
+	h[10] = (base & 1) << 7 | 0x7e | ext >> 8;
+	h[11] = ext;
+	return pcr;
+}
+
+/* Counters of each PID carry on from the last output one with the first
+ * packet after a restart */
+static void ts_rebase_cc(struct ts_rebase *rb, unsigned char *h, int pid)
+{
+	uint8_t *cc = &rb->cc[pid];
+	int in = h[3] & 0x0f, out;
+
+	if (!(*cc & TS_REBASE_CC_SYNC)) {
+		out = !(*cc & TS_CC_VALID) ? in : (h[3] & 0x10) ? *cc + 1 : *cc;
+		rb->cc_delta[pid] = (out - in) & 0x0f;
+	}
+	out = (in + rb->cc_delta[pid]) & 0x0f;
+	h[3] = (h[3] & 0xf0) | out;
+	*cc = out | TS_CC_VALID | TS_REBASE_CC_SYNC;
+}
+
+void ts_rebase(struct ts_rebase *rb, const struct iovec *iov, int ioc)
+{
+	unsigned char *p, *end, *q;
+	uint64_t pcr, delta;
+	int64_t v;
+	int i, pid;
+
+	if (rb->pending && ts_rebase_find(rb, iov, ioc, &pcr))
+		ts_rebase_set(rb, pcr);
+
+	for (i = 0; i < ioc; i++) {
+		end = (unsigned char *) iov[i].iov_base + iov[i].iov_len;
+		for (p = iov[i].iov_base; p < end; p += TS_PACKET_SIZE) {
+			pid = ts_pid(p);
+			if (pid == TS_NULL_PID)
+				continue;
+			ts_rebase_cc(rb, p, pid);
+
+			if ((v = ts_pcr(p)) >= 0) {
+				delta = (v + TS_PCR_WRAP - rb->last_in) % TS_PCR_WRAP;
+				if (!rb->pending && rb->have_in && delta > TS_PCR_HZ)
+					ts_rebase_set(rb, v);
+				else if (rb->have_in && delta && delta <= TS_PCR_HZ / 10)
+					rb->step = delta;
+				rb->last_in = v;
+				rb->have_in = 1;
+				if (!rb->pending) {
+					rb->last_out = ts_rebase_pcr(p, v, rb->offset);
+					rb->have_out = 1;
+				}
+			}
+
+			if ((v = ts_pes_dts(p)) < 0)
+				continue;
+			if (rb->have_in)
+				rb->delay = ((v * 300 - (int64_t) rb->last_in) % (int64_t) TS_PCR_WRAP +
+					     TS_PCR_WRAP) % TS_PCR_WRAP;
+			if (rb->pending)
+				continue;
+			q = (unsigned char *) ts_pes_header(p);
+			ts_rebase_stamp(&q[9], rb->offset);
+			if (q[7] & 0x40)
+				ts_rebase_stamp(&q[14], rb->offset);
+		}
+	}
+}
+
+/* Accounts the packets of a batch selected by 'range'. Packets cut off
+ * by an early return are left for the next call to count. */
+static inline __attribute__((always_inline))
+void ts_stats_update(struct ts_stats *st, const unsigned char *p, const struct ts_class *c, uint32_t range)
+{
+	struct ts_pid_stats *ps;
+	const unsigned char *h;
+	uint32_t m = c->sync & ~c->null & range;
+	int b, pid, cc, expected;
+
+	st->null_packets += __builtin_popcount(c->null & range);
+	st->zero_packets += __builtin_popcount(range & ~(c->sync | c->bad));
+
+	while (m) {
+		b = __builtin_ctz(m);
+		m &= m - 1;
+		h = &p[b * TS_PACKET_SIZE];
+		pid = ts_pid(h);
+		ps = &st->pid[pid];
+		ps->packets++;
+		if (pid == st->pcr.pid)
+			ts_pcr_update(st, h, st->packets + __builtin_popcount(c->sync & range & ((1u << b) - 1)));
+		if (h[1] & 0x80) {
+			ps->tei++;
+			st->tei++;
+		}
+
+		/* The counter advances only with payload. A repeated counter
+		 * (duplicate packet) and a signalled discontinuity are fine. */
+		cc = h[3] & 0x0f;
+		if (ps->cc & TS_CC_VALID) {
+			expected = (h[3] & 0x10) ? (ps->cc + 1) & 0x0f : ps->cc & 0x0f;
+			if (cc != expected && cc != (ps->cc & 0x0f) &&
+			    !((h[3] & 0x20) && h[4] && (h[5] & 0x80))) {
+				ps->cc_errors++;
+				st->cc_errors++;
+			}
+		}
+		ps->cc = cc | TS_CC_VALID;
+	}
+	st->packets += __builtin_popcount(c->sync & range);
+}
+
+/* Appends 'n' packets at offset 'off' to the run list. Returns zero if
+ * a new iovec would be needed but all are in use. */
+static inline __attribute__((always_inline))
+int ts_emit(unsigned char *buf, int off, int n, struct iovec *iov, int maxiov, int *ioc)
+{
+	if (*ioc && (const unsigned char *) iov[*ioc-1].iov_base + iov[*ioc-1].iov_len == &buf[off]) {
+		iov[*ioc-1].iov_len += n * TS_PACKET_SIZE;
+		return 1;
+	}
+	if (*ioc >= maxiov)
+		return 0;
+	iov[*ioc].iov_base = (void *) &buf[off];
+	iov[*ioc].iov_len = n * TS_PACKET_SIZE;
+	(*ioc)++;
+	return 1;
+}
+
+static inline __attribute__((always_inline))
+int ts_scan_generic(unsigned char *buf, int len, const struct ts_filter *f, struct ts_stats *st,
+		    struct iovec *iov, int maxiov, int *pos,
+		    struct ts_class (*classify)(const unsigned char *),
+		    const unsigned char *(*find_sync)(const unsigned char *, const unsigned char *))
+{
+	struct ts_class c;
+	uint32_t valid, counted;
+	int i = 0, ioc = 0, n, b, r, next;
+
+	while (i + TS_PACKET_SIZE <= len) {
+		if (i + TS_SCAN_BATCH * TS_PACKET_SIZE <= len) {
+			/* Transfers come in by DMA and are not cached yet: with a
+			 * header per cache line, fetch the next batch meanwhile */
+			for (n = 0; n < TS_SCAN_BATCH; n++)
+				__builtin_prefetch(&buf[i + (TS_SCAN_BATCH + n) * TS_PACKET_SIZE]);
+			c = classify(&buf[i]);
+			n = TS_SCAN_BATCH;
+		} else {
+			n = (len - i) / TS_PACKET_SIZE;
+			c = ts_classify_count(&buf[i], n);
+		}
+
+		/* Only packets up to the first one out of sync are usable */
+		valid = c.sync;
+		if (c.bad) {
+			n = __builtin_ctz(c.bad);
+			valid &= (1u << n) - 1;
+		}
+		if (f) {
+			if (!f->keep_null)
+				valid &= ~c.null;
+			if (f->active)
+				valid = ts_filter_mask(f, &buf[i], valid);
+		} else {
+			valid &= ~c.null;
+		}
+
+		/* Packets are counted under the PID the device sent them
+		 * with, so those of a run are counted before it is rewritten */
+		counted = 0;
+		while (valid) {
+			b = __builtin_ctz(valid);
+			r = __builtin_ctz(~(valid >> b));
+			if (!ts_emit(buf, i + b * TS_PACKET_SIZE, r, iov, maxiov, &ioc)) {
+				if (st)
+					ts_stats_update(st, &buf[i], &c, ((1u << b) - 1) & ~counted);
+				*pos = i + b * TS_PACKET_SIZE;
+				return ioc;
+			}
+			if (f && f->rewrite) {
+				if (st) {
+					ts_stats_update(st, &buf[i], &c, ((1u << (b + r)) - 1) & ~counted);
+					counted = (1u << (b + r)) - 1;
+				}
+				ts_filter_rewrite(f, &buf[i + b * TS_PACKET_SIZE], r);
+			}
+			valid &= ~(((1u << r) - 1) << b);
+		}
+		if (st)
+			ts_stats_update(st, &buf[i], &c, ((1u << n) - 1) & ~counted);
+		i += n * TS_PACKET_SIZE;
+
+		if (c.bad) {
+			next = find_sync(&buf[i + 1], &buf[len]) - buf;
+			if (st) {
+				st->resyncs++;
+				st->resync_bytes += next - i;
+			}
+			i = next;
+		}
+	}
+
+	*pos = i;
+	return ioc;
+}
+
+#define TS_SCAN_ARGS	unsigned char *buf, int len, const struct ts_filter *f, struct ts_stats *st, \
+			struct iovec *iov, int maxiov, int *pos
+
+static int ts_scan_scalar(TS_SCAN_ARGS)
+{
+	return ts_scan_generic(buf, len, f, st, iov, maxiov, pos, ts_classify_scalar, ts_find_sync_scalar);
+}
+
+#ifdef TS_SCAN_X86
+static __attribute__((target("sse2,popcnt")))
+int ts_scan_sse2(TS_SCAN_ARGS)
+{
+	return ts_scan_generic(buf, len, f, st, iov, maxiov, pos, ts_classify_sse2, ts_find_sync_sse2);
+}
+
+static __attribute__((target("avx2,popcnt")))
+int ts_scan_avx2(TS_SCAN_ARGS)
+{
+	return ts_scan_generic(buf, len, f, st, iov, maxiov, pos, ts_classify_avx2, ts_find_sync_avx2);
+}
+#endif
+
+static const struct {
+	const char *name;
+	int (*scan)(TS_SCAN_ARGS);
+} ts_scanners[] = {
+#ifdef TS_SCAN_X86
+	{ "avx2", ts_scan_avx2 },
+	{ "sse2", ts_scan_sse2 },
+#endif
+	{ "scalar", ts_scan_scalar },
+};
+
+static int (*ts_scan_fn)(TS_SCAN_ARGS) = ts_scan_scalar;
+
+static int ts_scanner_supported(const char *name)
+{
+#ifdef TS_SCAN_X86
+	__builtin_cpu_init();
+	/* Both count packets with popcnt as well */
+	if (!__builtin_cpu_supports("popcnt"))
+		return strcmp(name, "scalar") == 0;
+	if (strcmp(name, "avx2") == 0)
+		return __builtin_cpu_supports("avx2");
+	if (strcmp(name, "sse2") == 0)
+		return __builtin_cpu_supports("sse2");
+#endif
+	return 1;
+}
+
+const char *ts_scan_select(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(ts_scanners) / sizeof(ts_scanners[0]); i++) {
+		if (name && strcmp(name, ts_scanners[i].name) != 0)
+			continue;
+		if (!ts_scanner_supported(ts_scanners[i].name))
+			continue;
+		ts_scan_fn = ts_scanners[i].scan;
+		return ts_scanners[i].name;
+	}
+	return NULL;
+}
+
+int ts_scan(TS_SCAN_ARGS)
+{
+	return ts_scan_fn(buf, len, f, st, iov, maxiov, pos);
+}
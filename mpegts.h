@@ -0,0 +1,174 @@
+/* BlackMagic Design tools - MPEG-TS helpers
+ *
+ * Packet scanner used to pick valid transport stream packets out of the
+ * raw bulk data coming from the device.
+ */
+
+#ifndef MPEGTS_H
+#define MPEGTS_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define TS_PACKET_SIZE		0xbc
+#define TS_SYNC_BYTE		0x47
+#define TS_NULL_PID		0x1fff
+#define TS_PID_MAX		0x2000
+#define TS_PCR_HZ		27000000ULL
+#define TS_PCR_WRAP		((1ULL << 33) * 300)
+
+/* PID filter applied by the scanner. Packets of PIDs in 'drop' are
+ * skipped, the others get their PID replaced by remap[pid]. The PAT and
+ * the PMT PIDs in 'psi' are rewritten to match: remapped PIDs are
+ * updated and dropped elementary streams are removed from the PMT. */
+struct ts_filter {
+	uint64_t	drop[TS_PID_MAX / 64];
+	uint64_t	psi[TS_PID_MAX / 64];
+	uint16_t	remap[TS_PID_MAX];
+	int		active, rewrite;
+	int		keep_null;
+};
+
+/* Stream integrity counters kept by the scanner. Continuity counters
+ * and transport error indicators are tracked per PID as the device sent
+ * them, before any filtering or remapping. */
+#define TS_CC_VALID		0x10
+
+struct ts_pid_stats {
+	uint64_t	packets;
+	uint32_t	cc_errors;
+	uint32_t	tei;
+	uint8_t		cc;
+};
+
+/* PCR monitor. PCRs on 'pid' are compared against the packet count
+ * (mux bitrate) and against the host clock at arrival (jitter, drift).
+ * The window fields restart on every ts_pcr_report(), the drift anchor
+ * only on a PCR discontinuity. */
+struct ts_pcr_stats {
+	int		pid;
+	int		valid;
+	uint64_t	last_pcr, last_packet;
+	int64_t		first_host_us, last_host_us;
+	uint64_t	elapsed;
+	uint64_t	discontinuities;
+
+	uint64_t	window, window_packets, pcrs;
+	uint64_t	interval_max;
+	int64_t		offset_min, offset_max;
+};
+
+struct ts_pcr_report {
+	double		bitrate;
+	double		interval_avg_ms, interval_max_ms;
+	double		jitter_ms;
+	double		drift_ppm, drift_span_s;
+	uint64_t	pcrs, discontinuities;
+};
+
+struct ts_stats {
+	uint64_t	packets;
+	uint64_t	resyncs, resync_bytes;
+	uint64_t	zero_packets, null_packets;
+	uint64_t	cc_errors, tei;
+	int64_t		arrival_us;	/* host time of the data being scanned */
+	struct ts_pcr_stats pcr;
+	struct ts_pid_stats pid[TS_PID_MAX];
+};
+
+void ts_stats_init(struct ts_stats *st, int pcr_pid);
+
+/* Join point for consumers starting mid-stream: the latest PAT, PMT and
+ * SIT and the position of the latest H.264 random access point (an SPS
+ * or IDR at the start of a PES, or the random access indicator) on the
+ * video PID. Positions count packets like the stream ring head. */
+struct ts_join {
+	int		pmt_pid, video_pid, sit_pid;
+	int		have_pat, have_pmt, have_sit, have_rap;
+	unsigned int	rap;
+	unsigned char	pat[TS_PACKET_SIZE], pmt[TS_PACKET_SIZE], sit[TS_PACKET_SIZE];
+};
+
+/* Timestamp rebasing. PCRs and the PTS and DTS in PES headers are moved
+ * by an offset that is set anew after ts_rebase_restart() and on jumps
+ * of the input clock, so that the output time line carries on one PCR
+ * interval after the last output PCR. Continuity counters are carried
+ * on as well, so the output needs no discontinuity signalled. The
+ * first stretch keeps its own timestamps. */
+#define TS_REBASE_CC_SYNC	0x20
+
+struct ts_rebase {
+	int		pending, have_in, have_out;
+	int64_t		offset;		/* 27 MHz, whole 90 kHz ticks */
+	uint64_t	last_in, last_out;
+	uint64_t	step;		/* PCR interval */
+	int64_t		delay;		/* decode time ahead of the PCR */
+	uint64_t	rebases;
+	uint8_t		cc[TS_PID_MAX];	/* last output counter, TS_CC_VALID, TS_REBASE_CC_SYNC */
+	uint8_t		cc_delta[TS_PID_MAX];
+};
+
+void ts_rebase_init(struct ts_rebase *rb);
+void ts_rebase_restart(struct ts_rebase *rb);
+
+/* Rewrites the packets in 'iov' in place */
+void ts_rebase(struct ts_rebase *rb, const struct iovec *iov, int ioc);
+
+/* Checks a video packet for an H.264 random access point */
+int ts_random_access(const unsigned char *p);
+
+/* Checks a video packet starting a PES for a picture no other picture
+ * refers to (typically a B-frame), which can be dropped cleanly */
+int ts_disposable(const unsigned char *p);
+
+/* PTS of the PES starting in the packet, or -1 */
+int64_t ts_pes_pts(const unsigned char *p);
+
+/* PCR carried in the adaptation field of the packet, or -1 */
+int64_t ts_pcr(const unsigned char *p);
+
+/* Sets the discontinuity indicator of a packet with an adaptation field.
+ * Returns zero if the packet has none to set it in. */
+int ts_set_discontinuity(unsigned char *p);
+
+/* Fills 'p' with a packet of only an adaptation field flagging a
+ * discontinuity, to go in front of 'next' where that has none to set
+ * it in. It has the PID of 'next' and the counter before, as packets
+ * without payload don't count. */
+void ts_discontinuity_packet(unsigned char *p, const unsigned char *next);
+
+/* CRC of a PSI section, MPEG-2 CRC-32 */
+uint32_t ts_crc32(const unsigned char *p, int len);
+
+void ts_join_init(struct ts_join *j, int pmt_pid, int video_pid, int sit_pid);
+
+/* Looks at the packets in 'iov', the first of which is at 'pos' */
+void ts_join_update(struct ts_join *j, unsigned int pos, const struct iovec *iov, int ioc);
+
+/* Fills 'r' from the PCRs seen since the previous call and starts a new
+ * window. Returns zero if there were none. */
+int ts_pcr_report(struct ts_pcr_stats *p, struct ts_pcr_report *r);
+
+void ts_filter_init(struct ts_filter *f);
+void ts_filter_drop(struct ts_filter *f, int pid);
+void ts_filter_remap(struct ts_filter *f, int pid, int new_pid);
+void ts_filter_pmt(struct ts_filter *f, int pid);
+
+/* Scans 'len' bytes at 'buf' and collects runs of valid packets into
+ * 'iov', merging adjacent packets into a single entry. Packets with an
+ * all zero header and null packets (unless the filter keeps them) are
+ * skipped, lost sync is recovered by searching for the next sync byte.
+ * The optional filter 'f' is applied in the same pass, emitted packets
+ * are modified in place. Counters are updated in 'st' if given.
+ * Returns the number of iovecs filled, *pos is set to the offset where
+ * scanning stopped: either the start of an incomplete trailing packet,
+ * or the next packet to look at if all 'maxiov' entries were used. */
+int ts_scan(unsigned char *buf, int len, const struct ts_filter *f, struct ts_stats *st,
+	    struct iovec *iov, int maxiov, int *pos);
+
+/* Selects the scanner implementation: "scalar", "sse2", "avx2" or NULL
+ * for the best one supported by the CPU. Returns the name of the
+ * selected implementation, or NULL if the requested one is unavailable. */
+const char *ts_scan_select(const char *name);
+
+#endif
@@ -0,0 +1,698 @@
+/* BlackMagic Design tools - disk recorder
+ *
+ * io_uring is driven through the raw system calls: one submission per
+ * rec_write() call at most, and completions are picked up from the main
+ * loop when the ring fd becomes readable. Everything that may wait on
+ * the file system (writes, preallocation, truncation and close) goes
+ * through the ring, and so does opening new files where the kernel has
+ * IORING_OP_OPENAT. Buffers filled while their file is being opened wait
+ * on it, and get their file offset once submitted. Short writes are
+ * resubmitted for the rest. A file is truncated to its length and closed
+ * once its last write has completed; before Linux 6.9, which has no
+ * IORING_OP_FTRUNCATE, the preallocation past its end is released with a
+ * hole punched into it instead.
+ *
+ * With O_DIRECT all writes are whole buffers at buffer aligned offsets,
+ * except the last one of a file or the rest of a short write, for which
+ * O_DIRECT is turned off.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/falloc.h>
+#include <linux/io_uring.h>
+
+#include "mpegts.h"
+#include "record.h"
+
+#ifndef IORING_OP_FTRUNCATE
+#define IORING_OP_FTRUNCATE	55
+#endif
+
+/* Operation in the low bits of user_data, the buffer or file it is for
+ * in the rest */
+enum REC_OP {
+	REC_OP_WRITE = 0,
+	REC_OP_FALLOCATE,
+	REC_OP_FTRUNCATE,
+	REC_OP_CLOSE,
+	REC_OP_OPEN,
+	REC_OP_PUNCH,
+};
+#define REC_OP_MASK	7
+
+static const uint8_t rec_opcodes[] = {
+	[REC_OP_WRITE]		= IORING_OP_WRITE,
+	[REC_OP_FALLOCATE]	= IORING_OP_FALLOCATE,
+	[REC_OP_FTRUNCATE]	= IORING_OP_FTRUNCATE,
+	[REC_OP_CLOSE]		= IORING_OP_CLOSE,
+	[REC_OP_OPEN]		= IORING_OP_OPENAT,
+	[REC_OP_PUNCH]		= IORING_OP_FALLOCATE,
+};
+
+struct rec_file {
+	int		fd;
+	int		pending;	/* open, writes and fallocate in flight */
+	int		opening, ended, truncated;
+	int		direct;		/* O_DIRECT is set on fd */
+	int		attempt;	/* name suffix, for names taken already */
+	uint64_t	size;		/* bytes submitted */
+	struct rec_buffer *waiting, **waiting_tail;	/* filled while opening */
+	char		stamp[32];
+	char		path[PATH_MAX];
+};
+
+#define rec_log(r, prio, ...) do { if ((r)->log) (r)->log(prio, __VA_ARGS__); } while (0)
+
+static int64_t rec_us(const struct timespec *from, const struct timespec *to)
+{
+	return (int64_t)(to->tv_sec - from->tv_sec) * 1000000 +
+		(to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static int rec_has_op(const struct io_uring_probe *probe, int op)
+{
+	return probe && probe->last_op >= op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+}
+
+static int rec_uring_setup(struct recorder *r, unsigned int entries)
+{
+	struct io_uring_params p;
+	struct io_uring_probe *probe;
+	int err;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return 0;
+
+	r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_map_size > r->sq_map_size)
+			r->sq_map_size = r->cq_map_size;
+		r->cq_map_size = r->sq_map_size;
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			 r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED)
+		goto error;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_map = r->sq_map;
+	else
+		r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				 r->fd, IORING_OFF_CQ_RING);
+	if (r->cq_map == MAP_FAILED)
+		goto error;
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto error;
+
+	r->sq_entries = p.sq_entries;
+	r->sq_head = (void *) ((char *) r->sq_map + p.sq_off.head);
+	r->sq_tail = (void *) ((char *) r->sq_map + p.sq_off.tail);
+	r->sq_mask = (void *) ((char *) r->sq_map + p.sq_off.ring_mask);
+	r->sq_array = (void *) ((char *) r->sq_map + p.sq_off.array);
+	r->cq_head = (void *) ((char *) r->cq_map + p.cq_off.head);
+	r->cq_tail = (void *) ((char *) r->cq_map + p.cq_off.tail);
+	r->cq_mask = (void *) ((char *) r->cq_map + p.cq_off.ring_mask);
+	r->cqes = (char *) r->cq_map + p.cq_off.cqes;
+
+	probe = calloc(1, sizeof(*probe) + 256 * sizeof(probe->ops[0]));
+	if (probe && syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+		free(probe);
+		probe = NULL;
+	}
+	r->sync_open = !rec_has_op(probe, IORING_OP_OPENAT);
+	r->punch_tail = !rec_has_op(probe, IORING_OP_FTRUNCATE);
+	free(probe);
+	return 1;
+
+error:
+	err = errno;
+	if (r->sqes && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_map && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_map_size);
+	if (r->sq_map != MAP_FAILED)
+		munmap(r->sq_map, r->sq_map_size);
+	close(r->fd);
+	r->fd = -1;
+	errno = err;
+	return 0;
+}
+
+static void rec_uring_free(struct recorder *r)
+{
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_map_size);
+	munmap(r->sq_map, r->sq_map_size);
+	close(r->fd);
+	r->fd = -1;
+}
+
+static int rec_enter(struct recorder *r, unsigned int wait)
+{
+	int n;
+
+	if (!r->sq_pending && !wait)
+		return 0;
+	n = syscall(__NR_io_uring_enter, r->fd, r->sq_pending, wait,
+		    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (n < 0)
+		return -1;
+	r->sq_pending -= n;
+	return 0;
+}
+
+static struct io_uring_sqe *rec_sqe(struct recorder *r, int op, void *ptr)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail = *r->sq_tail, idx;
+
+	if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+		rec_enter(r, 0);
+		if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+			return NULL;
+	}
+	idx = tail & *r->sq_mask;
+	sqe = &((struct io_uring_sqe *) r->sqes)[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = rec_opcodes[op];
+	sqe->user_data = (uintptr_t) ptr | op;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->sq_pending++;
+	r->inflight++;
+	return sqe;
+}
+
+static void rec_buffer_release(struct recorder *r, struct rec_buffer *b)
+{
+	b->next = r->free;
+	r->free = b;
+	r->nfree++;
+	r->stats.queued--;
+}
+
+static void rec_buffer_drop(struct recorder *r, struct rec_buffer *b)
+{
+	r->stats.errors++;
+	r->stats.dropped += b->len - b->done;
+	rec_buffer_release(r, b);
+}
+
+/* Queues the write of what is left of a buffer */
+static int rec_queue_write(struct recorder *r, struct rec_buffer *b)
+{
+	struct rec_file *f = b->file;
+	struct io_uring_sqe *sqe;
+	int fl;
+
+	if (f->direct && ((b->offset + b->done) % REC_ALIGN || (b->len - b->done) % REC_ALIGN)) {
+		fl = fcntl(f->fd, F_GETFL);
+		if (fl >= 0)
+			fcntl(f->fd, F_SETFL, fl & ~O_DIRECT);
+		f->direct = 0;
+	}
+	sqe = rec_sqe(r, REC_OP_WRITE, b);
+	if (!sqe)
+		return 0;
+	sqe->fd = f->fd;
+	sqe->addr = (uintptr_t) &b->data[b->done];
+	sqe->len = b->len - b->done;
+	sqe->off = b->offset + b->done;
+	f->pending++;
+	if (!b->done)
+		clock_gettime(CLOCK_MONOTONIC, &b->submitted);
+	return 1;
+}
+
+/* Hands a filled buffer to its file, which it waits on while the file
+ * is being opened. The file only grows by the buffers queued, so one
+ * dropped leaves no hole. */
+static void rec_submit_buffer(struct recorder *r, struct rec_buffer *b)
+{
+	struct rec_file *f = b->file;
+
+	if (f->opening) {
+		b->next = NULL;
+		*f->waiting_tail = b;
+		f->waiting_tail = &b->next;
+		return;
+	}
+	b->offset = f->size;
+	if (f->fd < 0 || !rec_queue_write(r, b)) {
+		rec_buffer_drop(r, b);
+		return;
+	}
+	f->size += b->len;
+}
+
+/* Truncates away the preallocation beyond the end, then closes. Falls
+ * back to doing it inline if the ring is out of entries. Without
+ * IORING_OP_FTRUNCATE the file already has its length, as writes past
+ * the preallocation size move it, so the rest is only punched out;
+ * ext4 does not punch past the end and keeps those blocks. */
+static void rec_file_finish(struct recorder *r, struct rec_file *f)
+{
+	struct io_uring_sqe *sqe;
+
+	if (f->fd < 0) {
+		free(f);
+		return;
+	}
+	if (!f->truncated && r->cfg.prealloc > f->size) {
+		f->truncated = 1;
+		sqe = rec_sqe(r, r->punch_tail ? REC_OP_PUNCH : REC_OP_FTRUNCATE, f);
+		if (sqe) {
+			sqe->fd = f->fd;
+			sqe->off = f->size;
+			if (r->punch_tail) {
+				sqe->addr = r->cfg.prealloc - f->size;
+				sqe->len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+			}
+			return;
+		}
+		if (ftruncate(f->fd, f->size) < 0)
+			rec_log(r, LOG_WARNING, "record: truncating %s failed: %s", f->path, strerror(errno));
+	}
+	sqe = rec_sqe(r, REC_OP_CLOSE, f);
+	if (sqe) {
+		sqe->fd = f->fd;
+		return;
+	}
+	close(f->fd);
+	free(f);
+}
+
+static void rec_end_file(struct recorder *r)
+{
+	struct rec_file *f = r->file;
+	struct rec_buffer *b = r->cur;
+
+	if (!f)
+		return;
+	r->file = NULL;
+	r->cur = NULL;
+	f->ended = 1;
+	if (b && b->len) {
+		rec_submit_buffer(r, b);
+	} else if (b) {
+		rec_buffer_release(r, b);
+	}
+	if (!f->pending)
+		rec_file_finish(r, f);
+}
+
+static void rec_opened(struct recorder *r, struct rec_file *f, int res);
+
+/* Creates the file under the next free name. The open goes through the
+ * ring unless the kernel lacks IORING_OP_OPENAT; either way it ends in
+ * rec_opened(). */
+static void rec_open_file(struct recorder *r, struct rec_file *f)
+{
+	struct io_uring_sqe *sqe;
+	int flags, fd;
+
+	if (f->attempt)
+		snprintf(f->path, sizeof(f->path), "%s/%s-%s-%d.ts", r->dir, r->name, f->stamp, f->attempt);
+	else
+		snprintf(f->path, sizeof(f->path), "%s/%s-%s.ts", r->dir, r->name, f->stamp);
+	flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | (f->direct ? O_DIRECT : 0);
+	if (!r->sync_open && (sqe = rec_sqe(r, REC_OP_OPEN, f)) != NULL) {
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t) f->path;
+		sqe->open_flags = flags;
+		sqe->len = 0644;
+		return;
+	}
+	fd = open(f->path, flags, 0644);
+	rec_opened(r, f, fd < 0 ? -errno : fd);
+}
+
+static void rec_opened(struct recorder *r, struct rec_file *f, int res)
+{
+	struct io_uring_sqe *sqe;
+	struct rec_buffer *b;
+
+	if (res == -EINVAL && f->direct) {
+		rec_log(r, LOG_WARNING, "record: %s does not support O_DIRECT, writing through the page cache",
+			r->dir);
+		r->cfg.direct = f->direct = 0;
+		rec_open_file(r, f);
+		return;
+	}
+	if (res == -EEXIST && ++f->attempt < 100) {
+		rec_open_file(r, f);
+		return;
+	}
+	f->opening = 0;
+	f->pending--;
+	if (res < 0) {
+		if (!r->failing)
+			rec_log(r, LOG_ERR, "record: creating %s failed: %s", f->path, strerror(-res));
+		r->failing = 1;
+		r->stats.errors++;
+	} else {
+		f->fd = res;
+		if (r->cfg.prealloc && (sqe = rec_sqe(r, REC_OP_FALLOCATE, f)) != NULL) {
+			sqe->fd = f->fd;
+			sqe->off = 0;
+			sqe->addr = r->cfg.prealloc;
+			sqe->len = FALLOC_FL_KEEP_SIZE;
+			f->pending++;
+		}
+		rec_log(r, LOG_INFO, "record: writing %s", f->path);
+		r->stats.files++;
+	}
+	while ((b = f->waiting) != NULL) {
+		f->waiting = b->next;
+		rec_submit_buffer(r, b);
+	}
+	f->waiting_tail = &f->waiting;
+
+	/* What is still to come for a file that failed to open is dropped
+	 * with it, the next write starts over after a second */
+	if (res < 0 && r->file == f)
+		rec_end_file(r);
+	else if (f->ended && !f->pending)
+		rec_file_finish(r, f);
+}
+
+static int rec_start_file(struct recorder *r, const struct timespec *now)
+{
+	struct rec_file *f;
+	struct tm tm;
+	time_t t = time(NULL);
+
+	r->file_start = *now;
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return 0;
+	localtime_r(&t, &tm);
+	strftime(f->stamp, sizeof(f->stamp), "%Y%m%d-%H%M%S", &tm);
+	f->fd = -1;
+	f->opening = 1;
+	f->pending = 1;
+	f->direct = r->cfg.direct;
+	f->waiting_tail = &f->waiting;
+	r->file = f;
+	rec_open_file(r, f);
+	return r->file != NULL;
+}
+
+/* Appends whole packets as far as the free buffers allow */
+static void rec_append(struct recorder *r, const unsigned char *data, size_t len)
+{
+	struct rec_buffer *b;
+	size_t room, n;
+
+	if (!len)
+		return;
+	room = r->nfree * r->buffer_size + (r->cur ? r->buffer_size - r->cur->len : 0);
+	if (len > room) {
+		n = room / TS_PACKET_SIZE * TS_PACKET_SIZE;
+		r->stats.dropped += len - n;
+		if (!r->dropping)
+			rec_log(r, LOG_WARNING, "record: %s: all %d buffers in flight, dropping data",
+				r->name, r->cfg.buffers);
+		r->dropping = 1;
+		len = n;
+	} else {
+		r->dropping = 0;
+	}
+
+	while (len) {
+		b = r->cur;
+		if (!b) {
+			b = r->cur = r->free;
+			r->free = b->next;
+			r->nfree--;
+			b->file = r->file;
+			b->len = b->done = 0;
+			r->stats.queued++;
+			if (r->stats.queued > r->stats.queued_max)
+				r->stats.queued_max = r->stats.queued;
+		}
+		n = r->buffer_size - b->len;
+		if (n > len)
+			n = len;
+		memcpy(&b->data[b->len], data, n);
+		b->len += n;
+		data += n;
+		len -= n;
+		if (b->len == r->buffer_size) {
+			r->cur = NULL;
+			rec_submit_buffer(r, b);
+		}
+	}
+}
+
+static int rec_limit(struct recorder *r, const struct timespec *now, int factor)
+{
+	uint64_t size = r->file->size + (r->cur ? r->cur->len : 0);
+
+	return (r->cfg.max_bytes && size >= r->cfg.max_bytes * factor) ||
+	       (r->cfg.max_seconds > 0 &&
+		rec_us(&r->file_start, now) >= r->cfg.max_seconds * factor * 1e6);
+}
+
+void rec_write(struct recorder *r, const struct iovec *iov, int ioc)
+{
+	const unsigned char *p, *end, *run;
+	struct timespec now;
+	int i, pid;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (r->file && rec_limit(r, &now, 2)) {
+		/* No random access point in sight, rotate anyway */
+		rec_end_file(r);
+	}
+	if (!r->file) {
+		/* Retry a failed create once a second */
+		if (r->failing && rec_us(&r->file_start, &now) < 1000000)
+			goto done;
+		if (!rec_start_file(r, &now))
+			goto done;
+		if (r->have_pat)
+			rec_append(r, r->pat, TS_PACKET_SIZE);
+		if (r->have_pmt)
+			rec_append(r, r->pmt, TS_PACKET_SIZE);
+	}
+
+	for (i = 0; i < ioc; i++) {
+		run = p = iov[i].iov_base;
+		end = p + iov[i].iov_len;
+		for (; p < end; p += TS_PACKET_SIZE) {
+			if (!(p[1] & 0x40))
+				continue;
+			pid = ((p[1] & 0x1f) << 8) | p[2];
+			if (pid == 0) {
+				memcpy(r->pat, p, TS_PACKET_SIZE);
+				r->have_pat = 1;
+			} else if (pid == r->pmt_pid) {
+				memcpy(r->pmt, p, TS_PACKET_SIZE);
+				r->have_pmt = 1;
+			} else if (pid == r->video_pid && rec_limit(r, &now, 1) && ts_random_access(p)) {
+				rec_append(r, run, p - run);
+				rec_end_file(r);
+				run = p;
+				if (!rec_start_file(r, &now))
+					goto done;
+				if (r->have_pat)
+					rec_append(r, r->pat, TS_PACKET_SIZE);
+				if (r->have_pmt)
+					rec_append(r, r->pmt, TS_PACKET_SIZE);
+			}
+		}
+		rec_append(r, run, end - run);
+	}
+done:
+	rec_enter(r, 0);
+}
+
+void rec_split(struct recorder *r)
+{
+	if (!r->dir)
+		return;
+	rec_end_file(r);
+	rec_enter(r, 0);
+}
+
+static void rec_complete(struct recorder *r, uint64_t user_data, int res)
+{
+	struct rec_buffer *b;
+	struct rec_file *f;
+	struct timespec now;
+	int64_t us;
+
+	switch (user_data & REC_OP_MASK) {
+	case REC_OP_WRITE:
+		b = (struct rec_buffer *) (uintptr_t) (user_data & ~(uint64_t) REC_OP_MASK);
+		f = b->file;
+		f->pending--;
+		if (res > 0 && b->done + res < b->len) {
+			b->done += res;
+			if (!rec_queue_write(r, b))
+				rec_buffer_drop(r, b);
+			break;
+		}
+		/* No progress, resubmitting would not make any either */
+		if (res == 0)
+			res = -EIO;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		us = rec_us(&b->submitted, &now);
+		r->stats.writes++;
+		r->stats.write_us += us;
+		if (us > r->stats.write_max_us)
+			r->stats.write_max_us = us;
+		hist_add(&r->stats.write_hist, us);
+		if (res < 0) {
+			if (!r->failing)
+				rec_log(r, LOG_ERR, "record: writing %s failed: %s", f->path, strerror(-res));
+			r->failing = 1;
+			r->stats.errors++;
+		} else {
+			r->failing = 0;
+			r->stats.bytes += b->len;
+		}
+		rec_buffer_release(r, b);
+		break;
+	case REC_OP_FALLOCATE:
+		f = (struct rec_file *) (uintptr_t) (user_data & ~(uint64_t) REC_OP_MASK);
+		f->pending--;
+		if (res < 0) {
+			/* Nothing to truncate, the file is written regardless */
+			f->truncated = 1;
+			rec_log(r, LOG_DEBUG, "record: preallocating %s failed: %s", f->path, strerror(-res));
+		}
+		break;
+	case REC_OP_FTRUNCATE:
+	case REC_OP_PUNCH:
+		f = (struct rec_file *) (uintptr_t) (user_data & ~(uint64_t) REC_OP_MASK);
+		if (res < 0)
+			rec_log(r, LOG_WARNING, "record: truncating %s failed: %s", f->path, strerror(-res));
+		rec_file_finish(r, f);
+		return;
+	case REC_OP_OPEN:
+		rec_opened(r, (struct rec_file *) (uintptr_t) (user_data & ~(uint64_t) REC_OP_MASK), res);
+		return;
+	case REC_OP_CLOSE:
+		f = (struct rec_file *) (uintptr_t) (user_data & ~(uint64_t) REC_OP_MASK);
+		if (res < 0) {
+			r->stats.errors++;
+			rec_log(r, LOG_ERR, "record: closing %s failed: %s", f->path, strerror(-res));
+		}
+		free(f);
+		return;
+	default:
+		return;
+	}
+	if (f->ended && !f->pending)
+		rec_file_finish(r, f);
+}
+
+void rec_reap(struct recorder *r, int wait)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail;
+
+	if (!r->dir)
+		return;
+	if (rec_enter(r, wait && r->inflight) < 0 && wait &&
+	    errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+		/* Nothing will complete, don't have rec_close() wait forever */
+		rec_log(r, LOG_ERR, "record: io_uring_enter failed: %s", strerror(errno));
+		r->inflight = 0;
+		return;
+	}
+	head = *r->cq_head;
+	tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		cqe = &((struct io_uring_cqe *) r->cqes)[head & *r->cq_mask];
+		__atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+		r->inflight--;
+		rec_complete(r, cqe->user_data, cqe->res);
+	}
+	rec_enter(r, 0);
+}
+
+int rec_open(struct recorder *r, const struct rec_config *cfg, const char *name,
+	     int pmt_pid, int video_pid, void (*log)(int prio, const char *fmt, ...))
+{
+	size_t size;
+	int i, err;
+
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+	r->cfg = *cfg;
+	if (r->cfg.buffers < 2)
+		r->cfg.buffers = 2;
+	if (r->cfg.buffers > REC_BUFFERS_MAX)
+		r->cfg.buffers = REC_BUFFERS_MAX;
+	r->buffer_size = (size_t) (r->cfg.buffer_kb > 0 ? r->cfg.buffer_kb : REC_BUFFER_KB) * 1024;
+	r->buffer_size = (r->buffer_size + REC_ALIGN - 1) / REC_ALIGN * REC_ALIGN;
+	r->pmt_pid = pmt_pid;
+	r->video_pid = video_pid;
+	r->log = log;
+
+	/* Ring entries for every buffer plus open and closing files */
+	if (!rec_uring_setup(r, r->cfg.buffers + 16))
+		return 0;
+
+	size = r->buffer_size * r->cfg.buffers;
+	r->buffer_mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	r->buffers = calloc(r->cfg.buffers, sizeof(*r->buffers));
+	r->dir = strdup(cfg->dir);
+	r->name = strdup(name);
+	if (r->buffer_mem == MAP_FAILED || !r->buffers || !r->dir || !r->name) {
+		err = errno;
+		if (r->buffer_mem != MAP_FAILED)
+			munmap(r->buffer_mem, size);
+		free(r->buffers);
+		free(r->dir);
+		free(r->name);
+		r->dir = r->name = NULL;
+		rec_uring_free(r);
+		errno = err;
+		return 0;
+	}
+	for (i = 0; i < r->cfg.buffers; i++) {
+		r->buffers[i].data = &r->buffer_mem[i * r->buffer_size];
+		r->buffers[i].next = r->free;
+		r->free = &r->buffers[i];
+	}
+	r->nfree = r->cfg.buffers;
+	return 1;
+}
+
+void rec_close(struct recorder *r)
+{
+	if (!r->dir)
+		return;
+	rec_end_file(r);
+	while (r->inflight)
+		rec_reap(r, 1);
+	rec_uring_free(r);
+	munmap(r->buffer_mem, r->buffer_size * r->cfg.buffers);
+	free(r->buffers);
+	free(r->dir);
+	free(r->name);
+	r->dir = r->name = NULL;
+}
@@ -0,0 +1,102 @@
+/* BlackMagic Design tools - disk recorder
+ *
+ * Writes the transport stream to <dir>/<name>-<date>-<time>.ts files
+ * through io_uring. Packets are copied into large aligned buffers which
+ * are submitted as single writes once full; the caller never waits for
+ * the disk. When all buffers are in flight the data is dropped instead.
+ * Files can be preallocated, written with O_DIRECT, and are rotated at
+ * the first random access point past a size or time limit.
+ */
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "hist.h"
+
+#define REC_BUFFER_KB		1024
+#define REC_BUFFERS		16
+#define REC_BUFFERS_MAX		256
+#define REC_ALIGN		4096	/* O_DIRECT offset, length and memory alignment */
+
+struct rec_config {
+	const char	*dir;
+	uint64_t	max_bytes;	/* rotate after this many bytes, 0 for no limit */
+	double		max_seconds;	/* rotate after this many seconds, 0 for no limit */
+	uint64_t	prealloc;	/* fallocate() new files to this size */
+	int		direct;		/* O_DIRECT */
+	int		buffer_kb, buffers;
+};
+
+struct rec_stats {
+	uint64_t	files, bytes;
+	uint64_t	dropped;		/* bytes dropped with no free buffer */
+	uint64_t	errors;
+	int		queued, queued_max;	/* buffers in flight */
+	uint64_t	writes, write_us, write_max_us;	/* submission to completion */
+	struct hist	write_hist;
+};
+
+struct rec_file;
+
+struct rec_buffer {
+	struct rec_buffer *next;
+	struct rec_file	*file;
+	unsigned char	*data;
+	size_t		len, done;
+	uint64_t	offset;
+	struct timespec	submitted;
+};
+
+struct recorder {
+	struct rec_config cfg;
+	char		*dir, *name;
+	int		video_pid, pmt_pid;
+	void		(*log)(int prio, const char *fmt, ...);
+
+	/* io_uring, pollable for completions */
+	int		fd;
+	unsigned int	sq_entries, sq_pending;
+	unsigned int	*sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int	*cq_head, *cq_tail, *cq_mask;
+	void		*sqes, *cqes;
+	void		*sq_map, *cq_map;
+	size_t		sq_map_size, cq_map_size, sqes_size;
+	int		inflight;	/* operations submitted and not completed */
+	int		sync_open;	/* no IORING_OP_OPENAT, open() inline */
+	int		punch_tail;	/* no IORING_OP_FTRUNCATE, punch a hole */
+
+	struct rec_buffer *buffers, *free, *cur;
+	unsigned char	*buffer_mem;
+	size_t		buffer_size;
+	int		nfree;
+	struct rec_file	*file;
+	struct timespec	file_start;
+	int		failing, dropping;
+	unsigned char	pat[0xbc], pmt[0xbc];
+	int		have_pat, have_pmt;
+
+	struct rec_stats stats;
+};
+
+/* Sets up the ring and allocates the buffers; files are created on the
+ * first write. Returns zero with errno set on failure. */
+int rec_open(struct recorder *r, const struct rec_config *cfg, const char *name,
+	     int pmt_pid, int video_pid, void (*log)(int prio, const char *fmt, ...));
+
+/* Flushes and closes the current file, waiting for all writes */
+void rec_close(struct recorder *r);
+
+void rec_write(struct recorder *r, const struct iovec *iov, int ioc);
+
+/* Ends the current file; the next write starts a new one */
+void rec_split(struct recorder *r);
+
+/* Handles finished writes, call when r->fd is readable. 'wait' blocks
+ * for at least one completion if any operation is in flight. */
+void rec_reap(struct recorder *r, int wait);
+
+#endif
@@ -0,0 +1,226 @@
+/* BlackMagic Design tools - MPEG-TS over UDP
+ *
+ * A datagram never splits a TS packet. Without GSO each message of a
+ * sendmmsg() batch is one datagram: the optional RTP header and up to
+ * two iovecs pointing straight at the packets. With GSO each message
+ * carries up to TS_UDP_GSO_SEGMENTS datagrams which the kernel cuts at
+ * TS_UDP_PAYLOAD bytes.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "tsnet.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP		17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT	103
+#endif
+
+int ts_udp_parse(const char *str, struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+	struct addrinfo hints, *ai;
+	char host[256];
+	const char *port;
+	size_t len;
+
+	if (str[0] == '[') {
+		port = strchr(str, ']');
+		if (!port || port[1] != ':')
+			return 0;
+		str++;
+		len = port - str;
+		port += 2;
+	} else {
+		port = strrchr(str, ':');
+		if (!port)
+			return 0;
+		len = port - str;
+		port++;
+	}
+	if (len == 0 || len >= sizeof(host))
+		return 0;
+	memcpy(host, str, len);
+	host[len] = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	if (getaddrinfo(host, port, &hints, &ai) != 0)
+		return 0;
+	memcpy(addr, ai->ai_addr, ai->ai_addrlen);
+	*addrlen = ai->ai_addrlen;
+	freeaddrinfo(ai);
+	return 1;
+}
+
+static int ts_udp_multicast(int fd, const struct sockaddr *addr, int ttl, const char *ifname)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *) addr;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) addr;
+	struct ip_mreqn mr;
+	int ifindex = 0, mcast;
+
+	mcast = (addr->sa_family == AF_INET && IN_MULTICAST(ntohl(sin->sin_addr.s_addr))) ||
+		(addr->sa_family == AF_INET6 && IN6_IS_ADDR_MULTICAST(&sin6->sin6_addr));
+	if (!mcast)
+		return 1;
+	if (ifname) {
+		ifindex = if_nametoindex(ifname);
+		if (!ifindex)
+			return 0;
+	}
+
+	if (addr->sa_family == AF_INET) {
+		if (ttl && setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0)
+			return 0;
+		if (ifindex) {
+			memset(&mr, 0, sizeof(mr));
+			mr.imr_ifindex = ifindex;
+			if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mr, sizeof(mr)) < 0)
+				return 0;
+		}
+	} else {
+		if (ttl && setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl)) < 0)
+			return 0;
+		if (ifindex && setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex)) < 0)
+			return 0;
+	}
+	return 1;
+}
+
+int ts_udp_open(struct ts_udp *u, const struct sockaddr *addr, socklen_t addrlen,
+		int rtp, int ttl, const char *ifname, int sndbuf, int gso)
+{
+	struct timespec ts;
+	int seg = TS_UDP_PAYLOAD, err;
+
+	memset(u, 0, sizeof(*u));
+	u->fd = socket(addr->sa_family, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (u->fd < 0)
+		return 0;
+	if (sndbuf)
+		setsockopt(u->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	if (!ts_udp_multicast(u->fd, addr, ttl, ifname) ||
+	    connect(u->fd, addr, addrlen) < 0) {
+		err = errno;
+		close(u->fd);
+		u->fd = -1;
+		errno = err;
+		return 0;
+	}
+
+	u->rtp = rtp;
+	if (gso && !rtp)
+		u->gso = setsockopt(u->fd, SOL_UDP, UDP_SEGMENT, &seg, sizeof(seg)) == 0;
+
+	/* Random enough to tell restarted senders apart */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	u->ssrc = (ts.tv_nsec ^ ts.tv_sec ^ (getpid() << 16)) * 2654435761u;
+	u->seq = u->ssrc >> 16 ^ ts.tv_nsec;
+	return 1;
+}
+
+void ts_udp_close(struct ts_udp *u)
+{
+	if (u->fd >= 0)
+		close(u->fd);
+	u->fd = -1;
+}
+
+/* RTP timestamps are the 90 kHz sending time, as RFC 2250 allows */
+static uint32_t ts_rtp_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 90000ULL + (uint64_t) ts.tv_nsec * 9 / 100000;
+}
+
+static void ts_rtp_header(unsigned char *h, uint16_t seq, uint32_t stamp, uint32_t ssrc)
+{
+	h[0] = 0x80;
+	h[1] = TS_RTP_PT_MP2T;
+	h[2] = seq >> 8;
+	h[3] = seq;
+	h[4] = stamp >> 24;
+	h[5] = stamp >> 16;
+	h[6] = stamp >> 8;
+	h[7] = stamp;
+	h[8] = ssrc >> 24;
+	h[9] = ssrc >> 16;
+	h[10] = ssrc >> 8;
+	h[11] = ssrc;
+}
+
+int ts_udp_send(struct ts_udp *u, unsigned char *p1, unsigned int n1,
+		unsigned char *p2, unsigned int n2)
+{
+	struct mmsghdr msg[TS_UDP_BATCH];
+	struct iovec iov[TS_UDP_BATCH][3];
+	unsigned char hdr[TS_UDP_BATCH][TS_RTP_HEADER];
+	unsigned int count[TS_UDP_BATCH];
+	unsigned int total, sent = 0, per_msg, a, b, m;
+	uint32_t stamp = 0;
+	int i, k, nmsg, r;
+
+	per_msg = TS_UDP_PACKETS * (u->gso ? TS_UDP_GSO_SEGMENTS : 1);
+	total = (n1 + n2) / TS_UDP_PACKETS * TS_UDP_PACKETS;
+	if (u->rtp)
+		stamp = ts_rtp_clock();
+
+	while (sent < total) {
+		memset(msg, 0, sizeof(msg));
+		for (nmsg = 0, a = sent; nmsg < TS_UDP_BATCH && a < total; nmsg++, a = b) {
+			b = a + per_msg < total ? a + per_msg : total;
+			k = 0;
+			if (u->rtp) {
+				ts_rtp_header(hdr[nmsg], u->seq + nmsg, stamp, u->ssrc);
+				iov[nmsg][k].iov_base = hdr[nmsg];
+				iov[nmsg][k++].iov_len = TS_RTP_HEADER;
+			}
+			if (a < n1) {
+				m = b < n1 ? b : n1;
+				iov[nmsg][k].iov_base = p1 + a * 0xbc;
+				iov[nmsg][k++].iov_len = (m - a) * 0xbc;
+			}
+			if (b > n1) {
+				m = a > n1 ? a : n1;
+				iov[nmsg][k].iov_base = p2 + (m - n1) * 0xbc;
+				iov[nmsg][k++].iov_len = (b - m) * 0xbc;
+			}
+			msg[nmsg].msg_hdr.msg_iov = iov[nmsg];
+			msg[nmsg].msg_hdr.msg_iovlen = k;
+			count[nmsg] = b - a;
+		}
+
+		u->calls++;
+		r = sendmmsg(u->fd, msg, nmsg, 0);
+		if (r < 0 && (errno == EINTR || errno == ECONNREFUSED)) {
+			/* ECONNREFUSED reports an ICMP error for an earlier
+			 * datagram, nothing listening is not fatal for UDP */
+			continue;
+		}
+		if (r <= 0)
+			return sent ? sent : -1;
+		for (i = 0; i < r; i++)
+			sent += count[i];
+		if (u->rtp)
+			u->seq += r;
+	}
+	return sent;
+}
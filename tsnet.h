@@ -0,0 +1,49 @@
+/* BlackMagic Design tools - MPEG-TS over UDP
+ *
+ * Sends transport stream packets as UDP datagrams of TS_UDP_PACKETS
+ * packets each, optionally behind an RTP header (RFC 2250). Datagrams
+ * are handed to the kernel in batches with sendmmsg(), or as large
+ * segmented sends when UDP GSO is available.
+ */
+
+#ifndef TSNET_H
+#define TSNET_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define TS_UDP_PACKETS		7
+#define TS_UDP_PAYLOAD		(TS_UDP_PACKETS * 0xbc)
+#define TS_UDP_BATCH		64	/* messages per sendmmsg() */
+#define TS_UDP_GSO_SEGMENTS	48	/* datagrams per GSO message */
+#define TS_RTP_HEADER		12
+#define TS_RTP_PT_MP2T		33
+
+struct ts_udp {
+	int		fd;
+	int		rtp, gso;
+	uint16_t	seq;
+	uint32_t	ssrc;
+	uint64_t	calls;		/* sendmmsg() calls made */
+};
+
+/* Parses "host:port" or "[ipv6]:port". Returns zero on failure. */
+int ts_udp_parse(const char *str, struct sockaddr_storage *addr, socklen_t *addrlen);
+
+/* Opens a socket connected to 'addr'. 'ttl' and 'ifname' apply to
+ * multicast destinations (zero/NULL for the system default), 'sndbuf'
+ * is in bytes (zero for the default). GSO is silently turned off when
+ * the kernel lacks it or with RTP, which needs a header per datagram.
+ * Returns zero with errno set on failure. */
+int ts_udp_open(struct ts_udp *u, const struct sockaddr *addr, socklen_t addrlen,
+		int rtp, int ttl, const char *ifname, int sndbuf, int gso);
+void ts_udp_close(struct ts_udp *u);
+
+/* Sends the whole datagrams contained in 'n1' packets at 'p1' followed
+ * by 'n2' packets at 'p2' (the two halves of a wrapped ring). Returns
+ * the number of packets sent, a multiple of TS_UDP_PACKETS, or -1 with
+ * errno set if nothing could be sent. */
+int ts_udp_send(struct ts_udp *u, unsigned char *p1, unsigned int n1,
+		unsigned char *p2, unsigned int n2);
+
+#endif
@@ -0,0 +1,161 @@
+/* BlackMagic Design tools - ring outputs
+ *
+ * The reader's carry (the tables a new reader is primed with, or a
+ * packet that must go ahead of the data at the cursor) is always
+ * written with write(), it is not in the ring to be pinned.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+
+#include "tsout.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY	60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY	0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY		5
+#define SO_EE_CODE_ZEROCOPY_COPIED	1
+#endif
+
+void ts_pipe_update_pin(struct ts_reader *rd, int fd)
+{
+	unsigned int pin;
+	int inpipe;
+
+	if (ioctl(fd, FIONREAD, &inpipe) < 0)
+		return;
+	if (inpipe <= rd->partial)
+		pin = rd->cursor;
+	else
+		pin = rd->cursor - (inpipe - rd->partial + 0xbc - 1) / 0xbc;
+	if ((int)(pin - rd->pin) > 0)
+		rd->pin = pin;
+}
+
+ssize_t ts_pipe_write(struct ts_ring *r, struct ts_reader *rd, int fd, int nonblock,
+		      ssize_t (*send)(void *arg, void *ptr, size_t len), void *arg)
+{
+	struct iovec iov;
+	unsigned char *ptr;
+	unsigned int n = 0;
+	ssize_t w;
+
+	/* a packet to go first may be put in the carry by the peek */
+	if (!rd->carry_len)
+		n = ts_reader_peek(r, rd, &ptr);
+	if (rd->carry_len) {
+		w = write(fd, rd->carry + rd->carry_off, rd->carry_len);
+		if (w > 0) {
+			rd->carry_off += w;
+			rd->carry_len -= w;
+		}
+		return w;
+	}
+	if (n == 0)
+		return 0;
+
+	iov.iov_base = ptr + rd->partial;
+	iov.iov_len = n * 0xbc - rd->partial;
+	if (send)
+		w = send(arg, iov.iov_base, iov.iov_len);
+	else if (rd->pinning)
+		w = vmsplice(fd, &iov, 1, nonblock ? SPLICE_F_NONBLOCK : 0);
+	else
+		w = write(fd, iov.iov_base, iov.iov_len);
+	if (w > 0)
+		ts_reader_advance(rd, w);
+	return w;
+}
+
+int ts_udp_write(struct ts_udp *u, struct ts_ring *r, struct ts_reader *rd)
+{
+	unsigned char *ptr;
+	unsigned int n;
+	int sent;
+
+	n = ts_reader_peek(r, rd, &ptr);
+	sent = ts_udp_send(u, ptr, n, r->data, r->head - rd->cursor - n);
+	if (sent > 0)
+		ts_reader_advance(rd, sent * 0xbc);
+	return sent;
+}
+
+int ts_tcp_init(struct ts_tcp *t, int fd, struct ts_reader *rd)
+{
+	int one = 1;
+
+	memset(t, 0, sizeof(*t));
+	t->fd = fd;
+	t->rd = rd;
+	t->zerocopy = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+	return t->zerocopy;
+}
+
+ssize_t ts_tcp_send(void *arg, void *ptr, size_t len)
+{
+	struct ts_tcp *t = arg;
+	unsigned int start = t->rd->cursor;
+	ssize_t r;
+
+	if (t->zerocopy && len >= TS_ZEROCOPY_MIN &&
+	    t->zc_sent - t->zc_done < TS_ZEROCOPY_MAX) {
+		r = send(t->fd, ptr, len, MSG_DONTWAIT | MSG_NOSIGNAL | MSG_ZEROCOPY);
+		if (r > 0)
+			t->zc_start[t->zc_sent++ % TS_ZEROCOPY_MAX] = start;
+		/* ENOBUFS: out of memory for notifications, copy instead */
+		if (r > 0 || errno != ENOBUFS)
+			return r;
+	}
+	return send(t->fd, ptr, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+void ts_tcp_completions(struct ts_tcp *t)
+{
+	struct sock_extended_err *ee;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	char control[128];
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(t->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			ee = (struct sock_extended_err *) CMSG_DATA(cm);
+			if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			/* Copied anyway, as on loopback: not worth it */
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				t->zerocopy = 0;
+			if ((int)(ee->ee_info - t->zc_done) <= 0 &&
+			    (int)(ee->ee_data + 1 - t->zc_done) > 0)
+				t->zc_done = ee->ee_data + 1;
+		}
+	}
+}
+
+void ts_tcp_update_pin(struct ts_tcp *t)
+{
+	struct ts_reader *rd = t->rd;
+	unsigned int pin;
+
+	if (t->zc_sent != t->zc_done)
+		pin = t->zc_start[t->zc_done % TS_ZEROCOPY_MAX];
+	else
+		pin = ts_reader_sent_end(rd);
+	if ((int)(pin - rd->pin) > 0)
+		rd->pin = pin;
+}
@@ -0,0 +1,65 @@
+/* BlackMagic Design tools - ring outputs
+ *
+ * Writes what a ring reader has not had yet to where it goes: a pipe or
+ * file, a pipe the ring pages are vmsplice()d into, a TCP socket with
+ * MSG_ZEROCOPY where it has it, or UDP datagrams. Each call is one
+ * write, bmd-streamer and bmd-tsbench loop over them and keep their own
+ * counts.
+ */
+
+#ifndef TSOUT_H
+#define TSOUT_H
+
+#include <sys/types.h>
+
+#include "tsnet.h"
+#include "tsring.h"
+
+#define TS_ZEROCOPY_MIN		(8*1024)
+#define TS_ZEROCOPY_MAX		64
+
+/* The ring position each zero copy send started at is kept until the
+ * kernel reports it done, as that data is still pinned */
+struct ts_tcp {
+	int		fd;
+	int		zerocopy;
+	struct ts_reader *rd;
+	unsigned int	zc_sent, zc_done;
+	unsigned int	zc_start[TS_ZEROCOPY_MAX];
+};
+
+/* With vmsplice the pipe references ring pages instead of copying them.
+ * Moves the pin of the reader up to the oldest packet still in 'fd',
+ * which must carry this reader only. */
+void ts_pipe_update_pin(struct ts_reader *rd, int fd);
+
+/* Writes the carry of the reader, or else the ring from its cursor:
+ * with 'send' where given (which pins as it sees fit), vmsplice()d when
+ * the reader pins, otherwise with write(). 'nonblock' keeps vmsplice()
+ * from waiting for the pipe, write() goes by the descriptor. The reader
+ * moves past what was written. Returns the bytes written, zero when
+ * there is nothing to write, or -1 with errno set. */
+ssize_t ts_pipe_write(struct ts_ring *r, struct ts_reader *rd, int fd, int nonblock,
+		      ssize_t (*send)(void *arg, void *ptr, size_t len), void *arg);
+
+/* Sends the whole datagrams the reader has waiting, a short tail is
+ * left for the next call. Returns as ts_udp_send(). */
+int ts_udp_write(struct ts_udp *u, struct ts_ring *r, struct ts_reader *rd);
+
+/* Sets up sending 'rd' to the connected socket 'fd'. Returns whether
+ * MSG_ZEROCOPY is on, which is what the reader should pin for. */
+int ts_tcp_init(struct ts_tcp *t, int fd, struct ts_reader *rd);
+
+/* The 'send' of ts_pipe_write(), 'arg' is the struct ts_tcp. Sends
+ * without waiting, zero copy for large enough runs. */
+ssize_t ts_tcp_send(void *arg, void *ptr, size_t len);
+
+/* Takes the zero copy completions off the socket's error queue; zero
+ * copy is turned off if the kernel had to copy anyway */
+void ts_tcp_completions(struct ts_tcp *t);
+
+/* Moves the pin of the reader up to the oldest zero copy send the
+ * kernel has not reported done */
+void ts_tcp_update_pin(struct ts_tcp *t);
+
+#endif
@@ -0,0 +1,452 @@
+/* BlackMagic Design tools - stream ring and parser
+ *
+ * Nothing here locks: the parser and the readers of a ring are run from
+ * the same thread, bmd-streamer's event loop or a benchmark.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "mpegts.h"
+#include "hls.h"
+#include "record.h"
+#include "dvr.h"
+#include "tsring.h"
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+const char *ts_lag_policy_names[TS_LAG_MAX] = {
+	[TS_LAG_DROP] = "drop",
+	[TS_LAG_SKIP] = "skip",
+	[TS_LAG_CLOSE] = "close",
+	[TS_LAG_GOP] = "gop",
+	[TS_LAG_NONREF] = "nonref",
+	[TS_LAG_BLOCK] = "block",
+};
+
+int ts_ring_init(struct ts_ring *r, unsigned int kbytes)
+{
+	unsigned int n = 4 * TS_RING_BLOCK;
+
+	while (n * 2 * 0xbc <= kbytes * 1024)
+		n *= 2;
+
+	memset(r, 0, sizeof(*r));
+	r->size = n;
+	r->mask = n - 1;
+	/* Page aligned so that the outputs can vmsplice straight from it */
+	r->data = mmap(NULL, n * 0xbc, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (r->data == MAP_FAILED) {
+		r->data = NULL;
+		return 0;
+	}
+	r->meta = calloc(n, 1);
+	r->stamp = calloc(n / TS_RING_STAMP, sizeof(*r->stamp));
+	if (!r->meta || !r->stamp) {
+		munmap(r->data, n * 0xbc);
+		free(r->meta);
+		free(r->stamp);
+		r->data = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+void ts_ring_free(struct ts_ring *r)
+{
+	if (r->data)
+		munmap(r->data, r->size * 0xbc);
+	free(r->meta);
+	free(r->stamp);
+	r->data = NULL;
+	r->meta = NULL;
+	r->stamp = NULL;
+}
+
+void ts_ring_attach(struct ts_ring *r, struct ts_reader *rd, unsigned int lag_kb, int policy, int pinning)
+{
+	unsigned int max = r->size - TS_RING_BLOCK;
+
+	memset(rd, 0, sizeof(*rd));
+	rd->cursor = rd->pin = r->head;
+	rd->lag_limit = lag_kb ? lag_kb * 1024 / 0xbc : max;
+	/* Thinning gets the other half to fall back on */
+	if (policy == TS_LAG_NONREF)
+		max /= 2;
+	if (rd->lag_limit > max)
+		rd->lag_limit = max;
+	rd->policy = policy;
+	rd->pinning = pinning;
+	rd->next = r->readers;
+	r->readers = rd;
+}
+
+unsigned int ts_reader_sent_end(struct ts_reader *rd)
+{
+	return rd->cursor + (rd->partial ? 1 : 0);
+}
+
+void ts_ring_detach(struct ts_ring *r, struct ts_reader *rd)
+{
+	struct ts_reader **prd;
+	unsigned int end = ts_reader_sent_end(rd);
+
+	if (rd->pinning && rd->pin != end) {
+		if (r->orphan_pin == r->orphan_end || (int)(rd->pin - r->orphan_pin) < 0)
+			r->orphan_pin = rd->pin;
+		if (r->orphan_pin == r->orphan_end || (int)(end - r->orphan_end) > 0)
+			r->orphan_end = end;
+	}
+
+	for (prd = &r->readers; *prd; prd = &(*prd)->next) {
+		if (*prd == rd) {
+			*prd = rd->next;
+			break;
+		}
+	}
+}
+
+/* Moves the reader to 'cursor', keeping the rest of a packet it has
+ * started to send so the output stays packet aligned. */
+static void ts_reader_skip(struct ts_ring *r, struct ts_reader *rd, unsigned int cursor)
+{
+	if (rd->partial) {
+		rd->carry_len = 0xbc - rd->partial;
+		rd->carry_off = 0;
+		memcpy(rd->carry, &r->data[(rd->cursor & r->mask) * 0xbc + rd->partial], rd->carry_len);
+		rd->cursor++;
+		rd->partial = 0;
+	}
+	if ((int)(cursor - rd->cursor) > 0) {
+		rd->overruns += cursor - rd->cursor;
+		rd->cursor = cursor;
+	}
+	if (!rd->pinning)
+		rd->pin = rd->cursor;
+}
+
+/* Moves the reader to the first random access point that leaves it
+ * within its lag limit once the head is at 'head'. Without one in the
+ * ring it waits at the head for the next to be written. */
+static void ts_reader_skip_gop(struct ts_ring *r, struct ts_reader *rd, unsigned int head)
+{
+	unsigned int pos = head - rd->lag_limit;
+
+	rd->gop_skips++;
+	if ((int)(pos - rd->cursor) < 0)
+		pos = rd->cursor;
+	for (; (int)(r->head - pos) > 0; pos++) {
+		if (r->meta[pos & r->mask] & TS_META_RAP) {
+			ts_reader_skip(r, rd, pos);
+			return;
+		}
+	}
+	ts_reader_skip(r, rd, r->head);
+	rd->resync = 1;
+}
+
+/* Applies the lag policies for 'n' packets about to be written */
+static void ts_ring_make_room(struct ts_ring *r, unsigned int n)
+{
+	unsigned int head = r->head + n, lag;
+	struct ts_reader *rd;
+
+	for (rd = r->readers; rd; rd = rd->next) {
+		lag = head - rd->cursor;
+		if (lag > rd->high_water)
+			rd->high_water = lag;
+		if (rd->policy == TS_LAG_NONREF) {
+			if (lag > rd->lag_limit)
+				rd->thinning = 1;
+			else if (lag < rd->lag_limit / 2)
+				rd->thinning = 0;
+			if (lag <= 2 * rd->lag_limit)
+				continue;
+		} else if (lag <= rd->lag_limit)
+			continue;
+		/* Without video to go by, whole pictures can't be told apart */
+		if (rd->policy >= TS_LAG_GOP && !r->video_pid) {
+			ts_reader_skip(r, rd, r->head);
+			continue;
+		}
+		switch (rd->policy) {
+		case TS_LAG_DROP:
+			ts_reader_skip(r, rd, head - rd->lag_limit);
+			break;
+		case TS_LAG_SKIP:
+			ts_reader_skip(r, rd, r->head);
+			break;
+		case TS_LAG_CLOSE:
+			rd->overrun = 1;
+			rd->partial = 0;
+			ts_reader_skip(r, rd, head);
+			break;
+		case TS_LAG_BLOCK:
+			/* the device was held back for it as long as allowed */
+			rd->block_timeouts++;
+			/* fall through */
+		case TS_LAG_GOP:
+		case TS_LAG_NONREF:
+			ts_reader_skip_gop(r, rd, head);
+			break;
+		}
+	}
+}
+
+/* Marks the random access points and the packets of disposable
+ * pictures of the 'n' packets written at 'pos' */
+static void ts_ring_classify(struct ts_ring *r, unsigned int pos, const unsigned char *p, unsigned int n)
+{
+	unsigned char *meta;
+
+	for (; n; n--, pos++, p += 0xbc) {
+		meta = &r->meta[pos & r->mask];
+		*meta = 0;
+		if ((((p[1] & 0x1f) << 8) | p[2]) != r->video_pid)
+			continue;
+		if (p[1] & 0x40) {
+			r->disposable = ts_disposable(p);
+			*meta = TS_META_START;
+			if (ts_random_access(p))
+				*meta |= TS_META_RAP;
+		}
+		if (r->disposable)
+			*meta |= TS_META_DISPOSABLE;
+	}
+}
+
+/* Moves readers waiting for a random access point to one in the packets
+ * just written at 'pos', or past them */
+static void ts_ring_resync(struct ts_ring *r, unsigned int pos)
+{
+	struct ts_reader *rd;
+	unsigned int p;
+
+	for (rd = r->readers; rd; rd = rd->next) {
+		if (!rd->resync)
+			continue;
+		for (p = pos; p != r->head && !(r->meta[p & r->mask] & TS_META_RAP); p++);
+		ts_reader_skip(r, rd, p);
+		rd->resync = p == r->head;
+	}
+}
+
+/* Checks if [*pin, end) reaches into the old block ending at 'old_end'
+ * and moves the pin past it if so. */
+static int ts_pin_release(unsigned int *pin, unsigned int end, unsigned int old_end)
+{
+	if (*pin == end || (int)(*pin - old_end) >= 0)
+		return 0;
+	*pin = (int)(end - old_end) < 0 ? end : old_end;
+	return 1;
+}
+
+/* Called before the producer starts overwriting the block at 'pos' */
+static void ts_ring_claim_block(struct ts_ring *r, unsigned int pos)
+{
+	unsigned int old_end = pos - r->size + TS_RING_BLOCK;
+	struct ts_reader *rd;
+	int pinned;
+
+	pinned = ts_pin_release(&r->orphan_pin, r->orphan_end, old_end);
+	for (rd = r->readers; rd; rd = rd->next)
+		if (rd->pinning)
+			pinned |= ts_pin_release(&rd->pin, ts_reader_sent_end(rd), old_end);
+	if (!pinned)
+		return;
+
+	if (mmap(&r->data[(pos & r->mask) * 0xbc], TS_RING_BLOCK * 0xbc, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0) == MAP_FAILED)
+		r->renew_errors++;
+	else
+		r->renewed++;
+}
+
+void ts_ring_write(struct ts_ring *r, const struct iovec *iov, int ioc, int64_t now_us)
+{
+	unsigned int start = r->head, head = start, n, off, chunk, g;
+	const unsigned char *src;
+	int i;
+
+	for (i = n = 0; i < ioc; i++)
+		n += iov[i].iov_len / 0xbc;
+	ts_ring_make_room(r, n);
+
+	for (i = 0; i < ioc; i++) {
+		src = iov[i].iov_base;
+		n = iov[i].iov_len / 0xbc;
+		while (n) {
+			off = head & r->mask;
+			if (off % TS_RING_BLOCK == 0)
+				ts_ring_claim_block(r, head);
+			chunk = TS_RING_BLOCK - off % TS_RING_BLOCK;
+			if (chunk > n) chunk = n;
+			memcpy(&r->data[off * 0xbc], src, chunk * 0xbc);
+			if (r->video_pid)
+				ts_ring_classify(r, head, src, chunk);
+			for (g = head / TS_RING_STAMP; g <= (head + chunk - 1) / TS_RING_STAMP; g++)
+				r->stamp[g & (r->mask / TS_RING_STAMP)] = now_us;
+			src += chunk * 0xbc;
+			head += chunk;
+			n -= chunk;
+		}
+	}
+	r->head = head;
+	ts_ring_resync(r, start);
+}
+
+/* A PES is dropped if thinning is on where it starts, and then to its
+ * end regardless. Other PIDs interleaved with it are kept. */
+unsigned int ts_reader_peek(struct ts_ring *r, struct ts_reader *rd, unsigned char **ptr)
+{
+	unsigned int off, n, i;
+	unsigned char m;
+
+	off = rd->cursor & r->mask;
+	*ptr = &r->data[off * 0xbc];
+	if (rd->policy == TS_LAG_NONREF && !rd->partial) {
+		for (; rd->cursor != r->head; rd->cursor++, rd->thinned++) {
+			m = r->meta[rd->cursor & r->mask];
+			if (m & TS_META_START)
+				rd->dropping = rd->thinning && (m & TS_META_DISPOSABLE);
+			if (!rd->dropping || !(m & TS_META_DISPOSABLE))
+				break;
+			rd->cc_gap = 1;
+		}
+		if (!rd->pinning)
+			rd->pin = rd->cursor;
+		off = rd->cursor & r->mask;
+		*ptr = &r->data[off * 0xbc];
+		if (rd->cc_gap && rd->cursor != r->head && (r->meta[off] & TS_META_START)) {
+			ts_discontinuity_packet(rd->carry, *ptr);
+			rd->carry_off = 0;
+			rd->carry_len = 0xbc;
+			rd->cc_gap = 0;
+			return 0;
+		}
+	}
+
+	n = r->head - rd->cursor;
+	if (n > r->size - off)
+		n = r->size - off;
+	if (rd->policy == TS_LAG_NONREF) {
+		for (i = 1; i < n; i++) {
+			m = r->meta[off + i];
+			if ((m & TS_META_START) ?
+			    rd->dropping || rd->cc_gap || (rd->thinning && (m & TS_META_DISPOSABLE)) :
+			    rd->dropping && (m & TS_META_DISPOSABLE)) {
+				n = i;
+				break;
+			}
+		}
+	}
+	return n;
+}
+
+void ts_reader_advance(struct ts_reader *rd, unsigned int bytes)
+{
+	bytes += rd->partial;
+	rd->cursor += bytes / 0xbc;
+	rd->partial = bytes % 0xbc;
+	if (!rd->pinning)
+		rd->pin = rd->cursor;
+}
+
+void ts_reader_flush(struct ts_ring *r, struct ts_reader *rd)
+{
+	rd->cursor = r->head;
+	rd->partial = 0;
+	rd->carry_len = 0;
+	if (!rd->pinning)
+		rd->pin = rd->cursor;
+}
+
+/* For the outputs that carry on from the previous encoder run, the
+ * first packet of each PID in the new one is flagged as a discontinuity
+ * of its continuity counter, and on the PCR PID of the time base. Where
+ * the packet has no adaptation field a packet of only one is put in
+ * front of it; if a batch needs more of those than there is room for,
+ * the rest of its PIDs are flagged in the next one. PIDs that do not
+ * show up within TS_DISC_US are not waited for. Returns the runs of
+ * 'iov' with the packets put in, in 'out'. */
+static int mpegparser_discontinuity(struct mpeg_parser_buffer *pb, const struct iovec *iov, int ioc,
+				    struct iovec *out)
+{
+	unsigned char *p, *run, *end;
+	int i, n = 0, added = 0, pid;
+
+	if (pb->discontinuity) {
+		pb->discontinuity = 0;
+		pb->flagging = 1;
+		pb->disc_end_us = pb->stats->arrival_us + TS_DISC_US;
+		memset(pb->disc_pids, 0xff, sizeof(pb->disc_pids));
+	}
+	for (i = 0; i < ioc; i++) {
+		run = p = iov[i].iov_base;
+		end = p + iov[i].iov_len;
+		for (; p < end; p += 0xbc) {
+			pid = ((p[1] & 0x1f) << 8) | p[2];
+			if (!(pb->disc_pids[pid / 64] & (1ULL << (pid % 64))))
+				continue;
+			if (!ts_set_discontinuity(p)) {
+				if (added == TS_DISC_INSERT)
+					continue;
+				if (p != run) {
+					out[n].iov_base = run;
+					out[n++].iov_len = p - run;
+				}
+				ts_discontinuity_packet(pb->disc_packets[added], p);
+				out[n].iov_base = pb->disc_packets[added++];
+				out[n++].iov_len = 0xbc;
+				run = p;
+			}
+			pb->disc_pids[pid / 64] &= ~(1ULL << (pid % 64));
+		}
+		if (run != end) {
+			out[n].iov_base = run;
+			out[n++].iov_len = end - run;
+		}
+	}
+	if (pb->stats->arrival_us >= pb->disc_end_us)
+		pb->flagging = 0;
+	return n;
+}
+
+void mpegparser_parse(struct mpeg_parser_buffer *pb, unsigned char *data, int newlen)
+{
+	struct iovec iov[64], disc[64 + 2 * TS_DISC_INSERT], *v;
+	unsigned char *buf = &data[-pb->oldlen];
+	int i = 0, len = newlen + pb->oldlen, ioc, n, pos;
+
+	memcpy(buf, pb->olddata, pb->oldlen);
+
+	do {
+		ioc = ts_scan(&buf[i], len - i, pb->filter, pb->stats, iov, array_size(iov), &pos);
+		if (ioc) {
+			v = iov;
+			n = ioc;
+			if (pb->rebase) {
+				ts_rebase(pb->rebase, iov, ioc);
+			} else if (pb->discontinuity || pb->flagging) {
+				n = mpegparser_discontinuity(pb, iov, ioc, disc);
+				v = disc;
+			}
+			if (pb->join)
+				ts_join_update(pb->join, pb->ring->head, v, n);
+			if (pb->hls)
+				hls_write(pb->hls, v, n);
+			if (pb->rec)
+				rec_write(pb->rec, v, n);
+			if (pb->dvr)
+				dvr_write(pb->dvr, v, n);
+			ts_ring_write(pb->ring, v, n, pb->stats->arrival_us);
+		}
+		i += pos;
+	} while (ioc == array_size(iov));
+
+	pb->oldlen = len - i;
+	memcpy(pb->olddata, &buf[i], pb->oldlen);
+}
+
@@ -0,0 +1,139 @@
+/* BlackMagic Design tools - stream ring and parser
+ *
+ * Broadcast ring of TS packets between the USB completion path and the
+ * outputs. head and the reader cursors are free running packet
+ * counters. The producer never waits: each reader has its own cursor
+ * and lag limit, and a reader falling further behind than that is
+ * handled by its policy without affecting the others.
+ *
+ * Readers that vmsplice() pin the packets still sitting in their pipe.
+ * The ring is managed in blocks of TS_RING_BLOCK packets (exactly 47
+ * pages); a block still pinned when the producer wraps around to it is
+ * moved onto fresh pages, leaving the old ones to the pipe.
+ *
+ * Next to the data the ring keeps a byte per packet telling where the
+ * video random access points are and which packets belong to pictures
+ * nothing refers to, for the policies that drop whole pictures, and the
+ * arrival time of every TS_RING_STAMP packets for latency measurement.
+ *
+ * The parser turns the device's bulk transfers into packet runs and
+ * hands them to the ring and the stages that take the whole stream.
+ */
+
+#ifndef TSRING_H
+#define TSRING_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "mpegts.h"
+
+#define TS_RING_BLOCK	1024
+#define TS_RING_STAMP	64
+#define TS_READER_CARRY	1024
+
+#define TS_META_RAP		0x01
+#define TS_META_DISPOSABLE	0x02
+#define TS_META_START		0x04	/* of a video PES */
+
+enum TS_LAG_POLICY {
+	TS_LAG_DROP = 0,	/* drop the oldest packets beyond the limit */
+	TS_LAG_SKIP,		/* drop everything queued, continue live */
+	TS_LAG_CLOSE,		/* disconnect the reader */
+	TS_LAG_GOP,		/* drop up to the next random access point */
+	TS_LAG_NONREF,		/* drop non-reference pictures, then as gop */
+	TS_LAG_BLOCK,		/* hold the stream until it catches up, then as gop */
+	TS_LAG_MAX
+};
+
+extern const char *ts_lag_policy_names[TS_LAG_MAX];
+
+struct ts_reader {
+	struct ts_reader *next;
+	unsigned int cursor, partial;
+	unsigned int pin;
+	int pinning : 1;
+	int overrun : 1;
+	int thinning : 1;	/* dropping non-reference pictures */
+	int dropping : 1;	/* in a video PES being dropped */
+	int cc_gap : 1;		/* video continuity broken by a dropped PES */
+	int resync : 1;		/* waiting for a random access point */
+	int policy;
+	unsigned int lag_limit;
+
+	/* sent before the data at the cursor: the rest of a partially sent
+	 * packet the cursor was moved past, or a prefix for a new reader */
+	unsigned int carry_off, carry_len;
+	unsigned char carry[TS_READER_CARRY];
+
+	unsigned int high_water;
+	unsigned long long overruns;
+	unsigned long long gop_skips, thinned;
+	unsigned long long blocked_us, block_timeouts;
+};
+
+struct ts_ring {
+	unsigned char *data;
+	unsigned char *meta;
+	int64_t *stamp;
+	unsigned int size, mask;
+	unsigned int head;
+	struct ts_reader *readers;
+	int video_pid;
+	int disposable;		/* the current video picture */
+
+	/* packets still pinned by pipes of readers that have detached */
+	unsigned int orphan_pin, orphan_end;
+	unsigned long long renewed, renew_errors;
+};
+
+int ts_ring_init(struct ts_ring *r, unsigned int kbytes);
+void ts_ring_free(struct ts_ring *r);
+
+/* 'lag_kb' of zero means as much as the ring allows */
+void ts_ring_attach(struct ts_ring *r, struct ts_reader *rd, unsigned int lag_kb, int policy, int pinning);
+void ts_ring_detach(struct ts_ring *r, struct ts_reader *rd);
+
+/* 'now_us' is the arrival time of the packets, CLOCK_MONOTONIC */
+void ts_ring_write(struct ts_ring *r, const struct iovec *iov, int ioc, int64_t now_us);
+
+/* End of the packets a reader has handed out, including a partly sent one */
+unsigned int ts_reader_sent_end(struct ts_reader *rd);
+
+/* Reader side: returns the number of contiguous packets at *ptr. The
+ * caller sends from *ptr + rd->partial and reports it with
+ * ts_reader_advance(). While thinning, the video PES of disposable
+ * pictures are stepped over whole and runs end before them. The next
+ * video packet kept is preceded by one flagging the discontinuity in
+ * its continuity counter: zero is returned with it in the carry, which
+ * goes out before anything else. */
+unsigned int ts_reader_peek(struct ts_ring *r, struct ts_reader *rd, unsigned char **ptr);
+void ts_reader_advance(struct ts_reader *rd, unsigned int bytes);
+void ts_reader_flush(struct ts_ring *r, struct ts_reader *rd);
+
+#define TS_DISC_INSERT		16		/* packets put in per batch */
+#define TS_DISC_US		5000000		/* to wait for each PID */
+
+struct mpeg_parser_buffer {
+	struct ts_ring *ring;
+	const struct ts_filter *filter;
+	struct ts_stats *stats;
+	struct ts_join *join;
+	struct hls *hls;
+	struct recorder *rec;
+	struct dvr *dvr;
+	struct ts_rebase *rebase;
+	int discontinuity;	/* flag a restart of the stream */
+	int flagging;		/* PIDs are left in disc_pids until disc_end_us */
+	int64_t disc_end_us;
+	uint64_t disc_pids[TS_PID_MAX / 64];
+	unsigned char disc_packets[TS_DISC_INSERT][0xbc];
+	int oldlen;
+	unsigned char olddata[0xbc];
+};
+
+/* 'data' must be preceded by 0xbc bytes of headroom where the partial
+ * packet left over from the previous buffer is prepended. */
+void mpegparser_parse(struct mpeg_parser_buffer *pb, unsigned char *data, int newlen);
+
+#endif